@@ -0,0 +1,446 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Authors: Costin Lupu <costin.lupu@cs.pub.ro>
+ *
+ * Copyright (c) 2022, University Politehnica of Bucharest. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <common/log.h>
+#include <common/cmdline.h>
+#include <common/time.h>
+#include <server-common.h>
+#include <children-pool.h>
+
+#define CHILDREN_POOL_POLL_MS   100
+
+
+static void children_pool_wake(struct children_pool *pool)
+{
+    char c = 0;
+
+    if (write(pool->wake[1], &c, 1) < 0 && errno != EAGAIN)
+        ERROR("Error waking up the pool thread errno=%d\n", errno);
+}
+
+/*
+ * Child side. Only system calls from here on: the child is forked from a
+ * multithreaded process and another thread may hold any lock.
+ */
+static void children_pool_child(struct children_pool *pool, int sock)
+{
+    char cmsg_buf[CMSG_SPACE(sizeof(int))], reply[32];
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    uint64_t start_ns, lat_ns;
+    char ready = 1;
+    int fd, len;
+
+    /* don't outlive the pool */
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != pool->parent)
+        _exit(0);
+
+#ifdef __NR_close_range
+    /* the listener, the other children's sockets and so on */
+    if (sock > 3)
+        syscall(__NR_close_range, 3, sock - 1, 0);
+    syscall(__NR_close_range, sock + 1, ~0U, 0);
+#else
+    close(pool->close_fd);
+#endif
+
+    if (write(sock, &ready, 1) != 1)
+        _exit(1);
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &start_ns;
+    iov.iov_len = sizeof(start_ns);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg_buf;
+    msg.msg_controllen = sizeof(cmsg_buf);
+
+    /* EOF: the pool is shutting down */
+    if (recvmsg(sock, &msg, 0) != sizeof(start_ns))
+        _exit(0);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS)
+        _exit(1);
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+
+    lat_ns = os_now_nsec() - start_ns;
+    if (write(sock, &lat_ns, sizeof(lat_ns)) != sizeof(lat_ns))
+        _exit(1);
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+    len = snprintf(reply, sizeof(reply), "child %d\n", getpid());
+    if (send(fd, reply, len, MSG_NOSIGNAL) != len)
+        _exit(1);
+    close(fd);
+
+    _exit(0);
+}
+
+static int children_pool_spawn(struct children_pool *pool,
+        struct children_pool_child *child)
+{
+    pid_t pid;
+    int sv[2], rc = 0;
+    char ready;
+
+    rc = socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv);
+    if (rc) {
+        rc = -errno;
+        ERROR("Error calling socketpair() errno=%d\n", errno);
+        goto out;
+    }
+
+    pid = fork();
+    if (pid == 0) {
+        close(sv[0]);
+        children_pool_child(pool, sv[1]);
+    }
+    close(sv[1]);
+    if (pid < 0) {
+        rc = -errno;
+        ERROR("Error calling fork() errno=%d\n", errno);
+        close(sv[0]);
+        goto out;
+    }
+
+    /* ready once it got rid of what it inherited */
+    if (read(sv[0], &ready, 1) != 1) {
+        ERROR("Child %d died before getting ready\n", pid);
+        close(sv[0]);
+        waitpid(pid, NULL, 0);
+        rc = -ECHILD;
+        goto out;
+    }
+
+    child->pid = pid;
+    child->sock = sv[0];
+    pool->forks++;
+out:
+    return rc;
+}
+
+/* Reads the latency a busy child reports, reaps the child on EOF */
+static void children_pool_collect(struct children_pool *pool, int sock)
+{
+    uint64_t lat_ns;
+    pid_t pid = -1;
+
+    if (read(sock, &lat_ns, sizeof(lat_ns)) == sizeof(lat_ns)) {
+        histogram_record(pool->lat, lat_ns);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    for (int i = 0; i < pool->busy_num; i++) {
+        if (pool->busy[i].sock == sock) {
+            pid = pool->busy[i].pid;
+            pool->busy[i] = pool->busy[--pool->busy_num];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    close(sock);
+    if (pid > 0)
+        waitpid(pid, NULL, 0);
+}
+
+/*
+ * Called by the pool thread on its way out: the children are killed when
+ * the thread that forked them exits, so it must outlive them all.
+ */
+static void children_pool_drain(struct children_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    /* nothing is dispatched once stopped, the lists are ours */
+    for (int i = 0; i < pool->ready_num; i++) {
+        /* idle children exit on EOF */
+        close(pool->ready[i].sock);
+        waitpid(pool->ready[i].pid, NULL, 0);
+    }
+    for (int i = 0; i < pool->busy_num; i++) {
+        /* busy ones once they replied */
+        waitpid(pool->busy[i].pid, NULL, 0);
+        close(pool->busy[i].sock);
+    }
+    pool->ready_num = pool->busy_num = 0;
+}
+
+static void *children_pool_thread(void *p)
+{
+    struct children_pool *pool = p;
+    struct children_pool_child child;
+    struct pollfd *pfds = NULL, *tmp;
+    int pfds_size = 0, missing, n, rc;
+    char buf[64];
+
+    while (!pool->stop) {
+        /* top up the pool */
+        pthread_mutex_lock(&pool->lock);
+        missing = pool->size - pool->ready_num;
+        pthread_mutex_unlock(&pool->lock);
+
+        while (missing-- > 0 && !pool->stop) {
+            rc = children_pool_spawn(pool, &child);
+            if (rc)
+                break;
+
+            pthread_mutex_lock(&pool->lock);
+            pool->ready[pool->ready_num++] = child;
+            pthread_cond_signal(&pool->cond);
+            pthread_mutex_unlock(&pool->lock);
+        }
+
+        /* wait for the busy children, or for a dispatch */
+        pthread_mutex_lock(&pool->lock);
+        n = pool->busy_num;
+        if (n + 1 > pfds_size) {
+            tmp = realloc(pfds, (n + 1) * sizeof(*pfds));
+            if (!tmp) {
+                pthread_mutex_unlock(&pool->lock);
+                ERROR("Error allocating poll fds\n");
+                break;
+            }
+            pfds = tmp;
+            pfds_size = n + 1;
+        }
+        pfds[0].fd = pool->wake[0];
+        pfds[0].events = POLLIN;
+        for (int i = 0; i < n; i++) {
+            pfds[i + 1].fd = pool->busy[i].sock;
+            pfds[i + 1].events = POLLIN;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        rc = poll(pfds, n + 1, CHILDREN_POOL_POLL_MS);
+        if (rc < 0 && errno != EINTR) {
+            ERROR("Error calling poll() errno=%d\n", errno);
+            break;
+        }
+        if (rc <= 0)
+            continue;
+
+        if (pfds[0].revents & POLLIN)
+            while (read(pool->wake[0], buf, sizeof(buf)) > 0)
+                ;
+        for (int i = 1; i <= n; i++)
+            if (pfds[i].revents)
+                children_pool_collect(pool, pfds[i].fd);
+    }
+
+    children_pool_drain(pool);
+    free(pfds);
+    return NULL;
+}
+
+int children_pool_init(struct children_pool *pool, int size, int close_fd)
+{
+    int rc = 0;
+
+    memset(pool, 0, sizeof(*pool));
+    pool->size = size;
+    pool->close_fd = close_fd;
+    pool->parent = getpid();
+    pool->wake[0] = pool->wake[1] = -1;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    pool->ready = calloc(size, sizeof(*pool->ready));
+    pool->busy_size = size;
+    pool->busy = calloc(pool->busy_size, sizeof(*pool->busy));
+    pool->lat = malloc(sizeof(*pool->lat));
+    if (!pool->ready || !pool->busy || !pool->lat) {
+        ERROR("Error allocating children pool\n");
+        rc = -ENOMEM;
+        goto out;
+    }
+    histogram_init(pool->lat);
+
+    rc = pipe2(pool->wake, O_NONBLOCK | O_CLOEXEC);
+    if (rc) {
+        rc = -errno;
+        ERROR("Error calling pipe2() errno=%d\n", errno);
+        goto out;
+    }
+
+    rc = pthread_create(&pool->thread, NULL, children_pool_thread, pool);
+    if (rc) {
+        ERROR("Error calling pthread_create() rc=%d\n", rc);
+        rc = -rc;
+        goto out;
+    }
+    pool->thread_started = 1;
+    pthread_setname_np(pool->thread, "children-pool");
+
+    INFO("Children pool of %d started\n", size);
+out:
+    if (rc)
+        children_pool_fini(pool);
+    return rc;
+}
+
+void children_pool_fini(struct children_pool *pool)
+{
+    if (pool->thread_started) {
+        pthread_mutex_lock(&pool->lock);
+        pool->stop = 1;
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+
+        /* the thread waits for the children before it exits */
+        children_pool_wake(pool);
+        pthread_join(pool->thread, NULL);
+        pool->thread_started = 0;
+    }
+
+    for (int i = 0; i < 2; i++)
+        if (pool->wake[i] >= 0)
+            close(pool->wake[i]);
+
+    free(pool->ready);
+    free(pool->busy);
+    free(pool->lat);
+    pool->ready = pool->busy = NULL;
+    pool->lat = NULL;
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+static int children_pool_send(int sock, int fd, uint64_t start_ns)
+{
+    char cmsg_buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    int rc;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(cmsg_buf, 0, sizeof(cmsg_buf));
+    iov.iov_base = &start_ns;
+    iov.iov_len = sizeof(start_ns);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg_buf;
+    msg.msg_controllen = sizeof(cmsg_buf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+
+    rc = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    if (rc < 0)
+        rc = -errno;
+    else
+        rc = 0;
+
+    return rc;
+}
+
+int children_pool_dispatch(struct children_pool *pool, int fd)
+{
+    struct children_pool_child child, *busy;
+    uint64_t start_ns;
+    int rc = 0;
+
+    start_ns = os_now_nsec();
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->ready_num && !pool->stop) {
+        /* the pool ran dry, the request waits for the next fork */
+        children_pool_wake(pool);
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+    if (pool->stop) {
+        pthread_mutex_unlock(&pool->lock);
+        rc = -ESHUTDOWN;
+        goto out;
+    }
+
+    child = pool->ready[--pool->ready_num];
+
+    if (pool->busy_num == pool->busy_size) {
+        busy = realloc(pool->busy, 2 * pool->busy_size * sizeof(*busy));
+        if (!busy) {
+            pool->ready[pool->ready_num++] = child;
+            pthread_mutex_unlock(&pool->lock);
+            rc = -ENOMEM;
+            goto out;
+        }
+        pool->busy = busy;
+        pool->busy_size *= 2;
+    }
+    pool->busy[pool->busy_num++] = child;
+    pthread_mutex_unlock(&pool->lock);
+
+    rc = children_pool_send(child.sock, fd, start_ns);
+    if (rc) {
+        ERROR("Error handing the connection to child %d rc=%d\n",
+            child.pid, rc);
+        /* reaped by the pool thread on EOF */
+        kill(child.pid, SIGKILL);
+    }
+    pool->requests++;
+
+    children_pool_wake(pool);
+out:
+    return rc;
+}
+
+void children_pool_print_stats(struct children_pool *pool)
+{
+    fprintf(stderr, "CHILDREN_TRACE pool=%d requests=%lu forks=%lu\n",
+        pool->size, pool->requests, pool->forks);
+    server_report_histogram(pool->lat, "children-pool-ready");
+}
@@ -0,0 +1,84 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Authors: Costin Lupu <costin.lupu@cs.pub.ro>
+ *
+ * Copyright (c) 2022, University Politehnica of Bucharest. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CHILDREN_POOL_H_
+#define CHILDREN_POOL_H_
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <common/histogram.h>
+
+/*
+ * Pre-forked children for the children app (-p K, Linux only).
+ *
+ * A background thread keeps K children parked on one end of a socketpair
+ * each. children_pool_dispatch() hands a connection to an idle child with
+ * SCM_RIGHTS, together with the time the request arrived. The child reports
+ * how long it took until it held the connection, replies with its pid and
+ * exits, while the thread forks a replacement and reaps the finished ones.
+ * The children die with the thread that forked them (PR_SET_PDEATHSIG), so
+ * the thread waits for all of them before it exits.
+ */
+
+struct children_pool_child {
+    pid_t pid;
+    int sock;
+};
+
+struct children_pool {
+    int size;
+    int close_fd;
+    pid_t parent;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct children_pool_child *ready;
+    int ready_num;
+    struct children_pool_child *busy;
+    int busy_num;
+    int busy_size;
+    int wake[2];
+    int thread_started;
+    volatile int stop;
+
+    /* request-to-child-ready latencies */
+    struct histogram *lat;
+    unsigned long requests;
+    unsigned long forks;
+};
+
+int children_pool_init(struct children_pool *pool, int size, int close_fd);
+void children_pool_fini(struct children_pool *pool);
+int children_pool_dispatch(struct children_pool *pool, int fd);
+void children_pool_print_stats(struct children_pool *pool);
+
+#endif /* CHILDREN_POOL_H_ */
@@ -30,17 +30,143 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <string.h>
+#include <common/cfg.h>
+#include <common/cmdline.h>
 #include <common/log.h>
+#include <common/boot.h>
 #include <common/time.h>
+#include <common/mem.h>
 #include <common/net.h>
 #include <common/clone.h>
 #include <server-common.h>
+#if CFG_CLONE_PROCESS
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#endif
+#if CFG_CHILDREN_POOL
+#include <signal.h>
+#include <children-pool.h>
+#endif
 
+struct children {
+    long result;
+    struct histogram clone_hist;
+#if CFG_CHILDREN_POOL
+    struct children_pool *pool;
+#endif
+};
+
+#if CFG_CHILDREN_POOL
+static struct tcp_server_loop *children_loop;
+
+static void children_signal_handler(int sig)
+{
+    (void) sig;
+    if (children_loop)
+        tcp_server_loop_stop(children_loop);
+}
+
+static int children_pool_start(struct children_pool *pool,
+        struct os_server *server)
+{
+    struct sigaction sa;
+    sigset_t set, old;
+    int rc;
+
+    /* no SA_RESTART: the loop sees EINTR and notices it has been stopped */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = children_signal_handler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    /* the replenisher thread inherits the mask, signals go to the loop */
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    rc = children_pool_init(pool, pool_size, server->listener_socket.s);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return rc;
+}
+#endif
+
+#if CFG_CLONE_PROCESS
+/*
+ * The clone is a process forked from inside the loop, so it leaves the
+ * parent's loop alone, answers the connection it was cloned for, like the
+ * pool children, and exits.
+ */
+static void children_serve_clone(struct tcp_server_loop *loop,
+        struct tcp_conn *conn)
+{
+    char reply[32];
+    int fd = conn->msg.connection, len;
+
+    tcp_server_loop_detach(loop, conn);
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+    len = snprintf(reply, sizeof(reply), "child %d\n", getpid());
+    if (send(fd, reply, len, MSG_NOSIGNAL) != len)
+        os_exit(1);
+    os_exit(0);
+}
+#endif
+
+static int children_conn_recv(struct tcp_server_loop *loop,
+        struct tcp_conn *conn)
+{
+    struct children *children = loop->priv;
+    uint64_t start_nsec;
+    int rc;
+
+    tcp_conn_consume(conn, conn->rx_len);
+
+#if CFG_CHILDREN_POOL
+    if (children->pool) {
+        /* the child owns its own copy of the connection from now on */
+        rc = children_pool_dispatch(children->pool, conn->msg.connection);
+        if (rc)
+            ERROR("Error children_pool_dispatch() rc=%d\n", rc);
+        return TCP_CONN_CLOSE;
+    }
+#endif
+
+    start_nsec = os_now_nsec();
+    rc = os_clone(1);
+    if (rc == 0)
+        histogram_record(&children->clone_hist, os_now_nsec() - start_nsec);
+    if (!(rc >= 0)) {
+        ERROR("Error myclone() rc=%d\n", rc);
+        children->result = rc;
+        tcp_server_loop_stop(loop);
+        return rc;
+    }
+#if CFG_CLONE_PROCESS
+    if (rc == 1)
+        children_serve_clone(loop, conn);
+#endif
+
+    return TCP_CONN_CLOSE;
+}
+
+static const struct tcp_server_loop_ops children_ops = {
+    .conn_recv = children_conn_recv,
+};
 
 void *thread_func_children(void *p)
 {
     struct os_server server;
-    struct net_msg msg;
+    struct tcp_server_loop loop;
+    static struct children children;
+    /* scratch buffers tagged dontfork or wipe are not copied to children */
+    static struct mem_regions regions;
+#if CFG_CHILDREN_POOL
+    struct children_pool pool;
+#endif
     long rc;
 
     (void) p;
@@ -51,53 +177,80 @@ void *thread_func_children(void *p)
         goto out;
     }
 
+    if (regions_str) {
+        rc = mem_regions_alloc(&regions, regions_str);
+        if (rc) {
+            ERROR("Could not allocate regions %s\n", regions_str);
+            goto out;
+        }
+
+        rc = mem_regions_touch(&regions);
+        if (rc) {
+            ERROR("Could not write on memory\n");
+            goto out_free_regions;
+        }
+        mem_regions_print(&regions);
+    }
+
     rc = tcp_server_start(&server, DEFAULT_SERVER_PORT);
     if (rc) {
         ERROR("Error tcp_server_start() rc=%ld\n", rc);
-        goto out;
+        goto out_free_regions;
     }
 
-    while (1) {
-        if (!tcp_server_started(&server)) {
-            /*
-             * if we don't have networking then we just sleep;
-             * we choose to do this so that we can use the same
-             * application in experiments without networking
-             */
-            os_sleep_msec(5000);
-            continue;
-        }
+    while (!tcp_server_started(&server)) {
+        /*
+         * if we don't have networking then we just sleep;
+         * we choose to do this so that we can use the same
+         * application in experiments without networking
+         */
+        os_sleep_msec(5000);
+    }
+
+    memset(&children, 0, sizeof(children));
+    histogram_init(&children.clone_hist);
+
+    rc = tcp_server_loop_init(&loop, &server, &children_ops, &children);
+    if (rc) {
+        ERROR("Error tcp_server_loop_init() rc=%ld\n", rc);
+        goto out_server_stop;
+    }
 
-        rc = tcp_server_accept(&server, &msg);
+#if CFG_CHILDREN_POOL
+    if (pool_size > 0) {
+        rc = children_pool_start(&pool, &server);
         if (rc) {
-            ERROR("Error tcp_server_accept() rc=%ld\n", rc);
-            goto out_server_stop;
+            ERROR("Error children_pool_start() rc=%ld\n", rc);
+            goto out_loop_fini;
         }
+        children.pool = &pool;
+        children_loop = &loop;
+    }
+#endif
 
-        rc = tcp_server_recv_msg(&msg);
-        if (rc == 0)
-            goto cleanup;
-        if (rc < 0) {
-            ERROR("Error tcp_server_recv_msg() rc=%ld\n", rc);
-            goto cleanup;
-        }
+    rc = tcp_server_loop_run(&loop);
+    if (rc)
+        ERROR("Error tcp_server_loop_run() rc=%ld\n", rc);
+    else
+        rc = children.result;
 
-        rc = os_clone(1);
-        if (!(rc >= 0)) {
-            ERROR("Error myclone() rc=%ld\n", rc);
-            goto out;
-        }
+    if (children.clone_hist.count)
+        server_report_histogram(&children.clone_hist, "clone");
 
-cleanup:
-        net_msg_cleanup(&msg);
-        if (rc < 0)
-            break;
+#if CFG_CHILDREN_POOL
+    if (children.pool) {
+        children_loop = NULL;
+        children_pool_print_stats(&pool);
+        children_pool_fini(&pool);
     }
-
+out_loop_fini:
+#endif
+    tcp_server_loop_fini(&loop);
 out_server_stop:
     tcp_server_stop(&server);
+out_free_regions:
+    mem_regions_free(&regions);
 out:
     INFO("Exiting\n");
     return (void *) rc;
 }
-
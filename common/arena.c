@@ -0,0 +1,117 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Authors: Costin Lupu <costin.lupu@cs.pub.ro>
+ *
+ * Copyright (c) 2022, University Politehnica of Bucharest. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <common/log.h>
+#include <common/mem.h>
+#include <common/arena.h>
+
+#define DIV_ROUND_UP(v, d) (((v) + (d)-1) / (d))
+#define ALIGN_UP(v, a) (((v) + (a)-1) & ~((a)-1))
+
+
+int arena_init(struct arena *a, size_t size)
+{
+    int rc;
+
+    memset(a, 0, sizeof(*a));
+
+    if (!os_page_size)
+        os_page_size = os_get_page_size();
+
+    a->pages_num = DIV_ROUND_UP(size, os_page_size);
+    rc = os_alloc_pages(a->pages_num, &a->start);
+    if (rc) {
+        ERROR("Could not allocate arena of %zu bytes rc=%d\n", size, rc);
+        a->start = NULL;
+        goto out;
+    }
+    a->size = a->pages_num * os_page_size;
+
+out:
+    return rc;
+}
+
+void arena_fini(struct arena *a)
+{
+    if (!a->start)
+        return;
+
+    if (a->live)
+        ERROR("Arena freed with %lu live allocations\n", a->live);
+
+    os_free_pages(a->start, a->pages_num);
+    a->start = NULL;
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+    size_t offset;
+
+    offset = ALIGN_UP(a->used, ARENA_ALIGN);
+    if (!a->start || size > a->size || offset > a->size - size) {
+        a->stats.misses++;
+        return NULL;
+    }
+
+    a->used = offset + size;
+    if (a->used > a->stats.high)
+        a->stats.high = a->used;
+    a->live++;
+    a->stats.allocs++;
+
+    return a->start + offset;
+}
+
+void arena_free(struct arena *a, void *p)
+{
+    (void) p;
+
+    if (a->live && !--a->live)
+        arena_reset(a);
+}
+
+void arena_reset(struct arena *a)
+{
+    /* the pages are kept, the next request writes over the same ones */
+    a->used = 0;
+    a->live = 0;
+    a->stats.resets++;
+}
+
+void arena_print_stats(struct arena *a, const char *name)
+{
+    OS_PRINT_ERR("ARENA_TRACE name=%s size=%zu high=%zu allocs=%lu "
+        "resets=%lu misses=%lu\n", name, a->size, a->stats.high,
+        a->stats.allocs, a->stats.resets, a->stats.misses);
+}
@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Authors: Costin Lupu <costin.lupu@cs.pub.ro>
+ *
+ * Copyright (c) 2022, University Politehnica of Bucharest. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef APP_COMMON_ARENA_H_
+#define APP_COMMON_ARENA_H_
+
+#include <stddef.h>
+
+/*
+ * Bump-pointer arena for request-scoped buffers.
+ *
+ * The arena is one page-aligned region from os_alloc_pages(), so its users
+ * never grow or fragment the heap, and its pages are only written once they
+ * are handed out: after a fork they stay shared until a request of the child
+ * writes them. arena_alloc() bumps a pointer and arena_free() only counts
+ * the live allocations; the arena rewinds once none is left, i.e. at the end
+ * of every request, or explicitly with arena_reset(). An arena is not
+ * thread-safe. When it is full arena_alloc() returns NULL and the caller
+ * falls back to the heap, which is accounted as a miss.
+ */
+
+#define ARENA_ALIGN     64
+
+struct arena_stats {
+    unsigned long allocs;
+    unsigned long resets;
+    unsigned long misses;
+    size_t high;
+};
+
+struct arena {
+    char *start;
+    unsigned long pages_num;
+    size_t size;
+    size_t used;
+    unsigned long live;
+    struct arena_stats stats;
+};
+
+int arena_init(struct arena *a, size_t size);
+void arena_fini(struct arena *a);
+
+void *arena_alloc(struct arena *a, size_t size);
+void arena_free(struct arena *a, void *p);
+void arena_reset(struct arena *a);
+
+static inline int arena_owns(struct arena *a, const void *p)
+{
+    return a->start && (const char *) p >= a->start &&
+        (const char *) p < a->start + a->size;
+}
+
+void arena_print_stats(struct arena *a, const char *name);
+
+#endif /* APP_COMMON_ARENA_H_ */
@@ -39,7 +39,7 @@
 #include <common/net.h>
 #endif
 
-#ifdef __MINIOS__
+#if defined(__MINIOS__) || CFG_NUMA
 int os_app_init(void);
 #else
 #define os_app_init() 0
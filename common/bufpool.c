@@ -0,0 +1,304 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Authors: Costin Lupu <costin.lupu@cs.pub.ro>
+ *
+ * Copyright (c) 2022, University Politehnica of Bucharest. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __MINIOS__
+#include <mini-os/xmalloc.h>
+#else
+#include <stdlib.h>
+#endif
+#include <string.h>
+#include <errno.h>
+#include <common/log.h>
+#include <common/mem.h>
+#include <common/bufpool.h>
+
+#ifdef __MINIOS__
+#define __thread
+#endif
+
+#define DIV_ROUND_UP(v, d) (((v) + (d)-1) / (d))
+
+/*
+ * Buffers are identified by their 1-based index so that 0 terminates a list.
+ * The global freelist head packs a modification tag in the upper 32 bits,
+ * which is bumped by every update and protects the CAS against ABA.
+ */
+#define HEAD_IDX(h)             ((unsigned int) ((h) & 0xffffffffUL))
+#define HEAD_TAG(h)             ((h) >> 32)
+#define HEAD_MAKE(tag, idx)     (((tag) << 32) | (idx))
+
+struct bufpool {
+    char *start;
+    unsigned long pages_num;
+    unsigned int buf_size;
+    unsigned int buf_count;
+    unsigned int *next;
+    struct bufpool_stats stats;
+    unsigned long head __attribute__((aligned(64)));
+};
+
+struct bufpool_cache {
+    unsigned int head;
+    unsigned int count;
+    struct bufpool_stats stats;
+};
+
+static struct bufpool pool;
+static __thread struct bufpool_cache cache;
+
+
+static inline unsigned int next_get(unsigned int idx)
+{
+    return __atomic_load_n(&pool.next[idx - 1], __ATOMIC_RELAXED);
+}
+
+static inline void next_set(unsigned int idx, unsigned int next)
+{
+    __atomic_store_n(&pool.next[idx - 1], next, __ATOMIC_RELAXED);
+}
+
+static void global_push(unsigned int first, unsigned int last)
+{
+    unsigned long old, new;
+
+    old = __atomic_load_n(&pool.head, __ATOMIC_ACQUIRE);
+    do {
+        next_set(last, HEAD_IDX(old));
+        new = HEAD_MAKE(HEAD_TAG(old) + 1, first);
+    } while (!__atomic_compare_exchange_n(&pool.head, &old, new, 1,
+                __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+/* Pops up to max buffers in one go, returns the first one of the list */
+static unsigned int global_pop(unsigned int max, unsigned int *pcount)
+{
+    unsigned long old, new;
+    unsigned int first, last, next, count;
+
+    old = __atomic_load_n(&pool.head, __ATOMIC_ACQUIRE);
+    do {
+        first = HEAD_IDX(old);
+        if (!first) {
+            count = 0;
+            goto out;
+        }
+
+        /*
+         * The list may change under our feet, in which case the tag changed
+         * as well and the CAS below fails; just don't walk out of bounds.
+         */
+        last = first;
+        for (count = 1; count < max; count++) {
+            next = next_get(last);
+            if (!next || next > pool.buf_count)
+                break;
+            last = next;
+        }
+        next = next_get(last);
+        new = HEAD_MAKE(HEAD_TAG(old) + 1, next);
+    } while (!__atomic_compare_exchange_n(&pool.head, &old, new, 1,
+                __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    next_set(last, 0);
+out:
+    *pcount = count;
+    return first;
+}
+
+static void cache_fold_stats(void)
+{
+    __atomic_fetch_add(&pool.stats.hits, cache.stats.hits, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&pool.stats.refills, cache.stats.refills,
+            __ATOMIC_RELAXED);
+    __atomic_fetch_add(&pool.stats.misses, cache.stats.misses,
+            __ATOMIC_RELAXED);
+    memset(&cache.stats, 0, sizeof(cache.stats));
+}
+
+int bufpool_init(unsigned int buf_size, unsigned int buf_count)
+{
+    int rc = 0;
+
+    if (pool.start) {
+        rc = -EBUSY;
+        goto out;
+    }
+    if (!buf_count)
+        /* pool disabled, all buffers come from the heap */
+        goto out;
+    if (buf_size < 64) {
+        rc = -EINVAL;
+        goto out;
+    }
+
+    if (!os_page_size)
+        os_page_size = os_get_page_size();
+
+    buf_size = DIV_ROUND_UP(buf_size, 64) * 64;
+    pool.pages_num = DIV_ROUND_UP((unsigned long) buf_size * buf_count,
+            os_page_size);
+
+    pool.next = malloc(buf_count * sizeof(*pool.next));
+    if (!pool.next) {
+        rc = -ENOMEM;
+        goto out;
+    }
+
+    rc = os_alloc_pages(pool.pages_num, &pool.start);
+    if (rc) {
+        ERROR("Could not allocate %u buffers of %u bytes rc=%d\n",
+            buf_count, buf_size, rc);
+        free(pool.next);
+        pool.next = NULL;
+        pool.start = NULL;
+        goto out;
+    }
+
+    pool.buf_size = buf_size;
+    pool.buf_count = buf_count;
+    for (unsigned int i = 1; i < buf_count; i++)
+        pool.next[i - 1] = i + 1;
+    pool.next[buf_count - 1] = 0;
+    pool.head = HEAD_MAKE(0UL, 1);
+
+out:
+    return rc;
+}
+
+void bufpool_fini(void)
+{
+    if (!pool.start)
+        return;
+
+    os_free_pages(pool.start, pool.pages_num);
+    free(pool.next);
+    memset(&pool, 0, sizeof(pool));
+    memset(&cache, 0, sizeof(cache));
+}
+
+void *bufpool_get(void)
+{
+    unsigned int idx, count;
+    void *buf = NULL;
+
+    if (!pool.start)
+        goto out;
+
+    if (!cache.count) {
+        idx = global_pop(BUFPOOL_BATCH, &count);
+        if (!idx) {
+            cache.stats.misses++;
+            goto out;
+        }
+        cache.head = idx;
+        cache.count = count;
+        cache.stats.refills++;
+    }
+
+    idx = cache.head;
+    cache.head = next_get(idx);
+    cache.count--;
+    cache.stats.hits++;
+
+    buf = pool.start + (unsigned long) (idx - 1) * pool.buf_size;
+out:
+    return buf;
+}
+
+void bufpool_put(void *buf)
+{
+    unsigned int idx, first, last;
+
+    idx = ((char *) buf - pool.start) / pool.buf_size + 1;
+    next_set(idx, cache.head);
+    cache.head = idx;
+    cache.count++;
+
+    if (cache.count >= 2 * BUFPOOL_BATCH) {
+        /* give a batch back so that other threads can have it */
+        first = last = cache.head;
+        for (int i = 1; i < BUFPOOL_BATCH; i++)
+            last = next_get(last);
+        cache.head = next_get(last);
+        cache.count -= BUFPOOL_BATCH;
+        global_push(first, last);
+    }
+}
+
+int bufpool_owns(void *buf)
+{
+    char *p = buf;
+
+    return pool.start && p >= pool.start &&
+        p < pool.start + (unsigned long) pool.buf_size * pool.buf_count;
+}
+
+unsigned int bufpool_buf_size(void)
+{
+    return pool.buf_size;
+}
+
+void bufpool_thread_flush(void)
+{
+    unsigned int last;
+
+    if (cache.count) {
+        last = cache.head;
+        while (next_get(last))
+            last = next_get(last);
+        global_push(cache.head, last);
+        cache.head = 0;
+        cache.count = 0;
+    }
+
+    cache_fold_stats();
+}
+
+void bufpool_get_stats(struct bufpool_stats *stats)
+{
+    cache_fold_stats();
+
+    stats->hits = __atomic_load_n(&pool.stats.hits, __ATOMIC_RELAXED);
+    stats->refills = __atomic_load_n(&pool.stats.refills, __ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&pool.stats.misses, __ATOMIC_RELAXED);
+}
+
+void bufpool_print_stats(void)
+{
+    struct bufpool_stats stats;
+
+    bufpool_get_stats(&stats);
+
+    OS_PRINT_ERR("BUFPOOL_TRACE size=%u count=%u hits=%lu refills=%lu "
+        "misses=%lu\n", pool.buf_size, pool.buf_count,
+        stats.hits, stats.refills, stats.misses);
+}
@@ -0,0 +1,72 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Authors: Costin Lupu <costin.lupu@cs.pub.ro>
+ *
+ * Copyright (c) 2022, University Politehnica of Bucharest. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef APP_COMMON_BUFPOOL_H_
+#define APP_COMMON_BUFPOOL_H_
+
+/*
+ * Fixed-size buffer pool backing the net_msg buffers.
+ *
+ * All buffers are carved out of one region allocated at init time. Each
+ * thread keeps a private freelist that serves bufpool_get()/bufpool_put()
+ * without any synchronization; it is refilled from (and spills back to) a
+ * global lock-free freelist in batches of BUFPOOL_BATCH buffers. When the
+ * pool is exhausted bufpool_get() returns NULL and the caller falls back to
+ * the heap, which is accounted as a miss.
+ */
+
+#define BUFPOOL_BATCH               32
+
+#define BUFPOOL_DEFAULT_BUF_SIZE    4096
+#define BUFPOOL_DEFAULT_BUF_COUNT   1024
+
+struct bufpool_stats {
+    unsigned long hits;
+    unsigned long refills;
+    unsigned long misses;
+};
+
+int bufpool_init(unsigned int buf_size, unsigned int buf_count);
+void bufpool_fini(void);
+
+void *bufpool_get(void);
+void bufpool_put(void *buf);
+int bufpool_owns(void *buf);
+unsigned int bufpool_buf_size(void);
+
+/* Returns the cached buffers and the counters of the calling thread */
+void bufpool_thread_flush(void);
+
+void bufpool_get_stats(struct bufpool_stats *stats);
+void bufpool_print_stats(void);
+
+#endif /* APP_COMMON_BUFPOOL_H_ */
@@ -37,15 +37,49 @@
 #include <uk/config.h>
 
 #define CFG_NETWORK CONFIG_LIBLWIP
+#define CFG_NET_EPOLL 0
+#define CFG_SERVER_WORKERS 0
+#define CFG_NET_MMSG 0
+#define CFG_NET_URING 0
+#define CFG_CHILDREN_POOL 0
+#define CFG_PERF_COUNTERS 0
+#define CFG_MEM_TOUCH_THREADS 0
+#define CFG_NUMA 0
+#define CFG_LAZY_CLONE 0
+#define CFG_MEM_ACCOUNT 0
+#define CFG_CLONE_PROCESS 0
 
 #else
 
 #ifdef __MINIOS__
 #define CFG_NETWORK 1
+#define CFG_NET_EPOLL 0
+#define CFG_SERVER_WORKERS 0
+#define CFG_NET_MMSG 0
+#define CFG_NET_URING 0
+#define CFG_CHILDREN_POOL 0
+#define CFG_PERF_COUNTERS 0
+#define CFG_MEM_TOUCH_THREADS 0
+#define CFG_NUMA 0
+#define CFG_LAZY_CLONE 0
+#define CFG_MEM_ACCOUNT 0
+#define CFG_CLONE_PROCESS 0
 
 #else
 /* Posix */
 #define CFG_NETWORK 1
+#define CFG_NET_EPOLL 1
+#define CFG_SERVER_WORKERS 1
+#define CFG_NET_MMSG 1
+#define CFG_NET_URING 1
+#define CFG_CHILDREN_POOL 1
+#define CFG_PERF_COUNTERS 1
+#define CFG_MEM_TOUCH_THREADS 1
+#define CFG_NUMA 1
+#define CFG_LAZY_CLONE 1
+#define CFG_MEM_ACCOUNT 1
+/* os_clone() children share the parent's file descriptions */
+#define CFG_CLONE_PROCESS 1
 
 #endif /* __MINIOS__ */
 
@@ -36,4 +36,12 @@
 int os_clone(unsigned int nr_children);
 unsigned int os_get_self_id(void);
 
+/*
+ * The region lazy clones (-X lazy) get as a snapshot faulted in on demand
+ * rather than as a copy of the parent's page tables. Linux only, one
+ * region at a time.
+ */
+int os_clone_region_alloc(unsigned long pages_num, char **pstart);
+int os_clone_region_free(char *start, unsigned long pages_num);
+
 #endif /* APP_COMMON_CLONE_H_ */
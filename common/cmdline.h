@@ -34,6 +34,24 @@
 #define APP_COMMON_CMDLINE_H_
 
 #include <apps.h>
+#include <common/mem.h>
+
+enum fork_mode {
+    FORK_MODE_LINEAR,
+    FORK_MODE_TREE,
+    FORK_MODE_HELPER,
+};
+
+enum clone_mode {
+    CLONE_MODE_FORK,
+    CLONE_MODE_LAZY,
+};
+
+enum touch_mode {
+    TOUCH_MODE_WORD,
+    TOUCH_MODE_FILL,
+    TOUCH_MODE_NT,
+};
 
 extern enum app app;
 extern int do_send_time;
@@ -42,9 +60,34 @@ extern int do_clone;
 extern int children_num;
 extern int sleep_between_clones_msec;
 extern char *memory_str;
+extern int workers_num;
+extern int do_echo;
+extern int netbuf_size;
+extern int netbuf_count;
+extern int do_io_uring;
+extern int do_bench;
+extern int pool_size;
+extern enum fork_mode fork_mode;
+extern int fork_fanout;
+extern enum clone_mode clone_mode;
+extern enum touch_mode touch_mode;
+extern int touch_threads;
+extern enum page_mode page_mode;
+extern char *regions_str;
+extern char *numa_str;
+extern char *cpus_str;
+extern char *hist_dump_prefix;
+extern char *trace_json_prefix;
 
 int os_parse_args(int argc, char **argv);
 
 void print_usage(char *cmd);
+int string_to_fork_mode(const char *s, enum fork_mode *mode);
+const char *fork_mode_to_string(enum fork_mode mode);
+int string_to_clone_mode(const char *s, enum clone_mode *mode);
+const char *clone_mode_to_string(enum clone_mode mode);
+int string_to_touch_mode(const char *s, enum touch_mode *mode);
+int string_to_page_mode(const char *s, enum page_mode *mode);
+const char *page_mode_to_string(enum page_mode mode);
 
 #endif /* APP_COMMON_CMDLINE_H_ */
@@ -0,0 +1,253 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Authors: Costin Lupu <costin.lupu@cs.pub.ro>
+ *
+ * Copyright (c) 2022, University Politehnica of Bucharest. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <common/log.h>
+#include <common/histogram.h>
+
+#define HISTOGRAM_MAGIC     0x54534948 /* "HIST" */
+#define HISTOGRAM_VERSION   1
+
+
+static inline unsigned int bucket_of(uint64_t v)
+{
+    unsigned int shift;
+
+    if (v >= (1ULL << HISTOGRAM_MAX_BITS))
+        v = (1ULL << HISTOGRAM_MAX_BITS) - 1;
+    if (v < 2 * HISTOGRAM_HALF)
+        return v;
+
+    /* keep the HISTOGRAM_SUB_BITS most significant bits */
+    shift = 63 - __builtin_clzll(v) - HISTOGRAM_SUB_BITS + 1;
+    return shift * HISTOGRAM_HALF + (v >> shift);
+}
+
+/* The highest value which lands in bucket b */
+static inline uint64_t bucket_top(unsigned int b)
+{
+    unsigned int shift;
+
+    if (b < 2 * HISTOGRAM_HALF)
+        return b;
+
+    shift = b / HISTOGRAM_HALF - 1;
+    return (((uint64_t) (b - shift * HISTOGRAM_HALF) + 1) << shift) - 1;
+}
+
+void histogram_init(struct histogram *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+void histogram_record(struct histogram *h, uint64_t value)
+{
+    h->buckets[bucket_of(value)]++;
+    h->count++;
+    h->sum += value;
+    if (value < h->min)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+}
+
+void histogram_merge(struct histogram *dst, const struct histogram *src)
+{
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+uint64_t histogram_percentile(const struct histogram *h, double p)
+{
+    uint64_t rank, seen = 0, v;
+
+    if (!h->count)
+        return 0;
+
+    rank = (uint64_t) (p / 100 * h->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            v = bucket_top(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+void histogram_print(const struct histogram *h, const char *name)
+{
+    if (!h->count) {
+        fprintf(stderr, "HIST_TRACE name=%s count=0\n", name);
+        return;
+    }
+
+    fprintf(stderr, "HIST_TRACE name=%s count=%llu unit=us min=%.3lf "
+        "mean=%.3lf p50=%.3lf p90=%.3lf p99=%.3lf p99.9=%.3lf max=%.3lf\n",
+        name, (unsigned long long) h->count, h->min / 1e3,
+        (double) h->sum / h->count / 1e3,
+        histogram_percentile(h, 50) / 1e3,
+        histogram_percentile(h, 90) / 1e3,
+        histogram_percentile(h, 99) / 1e3,
+        histogram_percentile(h, 99.9) / 1e3,
+        h->max / 1e3);
+}
+
+static int put_le(FILE *f, uint64_t v, int bytes)
+{
+    unsigned char b[8];
+
+    for (int i = 0; i < bytes; i++)
+        b[i] = v >> (8 * i);
+
+    return fwrite(b, bytes, 1, f) == 1 ? 0 : -EIO;
+}
+
+static int get_le(FILE *f, uint64_t *v, int bytes)
+{
+    unsigned char b[8];
+
+    if (fread(b, bytes, 1, f) != 1)
+        return -EIO;
+
+    *v = 0;
+    for (int i = 0; i < bytes; i++)
+        *v |= (uint64_t) b[i] << (8 * i);
+
+    return 0;
+}
+
+int histogram_dump(const struct histogram *h, const char *path)
+{
+    unsigned int pairs = 0;
+    FILE *f;
+    int rc = 0;
+
+    f = fopen(path, "wb");
+    if (!f) {
+        rc = -errno;
+        ERROR("Error opening %s errno=%d\n", path, errno);
+        goto out;
+    }
+
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        pairs += !!h->buckets[i];
+
+    rc |= put_le(f, HISTOGRAM_MAGIC, 4);
+    rc |= put_le(f, HISTOGRAM_VERSION, 4);
+    rc |= put_le(f, HISTOGRAM_SUB_BITS, 4);
+    rc |= put_le(f, HISTOGRAM_MAX_BITS, 4);
+    rc |= put_le(f, h->count, 8);
+    rc |= put_le(f, h->min, 8);
+    rc |= put_le(f, h->max, 8);
+    rc |= put_le(f, h->sum, 8);
+    rc |= put_le(f, pairs, 4);
+
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS && !rc; i++) {
+        if (!h->buckets[i])
+            continue;
+        rc |= put_le(f, i, 4);
+        rc |= put_le(f, h->buckets[i], 8);
+    }
+
+    if (fclose(f) && !rc)
+        rc = -EIO;
+    if (rc)
+        ERROR("Error writing %s\n", path);
+out:
+    return rc;
+}
+
+int histogram_load(struct histogram *h, const char *path)
+{
+    uint64_t magic = 0, version = 0, sub_bits = 0, max_bits = 0;
+    uint64_t pairs = 0, idx = 0, count = 0;
+    FILE *f;
+    int rc = 0;
+
+    histogram_init(h);
+
+    f = fopen(path, "rb");
+    if (!f) {
+        rc = -errno;
+        ERROR("Error opening %s errno=%d\n", path, errno);
+        goto out;
+    }
+
+    rc |= get_le(f, &magic, 4);
+    rc |= get_le(f, &version, 4);
+    rc |= get_le(f, &sub_bits, 4);
+    rc |= get_le(f, &max_bits, 4);
+    if (rc || magic != HISTOGRAM_MAGIC || version != HISTOGRAM_VERSION ||
+            sub_bits != HISTOGRAM_SUB_BITS || max_bits != HISTOGRAM_MAX_BITS) {
+        ERROR("%s is not a compatible histogram dump\n", path);
+        rc = -EINVAL;
+        goto out_close;
+    }
+
+    rc |= get_le(f, &h->count, 8);
+    rc |= get_le(f, &h->min, 8);
+    rc |= get_le(f, &h->max, 8);
+    rc |= get_le(f, &h->sum, 8);
+    rc |= get_le(f, &pairs, 4);
+
+    for (uint64_t i = 0; i < pairs && !rc; i++) {
+        rc |= get_le(f, &idx, 4);
+        rc |= get_le(f, &count, 8);
+        if (!rc && idx >= HISTOGRAM_BUCKETS)
+            rc = -EINVAL;
+        if (!rc)
+            h->buckets[idx] = count;
+    }
+    if (rc) {
+        ERROR("%s is truncated or corrupt\n", path);
+        histogram_init(h);
+    }
+
+out_close:
+    fclose(f);
+out:
+    return rc;
+}
@@ -0,0 +1,85 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Authors: Costin Lupu <costin.lupu@cs.pub.ro>
+ *
+ * Copyright (c) 2022, University Politehnica of Bucharest. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef APP_COMMON_HISTOGRAM_H_
+#define APP_COMMON_HISTOGRAM_H_
+
+#include <stdint.h>
+
+/*
+ * Log-linear latency histogram, HDR style.
+ *
+ * Values below 2^HISTOGRAM_SUB_BITS land in buckets of their own; above
+ * that every power of two is split into 2^(HISTOGRAM_SUB_BITS - 1) linear
+ * buckets, so any recorded value is off by less than 1/64 (~1.6%) whatever
+ * its magnitude. Values are meant to be nanoseconds and are clamped to
+ * 2^HISTOGRAM_MAX_BITS (~78 hours).
+ *
+ * Histograms with the same layout merge by adding up their buckets, which
+ * is what the binary dump is for: dumps of several runs or machines can be
+ * loaded and merged (see hist-merge) and still yield exact percentiles.
+ */
+
+#define HISTOGRAM_SUB_BITS      7
+#define HISTOGRAM_MAX_BITS      48
+#define HISTOGRAM_HALF          (1U << (HISTOGRAM_SUB_BITS - 1))
+#define HISTOGRAM_BUCKETS \
+    ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 2) * HISTOGRAM_HALF)
+
+struct histogram {
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+void histogram_init(struct histogram *h);
+void histogram_record(struct histogram *h, uint64_t value);
+void histogram_merge(struct histogram *dst, const struct histogram *src);
+
+/* Highest value equivalent to the p-th percentile, p in [0, 100] */
+uint64_t histogram_percentile(const struct histogram *h, double p);
+
+/* HIST_TRACE line: count, min, mean, p50/p90/p99/p99.9 and max in usecs */
+void histogram_print(const struct histogram *h, const char *name);
+
+/*
+ * Dump format, all integers little endian:
+ *   u32 magic "HIST", u32 version, u32 sub bits, u32 max bits,
+ *   u64 count, u64 min, u64 max, u64 sum, u32 number of pairs,
+ *   then (u32 bucket, u64 count) for each non-empty bucket.
+ */
+int histogram_dump(const struct histogram *h, const char *path);
+int histogram_load(struct histogram *h, const char *path);
+
+#endif /* APP_COMMON_HISTOGRAM_H_ */
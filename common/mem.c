@@ -30,71 +30,455 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <common/cfg.h>
+#if CFG_MEM_TOUCH_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 #include <common/log.h>
 #include <common/cmdline.h>
 #include <common/time.h>
 #include <common/mem.h>
+#include <common/tsc.h>
+
+/* below this many pages per thread the thread start-up dominates */
+#define TOUCH_MIN_PAGES_PER_THREAD  1024
 
 unsigned long os_page_size;
 
+/*
+ * Page i holds the value i: in its first word for TOUCH_MODE_WORD, in all
+ * its words for the fill modes, so every mode passes the same first-word
+ * check other code may rely on.
+ */
+struct touch_ops {
+    void (*write)(char *page, unsigned long v);
+    int (*verify)(const char *page, unsigned long v);
+};
+
+static void touch_word_write(char *page, unsigned long v)
+{
+    *((unsigned long *) page) = v;
+}
+
+static int touch_word_verify(const char *page, unsigned long v)
+{
+    return *((const unsigned long *) page) == v;
+}
+
+static void touch_fill_write(char *page, unsigned long v)
+{
+    unsigned long *w = (unsigned long *) page;
+
+    for (unsigned long k = 0; k < os_page_size / sizeof(*w); k++)
+        w[k] = v;
+}
+
+static int touch_fill_verify(const char *page, unsigned long v)
+{
+    const unsigned long *w = (const unsigned long *) page;
+    unsigned long diff = 0;
+
+    /* no early exit, so the loop vectorizes */
+    for (unsigned long k = 0; k < os_page_size / sizeof(*w); k++)
+        diff |= w[k] ^ v;
+
+    return !diff;
+}
+
+#ifdef __x86_64__
+static inline void touch_cpuid(uint32_t leaf, uint32_t *a, uint32_t *b,
+        uint32_t *c, uint32_t *d)
+{
+    __asm__ __volatile__("cpuid"
+        : "=a" (*a), "=b" (*b), "=c" (*c), "=d" (*d)
+        : "a" (leaf), "c" (0));
+}
+
+static int touch_has_avx2(void)
+{
+    uint32_t a, b, c, d, xcr0_lo, xcr0_hi;
+
+    touch_cpuid(0, &a, &b, &c, &d);
+    if (a < 7)
+        return 0;
+
+    /* AVX needs OSXSAVE and the OS saving the YMM state */
+    touch_cpuid(1, &a, &b, &c, &d);
+    if ((c & ((1U << 27) | (1U << 28))) != ((1U << 27) | (1U << 28)))
+        return 0;
+
+    __asm__ __volatile__("xgetbv"
+        : "=a" (xcr0_lo), "=d" (xcr0_hi)
+        : "c" (0));
+    if ((xcr0_lo & 0x6) != 0x6)
+        return 0;
+
+    touch_cpuid(7, &a, &b, &c, &d);
+    return !!(b & (1U << 5));
+}
+
+/* SSE2 is part of x86_64, no check needed */
+static void touch_nt_sse2_write(char *page, unsigned long v)
+{
+    __m128i x = _mm_set1_epi64x(v);
+
+    for (unsigned long off = 0; off < os_page_size; off += 64) {
+        _mm_stream_si128((__m128i *) (page + off), x);
+        _mm_stream_si128((__m128i *) (page + off + 16), x);
+        _mm_stream_si128((__m128i *) (page + off + 32), x);
+        _mm_stream_si128((__m128i *) (page + off + 48), x);
+    }
+}
+
+static int touch_sse2_verify(const char *page, unsigned long v)
+{
+    __m128i x = _mm_set1_epi64x(v), diff = _mm_setzero_si128();
+
+    for (unsigned long off = 0; off < os_page_size; off += 64) {
+        diff = _mm_or_si128(diff, _mm_xor_si128(x,
+            _mm_load_si128((const __m128i *) (page + off))));
+        diff = _mm_or_si128(diff, _mm_xor_si128(x,
+            _mm_load_si128((const __m128i *) (page + off + 16))));
+        diff = _mm_or_si128(diff, _mm_xor_si128(x,
+            _mm_load_si128((const __m128i *) (page + off + 32))));
+        diff = _mm_or_si128(diff, _mm_xor_si128(x,
+            _mm_load_si128((const __m128i *) (page + off + 48))));
+    }
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(diff,
+        _mm_setzero_si128())) == 0xffff;
+}
+
+__attribute__((target("avx2")))
+static void touch_nt_avx2_write(char *page, unsigned long v)
+{
+    __m256i y = _mm256_set1_epi64x(v);
+
+    for (unsigned long off = 0; off < os_page_size; off += 64) {
+        _mm256_stream_si256((__m256i *) (page + off), y);
+        _mm256_stream_si256((__m256i *) (page + off + 32), y);
+    }
+}
+
+__attribute__((target("avx2")))
+static int touch_avx2_verify(const char *page, unsigned long v)
+{
+    __m256i y = _mm256_set1_epi64x(v), diff = _mm256_setzero_si256();
+
+    for (unsigned long off = 0; off < os_page_size; off += 64) {
+        diff = _mm256_or_si256(diff, _mm256_xor_si256(y,
+            _mm256_load_si256((const __m256i *) (page + off))));
+        diff = _mm256_or_si256(diff, _mm256_xor_si256(y,
+            _mm256_load_si256((const __m256i *) (page + off + 32))));
+    }
+
+    return _mm256_testz_si256(diff, diff);
+}
+#endif /* __x86_64__ */
+
+static void touch_ops_select(struct touch_ops *ops)
+{
+    ops->write = touch_word_write;
+    ops->verify = touch_word_verify;
+
+    if (touch_mode == TOUCH_MODE_WORD)
+        return;
+
+    ops->write = touch_fill_write;
+    ops->verify = touch_fill_verify;
+
+#ifdef __x86_64__
+    if (touch_has_avx2()) {
+        ops->verify = touch_avx2_verify;
+        if (touch_mode == TOUCH_MODE_NT)
+            ops->write = touch_nt_avx2_write;
+    } else {
+        ops->verify = touch_sse2_verify;
+        if (touch_mode == TOUCH_MODE_NT)
+            ops->write = touch_nt_sse2_write;
+    }
+#endif
+}
+
+struct touch_work {
+    char *start;
+    unsigned long first;
+    unsigned long num;
+    const struct touch_ops *ops;
+    /* shared by all the works of one mem_touch_pages() call */
+    int *writers;
+    uint64_t *ns_after;
+    int rc;
+};
+
+static void *touch_worker(void *arg)
+{
+    struct touch_work *w = arg;
+    unsigned long i;
+    char *p;
+
+    for (i = w->first; i < w->first + w->num; i++)
+        w->ops->write(w->start + i * os_page_size, i);
+
+#ifdef __x86_64__
+    /* non-temporal stores are weakly ordered */
+    _mm_sfence();
+#endif
+
+    /* the last writer done stops the clock, verifying is not timed */
+    if (__atomic_sub_fetch(w->writers, 1, __ATOMIC_ACQ_REL) == 0 &&
+            w->ns_after)
+        *w->ns_after = tsc_now_nsec();
+
+    w->rc = 0;
+    for (i = w->first; i < w->first + w->num; i++) {
+        p = w->start + i * os_page_size;
+
+        if (!w->ops->verify(p, i)) {
+            DEBUG("Mismatch on page %lu: found %lu expected %lu\n",
+                i, *((unsigned long *) p), i);
+            w->rc = -1;
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static int touch_threads_num(unsigned long pages_num)
+{
+    long threads_num = 1;
+
+#if CFG_MEM_TOUCH_THREADS
+    threads_num = touch_threads;
+    if (threads_num == 0)
+        threads_num = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads_num > (long) (pages_num / TOUCH_MIN_PAGES_PER_THREAD))
+        threads_num = pages_num / TOUCH_MIN_PAGES_PER_THREAD;
+    if (threads_num < 1)
+        threads_num = 1;
+#else
+    (void) pages_num;
+#endif
+
+    return threads_num;
+}
+
 int mem_touch_pages(char *start, unsigned long pages_num,
         struct timeval *duration)
 {
-    char *p;
-    struct timeval tv_before, tv_after;
-    struct timespec ts_before, ts_after;
-    int rc = 0;
+    struct touch_ops ops;
+    struct touch_work *works;
+#if CFG_MEM_TOUCH_THREADS
+    pthread_t *threads;
+    int *started;
+#endif
+    uint64_t ns_before = 0, ns_after = 0;
+    unsigned long chunk, first = 0;
+    int threads_num, writers, i, rc = 0;
 
     if (!os_page_size)
         os_page_size = os_get_page_size();
 
-    if (duration) {
-        rc = clock_gettime(CLOCK_MONOTONIC, &ts_before);
-        if (rc) {
-            ERROR("Error calling clock_gettime()\n");
-            goto out;
-        }
+    touch_ops_select(&ops);
+    threads_num = touch_threads_num(pages_num);
+
+    works = calloc(threads_num, sizeof(*works));
+#if CFG_MEM_TOUCH_THREADS
+    threads = calloc(threads_num, sizeof(*threads));
+    started = calloc(threads_num, sizeof(*started));
+    if (!threads || !started) {
+        rc = -ENOMEM;
+        goto out_free;
+    }
+#endif
+    if (!works) {
+        rc = -ENOMEM;
+        goto out_free;
     }
 
-    for (unsigned long i = 0; i < pages_num; i++) {
-        p = start + i * os_page_size;
-        *((unsigned long *) p) = i;
+    chunk = pages_num / threads_num;
+    for (i = 0; i < threads_num; i++) {
+        works[i].start = start;
+        works[i].first = first;
+        works[i].num = chunk + (i < (int) (pages_num % threads_num));
+        works[i].ops = &ops;
+        works[i].writers = &writers;
+        works[i].ns_after = duration ? &ns_after : NULL;
+        first += works[i].num;
     }
+    writers = threads_num;
 
     if (duration) {
-        rc = clock_gettime(CLOCK_MONOTONIC, &ts_after);
-        if (rc) {
-            ERROR("Error calling clock_gettime()\n");
-            goto out;
-        }
+        tsc_init();
+        ns_before = tsc_now_nsec();
     }
 
-    for (unsigned long i = 0; i < pages_num; i++) {
-        p = start + i * os_page_size;
+#if CFG_MEM_TOUCH_THREADS
+    /* the calling thread takes the first chunk */
+    for (i = 1; i < threads_num; i++)
+        started[i] = !pthread_create(&threads[i], NULL, touch_worker,
+            &works[i]);
+#endif
 
-        if (*((unsigned long *) p) != i) {
-            DEBUG("Mismatch on page %lu: found %lu expected %lu\n",
-                i, *((unsigned long *) p), i);
-            rc = -1;
-            goto out;
+    touch_worker(&works[0]);
+    rc = works[0].rc;
+
+#if CFG_MEM_TOUCH_THREADS
+    for (i = 1; i < threads_num; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            touch_worker(&works[i]);
+        if (works[i].rc)
+            rc = works[i].rc;
+    }
+#endif
+
+    if (!rc && duration) {
+        duration->tv_sec = (ns_after - ns_before) / 1000000000ULL;
+        duration->tv_usec = (ns_after - ns_before) % 1000000000ULL / 1000;
+    }
+
+out_free:
+#if CFG_MEM_TOUCH_THREADS
+    free(started);
+    free(threads);
+#endif
+    free(works);
+    return rc;
+}
+
+static const char *mem_inherit_names[] = {
+    [MEM_INHERIT_COW] = "cow",
+    [MEM_INHERIT_SHARED] = "shared",
+    [MEM_INHERIT_DONTFORK] = "dontfork",
+    [MEM_INHERIT_WIPE] = "wipe",
+};
+
+const char *mem_inherit_to_string(enum mem_inherit inherit)
+{
+    return mem_inherit_names[inherit];
+}
+
+static int string_to_mem_inherit(const char *s, enum mem_inherit *inherit)
+{
+    int i;
+
+    for (i = 0; i < (int) (sizeof(mem_inherit_names) / sizeof(mem_inherit_names[0])); i++) {
+        if (!strcmp(s, mem_inherit_names[i])) {
+            *inherit = i;
+            return 0;
         }
     }
 
-    if (duration) {
-        tv_before.tv_sec = ts_before.tv_sec;
-        tv_before.tv_usec = ts_before.tv_nsec / 1000;
+    return -EINVAL;
+}
+
+void mem_regions_free(struct mem_regions *mr)
+{
+    struct mem_region *r;
+
+    while (mr->num > 0) {
+        r = &mr->regions[--mr->num];
+        os_free_pages_inherit(r->start, r->pages_num, r->inherit);
+    }
+}
+
+int mem_regions_alloc(struct mem_regions *mr, const char *spec)
+{
+    struct mem_region *r;
+    char *buf, *tok, *size, *saveptr;
+    int rc = 0;
+
+    mr->num = 0;
+
+    buf = strdup(spec);
+    if (!buf) {
+        rc = -ENOMEM;
+        goto out;
+    }
+
+    for (tok = strtok_r(buf, ",", &saveptr); tok;
+            tok = strtok_r(NULL, ",", &saveptr)) {
+        if (mr->num == MEM_REGIONS_MAX) {
+            ERROR("More than %d regions in %s\n", MEM_REGIONS_MAX, spec);
+            rc = -E2BIG;
+            goto out_free;
+        }
+        r = &mr->regions[mr->num];
+
+        size = strchr(tok, ':');
+        if (!size) {
+            ERROR("Invalid region %s, expected <inherit>:<size>\n", tok);
+            rc = -EINVAL;
+            goto out_free;
+        }
+        *size++ = '\0';
 
-        tv_after.tv_sec = ts_after.tv_sec;
-        tv_after.tv_usec = ts_after.tv_nsec / 1000;
+        if (string_to_mem_inherit(tok, &r->inherit)) {
+            ERROR("Unsupported region inheritance: %s\n", tok);
+            rc = -EINVAL;
+            goto out_free;
+        }
+
+        r->pages_num = memsize_str2pages(size);
+        if (!r->pages_num) {
+            rc = -EINVAL;
+            goto out_free;
+        }
 
-        timersub(&tv_after, &tv_before, duration);
+        rc = os_alloc_pages_inherit(r->pages_num, r->inherit, &r->start);
+        if (rc) {
+            ERROR("Could not allocate %s %s region rc=%d\n", size, tok, rc);
+            goto out_free;
+        }
+        mr->num++;
     }
 
+    if (!mr->num) {
+        ERROR("No regions in %s\n", spec);
+        rc = -EINVAL;
+    }
+
+out_free:
+    if (rc)
+        mem_regions_free(mr);
+    free(buf);
 out:
     return rc;
 }
 
+int mem_regions_touch(struct mem_regions *mr)
+{
+    int i, rc = 0;
+
+    for (i = 0; i < mr->num && !rc; i++)
+        rc = mem_touch_pages(mr->regions[i].start, mr->regions[i].pages_num,
+            NULL);
+
+    return rc;
+}
+
+void mem_regions_print(struct mem_regions *mr)
+{
+    int i;
+
+    for (i = 0; i < mr->num; i++)
+        OS_PRINT_ERR("REGION_TRACE region=%d inherit=%s pages=%lu "
+            "bytes=%lu\n", i, mem_inherit_to_string(mr->regions[i].inherit),
+            mr->regions[i].pages_num,
+            mr->regions[i].pages_num * os_page_size);
+}
+
 unsigned long memsize_str2bytes(const char *size_str)
 {
     unsigned long n;
@@ -37,6 +37,30 @@
 
 extern unsigned long os_page_size;
 
+/*
+ * Backing of the os_alloc_pages_mode() regions: the system default, 4 KB
+ * pages only, transparent huge pages or explicit 2 MB/1 GB hugetlb pages
+ * (the latter need pages reserved in /sys/kernel/mm/hugepages).
+ */
+enum page_mode {
+    PAGE_MODE_DEFAULT,
+    PAGE_MODE_4K,
+    PAGE_MODE_THP,
+    PAGE_MODE_2M,
+    PAGE_MODE_1G,
+};
+
+/*
+ * What forked children get of a region: a copy-on-write copy, the very same
+ * pages, nothing (MADV_DONTFORK) or zero-filled pages (MADV_WIPEONFORK).
+ */
+enum mem_inherit {
+    MEM_INHERIT_COW,
+    MEM_INHERIT_SHARED,
+    MEM_INHERIT_DONTFORK,
+    MEM_INHERIT_WIPE,
+};
+
 int os_get_page_size(void);
 
 int os_alloc_max_contiguous_memory(char **pstart, unsigned long *ppages_num);
@@ -45,6 +69,38 @@ int os_free_max_contiguous_memory(char *start, unsigned long pages_num);
 int os_alloc_pages(unsigned long pages_num, char **pstart);
 int os_free_pages(char *start, unsigned long pages_num);
 
+/* Huge page regions are rounded up to a multiple of the huge page size */
+int os_alloc_pages_mode(unsigned long pages_num, enum page_mode mode,
+        char **pstart);
+int os_free_pages_mode(char *start, unsigned long pages_num,
+        enum page_mode mode);
+
+/* Only MEM_INHERIT_COW where the OS cannot tell regions apart on fork */
+int os_alloc_pages_inherit(unsigned long pages_num, enum mem_inherit inherit,
+        char **pstart);
+int os_free_pages_inherit(char *start, unsigned long pages_num,
+        enum mem_inherit inherit);
+
+#define MEM_REGIONS_MAX 8
+
+struct mem_region {
+    char *start;
+    unsigned long pages_num;
+    enum mem_inherit inherit;
+};
+
+/* A mix of tagged regions, e.g. "cow:1GB,dontfork:512MB,wipe:64MB" */
+struct mem_regions {
+    struct mem_region regions[MEM_REGIONS_MAX];
+    int num;
+};
+
+int mem_regions_alloc(struct mem_regions *mr, const char *spec);
+void mem_regions_free(struct mem_regions *mr);
+int mem_regions_touch(struct mem_regions *mr);
+void mem_regions_print(struct mem_regions *mr);
+const char *mem_inherit_to_string(enum mem_inherit inherit);
+
 int mem_touch_pages(char *start, unsigned long pages_num,
         struct timeval *duration);
 
@@ -30,11 +30,39 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
 #include <errno.h>
 #include <string.h>
+#include <common/cfg.h>
+#if CFG_NET_EPOLL
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+#endif
+#if CFG_NET_URING
+#include <os/posix/uring.h>
+#include <common/cmdline.h>
+#endif
 #include <common/log.h>
+#include <common/arena.h>
+#include <common/bufpool.h>
 #include <common/net.h>
 
+#if CFG_NET_EPOLL
+#define TCP_SERVER_BACKLOG      SOMAXCONN
+#else
+#define TCP_SERVER_BACKLOG      5
+#endif
+
+#ifdef __MINIOS__
+#define __thread
+#endif
+
+/* Buffers the pool cannot serve come from a per-thread arena, then the heap */
+#define NET_ARENA_SIZE          (1024 * 1024)
+
+static __thread struct arena net_arena;
+static __thread int net_arena_failed;
 
 static void servaddr_init(struct sockaddr_in *servaddr,
         unsigned int net_addr, unsigned short net_port)
@@ -45,10 +73,11 @@ static void servaddr_init(struct sockaddr_in *servaddr,
     servaddr->sin_addr.s_addr = net_addr;
 }
 
-int mysocket_init(struct mysocket *sock, int type, unsigned short port)
+int mysocket_init_flags(struct mysocket *sock, int type, unsigned short port,
+        int flags)
 {
     struct sockaddr_in servaddr;
-#ifndef __MINIOS__
+#if !defined(__MINIOS__) || defined(SO_REUSEPORT)
     int enable = 1;
 #endif
     int rc = 0;
@@ -73,6 +102,23 @@ int mysocket_init(struct mysocket *sock, int type, unsigned short port)
     }
 #endif
 
+    if (flags & MYSOCKET_REUSEPORT) {
+#ifdef SO_REUSEPORT
+        rc = setsockopt(sock->s, SOL_SOCKET, SO_REUSEPORT,
+                &enable, sizeof(enable));
+        if (rc < 0) {
+            ERROR("setsockopt(SO_REUSEPORT) failed (%s).\n", strerror(errno));
+            close(sock->s);
+            goto out;
+        }
+#else
+        ERROR("SO_REUSEPORT not supported\n");
+        close(sock->s);
+        rc = -ENOTSUP;
+        goto out;
+#endif
+    }
+
     if (port) {
         servaddr_init(&servaddr, htonl(INADDR_ANY), htons(port));
 
@@ -90,6 +136,11 @@ out:
     return rc;
 }
 
+int mysocket_init(struct mysocket *sock, int type, unsigned short port)
+{
+    return mysocket_init_flags(sock, type, port, 0);
+}
+
 int mysocket_fini(struct mysocket *sock)
 {
     int rc = 0;
@@ -105,12 +156,57 @@ out:
     return rc;
 }
 
+static inline int net_msg_buf_size(void)
+{
+    return bufpool_buf_size() ?: NET_MSG_BUF_SIZE;
+}
+
+static void *net_heap_alloc(size_t size)
+{
+    void *buf;
+
+    if (!net_arena.start && !net_arena_failed &&
+            arena_init(&net_arena, NET_ARENA_SIZE))
+        net_arena_failed = 1;
+
+    buf = arena_alloc(&net_arena, size);
+    if (!buf)
+        buf = malloc(size);
+
+    return buf;
+}
+
+static void *net_buf_alloc(int *psize)
+{
+    void *buf;
+
+    buf = bufpool_get();
+    if (buf)
+        *psize = bufpool_buf_size();
+    else {
+        /* pool disabled or exhausted */
+        *psize = net_msg_buf_size();
+        buf = net_heap_alloc(*psize);
+    }
+
+    return buf;
+}
+
+static void net_buf_free(void *buf)
+{
+    if (bufpool_owns(buf))
+        bufpool_put(buf);
+    else if (arena_owns(&net_arena, buf))
+        arena_free(&net_arena, buf);
+    else
+        free(buf);
+}
+
 static int net_msg_init_buffer(struct net_msg *m)
 {
     int rc = 0;
 
-    m->netbuf_size = 4096; /* TODO */
-    m->netbuf = malloc(m->netbuf_size);
+    m->netbuf = net_buf_alloc(&m->netbuf_size);
     if (!m->netbuf) {
         ERROR("could not allocate netbuf\n");
         rc = -ENOMEM;
@@ -123,19 +219,86 @@ out:
 
 void net_msg_cleanup(struct net_msg *m)
 {
-    if (m->netbuf)
-        free(m->netbuf);
+    if (m->netbuf) {
+        net_buf_free(m->netbuf);
+        m->netbuf = NULL;
+    }
     if (m->connection >= 0) {
         close(m->connection);
         m->connection = -1;
     }
 }
 
+#if CFG_NET_URING
+/*******************************************************************************
+ * io_uring
+ ******************************************************************************/
+
+#define NET_URING_ENTRIES   256
+#define NET_URING_BUFS      256
+#define NET_URING_BGID      0
+#define NET_URING_WAIT_MS   500
+
+/* user_data holds the tcp_conn pointer tagged with the request type */
+#define NET_URING_OP_ACCEPT 0UL
+#define NET_URING_OP_RECV   1UL
+#define NET_URING_OP_SEND   2UL
+#define NET_URING_OP_CANCEL 3UL
+#define NET_URING_OP_MASK   3UL
+
+struct net_uring {
+    struct os_uring ring;
+    struct os_uring_bufs bufs;
+};
+
+static int net_uring_init(struct net_uring *u, int buf_size)
+{
+    int rc;
+
+    rc = os_uring_init(&u->ring, NET_URING_ENTRIES);
+    if (rc)
+        goto out;
+
+    rc = os_uring_bufs_init(&u->ring, &u->bufs, NET_URING_BGID,
+            NET_URING_BUFS, buf_size);
+    if (rc)
+        os_uring_fini(&u->ring);
+out:
+    return rc;
+}
+
+static void net_uring_fini(struct net_uring *u)
+{
+    /* closing the ring cancels whatever is still in flight */
+    os_uring_fini(&u->ring);
+    os_uring_bufs_fini(NULL, &u->bufs);
+}
+
+static struct io_uring_sqe *net_uring_sqe(struct net_uring *u, int opcode,
+        int fd, unsigned long user_data)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = os_uring_get_sqe(&u->ring);
+    if (!sqe) {
+        ERROR("Error getting io_uring SQE\n");
+        goto out;
+    }
+
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+out:
+    return sqe;
+}
+#endif
+
 /*******************************************************************************
  * TCP
  ******************************************************************************/
 
-int tcp_server_start(struct os_server *srv, unsigned short port)
+int tcp_server_start_flags(struct os_server *srv, unsigned short port,
+        int flags)
 {
     int rc = 0;
 
@@ -146,13 +309,13 @@ int tcp_server_start(struct os_server *srv, unsigned short port)
 
     INFO("Opening connection\n");
 
-    rc = mysocket_init(&srv->listener_socket, SOCK_STREAM, port);
+    rc = mysocket_init_flags(&srv->listener_socket, SOCK_STREAM, port, flags);
     if (rc) {
         ERROR("Error creating socket\n");
         goto out;
     }
 
-    rc = listen(srv->listener_socket.s, 5);
+    rc = listen(srv->listener_socket.s, TCP_SERVER_BACKLOG);
     if (rc) {
         ERROR("Error calling listen() rc=%d\n", rc);
         goto out_cleanup;
@@ -167,6 +330,11 @@ out:
     return rc;
 }
 
+int tcp_server_start(struct os_server *srv, unsigned short port)
+{
+    return tcp_server_start_flags(srv, port, 0);
+}
+
 int tcp_server_stop(struct os_server *srv)
 {
     int rc = 0;
@@ -263,37 +431,1318 @@ out:
 }
 
 /*******************************************************************************
- * UDP
+ * TCP event loop
  ******************************************************************************/
 
-int udp_server_start(struct mysocket *sock, unsigned short port)
+#define TCP_CONN_TXBUF_MAX          (1024 * 1024)
+#define TCP_SERVER_LOOP_EVENTS      256
+#define TCP_SERVER_LOOP_TIMEOUT_MS  500
+
+static struct tcp_conn *tcp_conn_alloc(struct tcp_server_loop *loop)
 {
-    return mysocket_init(sock, SOCK_DGRAM, port);
+    struct tcp_conn *conn;
+
+    /* closed connections are recycled, not freed */
+    conn = loop->free_conns;
+    if (conn)
+        loop->free_conns = conn->next;
+    else {
+        conn = malloc(sizeof(*conn));
+        if (!conn)
+            goto out;
+    }
+
+    memset(conn, 0, sizeof(*conn));
+    conn->msg.connection = -1;
+
+    if (net_msg_init_buffer(&conn->msg)) {
+        conn->next = loop->free_conns;
+        loop->free_conns = conn;
+        conn = NULL;
+        goto out;
+    }
+    ((char *) conn->msg.netbuf)[0] = '\0';
+
+    conn->next = loop->conns;
+    if (loop->conns)
+        loop->conns->prev = conn;
+    loop->conns = conn;
+    loop->conns_num++;
+out:
+    return conn;
 }
 
-int udp_server_recv_msg(struct mysocket *sock, struct net_msg *m)
+static void tcp_conn_free(struct tcp_server_loop *loop, struct tcp_conn *conn)
 {
-    socklen_t len = sizeof(m->client_addr);
-    int rc = -1;
+    if (loop->ops->conn_close)
+        loop->ops->conn_close(loop, conn);
 
-    if (!m->netbuf) {
-        rc = net_msg_init_buffer(m);
-        if (rc) {
-            ERROR("Error calling net_msg_init_buffer() rc=%d\n", rc);
+#if CFG_NET_EPOLL
+    if (loop->epfd >= 0 && conn->msg.connection >= 0)
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->msg.connection, NULL);
+#endif
+    net_msg_cleanup(&conn->msg);
+    if (conn->txbuf)
+        net_buf_free(conn->txbuf);
+#if CFG_NET_URING
+    if (conn->tx_inflight)
+        net_buf_free(conn->tx_inflight);
+#endif
+
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        loop->conns = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+    loop->conns_num--;
+
+    conn->next = loop->free_conns;
+    loop->free_conns = conn;
+}
+
+int tcp_conn_queue(struct tcp_conn *conn, const void *data, int size)
+{
+    void *txbuf;
+    int new_size, rc = 0;
+
+    if (conn->tx_off && conn->tx_off == conn->tx_len)
+        conn->tx_off = conn->tx_len = 0;
+
+    if (!conn->txbuf && size <= net_msg_buf_size()) {
+        /* the common case: replies fit in one pool buffer */
+        conn->txbuf = net_buf_alloc(&conn->txbuf_size);
+        if (!conn->txbuf) {
+            rc = -ENOMEM;
             goto out;
         }
     }
 
-    rc = recvfrom(sock->s, m->netbuf, m->netbuf_size, 0,
-            (struct sockaddr *) &m->client_addr, &len);
-    if (rc < 0) {
-        ERROR("Error calling recvfrom() rc=%d\n", rc);
+    if (conn->tx_len + size > conn->txbuf_size) {
+        new_size = conn->txbuf_size ? conn->txbuf_size : net_msg_buf_size();
+        while (new_size < conn->tx_len + size)
+            new_size *= 2;
+        if (new_size > TCP_CONN_TXBUF_MAX) {
+            rc = -ENOBUFS;
+            goto out;
+        }
+
+        txbuf = net_heap_alloc(new_size);
+        if (!txbuf) {
+            rc = -ENOMEM;
+            goto out;
+        }
+        if (conn->txbuf) {
+            memcpy(txbuf, conn->txbuf, conn->tx_len);
+            net_buf_free(conn->txbuf);
+        }
+        conn->txbuf = txbuf;
+        conn->txbuf_size = new_size;
+    }
+
+    memcpy((char *) conn->txbuf + conn->tx_len, data, size);
+    conn->tx_len += size;
+out:
+    return rc;
+}
+
+void tcp_conn_consume(struct tcp_conn *conn, int size)
+{
+    char *buf = conn->msg.netbuf;
+
+    if (size >= conn->rx_len)
+        conn->rx_len = 0;
+    else {
+        memmove(buf, buf + size, conn->rx_len - size);
+        conn->rx_len -= size;
+    }
+    buf[conn->rx_len] = '\0';
+}
+
+/*
+ * Sends the queued replies. Returns 0 when everything was sent, 1 when the
+ * socket would block and a negative value on error.
+ */
+static int tcp_conn_flush(struct tcp_server_loop *loop, struct tcp_conn *conn)
+{
+    int rc = 0;
+
+    while (conn->tx_off < conn->tx_len) {
+        rc = send(conn->msg.connection, (char *) conn->txbuf + conn->tx_off,
+                conn->tx_len - conn->tx_off, 0);
+        if (rc < 0) {
+#if CFG_NET_EPOLL
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                rc = 1;
+                goto out;
+            }
+#endif
+            ERROR("Error calling send() rc=%d\n", rc);
+            goto out;
+        }
+        conn->tx_off += rc;
+        loop->stats.bytes_tx += rc;
+        rc = 0;
+    }
+    conn->tx_off = conn->tx_len = 0;
+out:
+    return rc;
+}
+
+/* Returns the conn_recv() verdict for the newly received bytes */
+static int tcp_conn_handle_rx(struct tcp_server_loop *loop,
+        struct tcp_conn *conn, int len)
+{
+    int rc;
+
+    conn->rx_len += len;
+    ((char *) conn->msg.netbuf)[conn->rx_len] = '\0';
+    loop->stats.recvs++;
+    loop->stats.bytes_rx += len;
+
+    rc = loop->ops->conn_recv(loop, conn);
+    if (rc == TCP_CONN_KEEP && conn->rx_len >= conn->msg.netbuf_size - 1) {
+        ERROR("Connection buffer full, dropping connection\n");
+        rc = -ENOBUFS;
+    }
+
+    return rc;
+}
+
+#if CFG_NET_URING
+/* tcp_conn uring_state */
+#define TCP_CONN_URING_RECV     0x1     /* multishot recv armed */
+#define TCP_CONN_URING_SEND     0x2     /* send in flight */
+#define TCP_CONN_URING_CANCEL   0x4     /* recv cancellation submitted */
+#define TCP_CONN_URING_ABORT    0x8     /* nothing more to send */
+
+static int tcp_uring_init(struct tcp_server_loop *loop)
+{
+    struct net_uring *u;
+    int rc;
+
+    u = malloc(sizeof(*u));
+    if (!u) {
+        rc = -ENOMEM;
+        goto out;
+    }
+
+    rc = net_uring_init(u, net_msg_buf_size());
+    if (rc) {
+        free(u);
+        goto out;
+    }
+
+    loop->uring = u;
+out:
+    return rc;
+}
+
+static int tcp_uring_accept(struct tcp_server_loop *loop)
+{
+    struct io_uring_sqe *sqe;
+    int rc = 0;
+
+    sqe = net_uring_sqe(loop->uring, IORING_OP_ACCEPT,
+            loop->srv->listener_socket.s, NET_URING_OP_ACCEPT);
+    if (!sqe) {
+        rc = -EBUSY;
+        goto out;
+    }
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+out:
+    return rc;
+}
+
+static int tcp_uring_recv(struct tcp_server_loop *loop, struct tcp_conn *conn)
+{
+    struct io_uring_sqe *sqe;
+    int rc = 0;
+
+    sqe = net_uring_sqe(loop->uring, IORING_OP_RECV, conn->msg.connection,
+            (unsigned long) conn | NET_URING_OP_RECV);
+    if (!sqe) {
+        rc = -EBUSY;
+        goto out;
+    }
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = NET_URING_BGID;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    conn->uring_state |= TCP_CONN_URING_RECV;
+out:
+    return rc;
+}
+
+static void tcp_uring_cancel(struct tcp_server_loop *loop,
+        struct tcp_conn *conn)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = net_uring_sqe(loop->uring, IORING_OP_ASYNC_CANCEL, -1,
+            (unsigned long) conn | NET_URING_OP_CANCEL);
+    if (!sqe)
+        return;
+    sqe->addr = (unsigned long) conn | NET_URING_OP_RECV;
+    conn->uring_state |= TCP_CONN_URING_CANCEL;
+}
+
+static void tcp_uring_abort(struct tcp_conn *conn)
+{
+    conn->closing = 1;
+    conn->uring_state |= TCP_CONN_URING_ABORT;
+    conn->tx_len = conn->tx_off = 0;
+    if (conn->tx_inflight && !(conn->uring_state & TCP_CONN_URING_SEND)) {
+        net_buf_free(conn->tx_inflight);
+        conn->tx_inflight = NULL;
+    }
+}
+
+/* Submits the queued replies, with at most one send in flight */
+static void tcp_uring_flush(struct tcp_server_loop *loop,
+        struct tcp_conn *conn)
+{
+    struct io_uring_sqe *sqe;
+
+    if (conn->uring_state & (TCP_CONN_URING_SEND | TCP_CONN_URING_ABORT))
+        return;
+
+    if (!conn->tx_inflight) {
+        if (!conn->tx_len)
+            return;
+
+        /* the kernel owns the buffer until the send completes */
+        conn->tx_inflight = conn->txbuf;
+        conn->tx_inflight_len = conn->tx_len;
+        conn->tx_inflight_off = 0;
+        conn->txbuf = NULL;
+        conn->txbuf_size = conn->tx_len = conn->tx_off = 0;
+    }
+
+    sqe = net_uring_sqe(loop->uring, IORING_OP_SEND, conn->msg.connection,
+            (unsigned long) conn | NET_URING_OP_SEND);
+    if (!sqe) {
+        tcp_uring_abort(conn);
+        return;
+    }
+    sqe->addr = (unsigned long) conn->tx_inflight + conn->tx_inflight_off;
+    sqe->len = conn->tx_inflight_len - conn->tx_inflight_off;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    conn->uring_state |= TCP_CONN_URING_SEND;
+
+    if (conn->closing &&
+        (conn->uring_state & (TCP_CONN_URING_RECV | TCP_CONN_URING_CANCEL)) ==
+            TCP_CONN_URING_RECV) {
+        /* the last reply and the recv teardown go in one submission */
+        sqe->flags |= IOSQE_IO_HARDLINK;
+        tcp_uring_cancel(loop, conn);
+
+    } else if (!conn->closing && !(conn->uring_state & TCP_CONN_URING_RECV)) {
+        /* so is the reply and the recv re-armed behind it */
+        sqe->flags |= IOSQE_IO_HARDLINK;
+        if (tcp_uring_recv(loop, conn))
+            tcp_uring_abort(conn);
+    }
+}
+
+/* Moves the connection along after a completion, freeing it once idle */
+static void tcp_uring_update(struct tcp_server_loop *loop,
+        struct tcp_conn *conn)
+{
+    tcp_uring_flush(loop, conn);
+    if (!conn->closing)
+        return;
+
+    if ((conn->uring_state & (TCP_CONN_URING_RECV | TCP_CONN_URING_CANCEL)) ==
+            TCP_CONN_URING_RECV)
+        tcp_uring_cancel(loop, conn);
+
+    if (!(conn->uring_state & (TCP_CONN_URING_RECV | TCP_CONN_URING_SEND)) &&
+        !conn->tx_len)
+        tcp_conn_free(loop, conn);
+}
+
+static int tcp_uring_rx(struct tcp_server_loop *loop, struct tcp_conn *conn,
+        const char *data, int len)
+{
+    int n, rc = TCP_CONN_KEEP;
+
+    /* the ring buffer may hold more than the connection buffer has room for */
+    while (len > 0) {
+        n = conn->msg.netbuf_size - conn->rx_len - 1;
+        if (n > len)
+            n = len;
+        memcpy((char *) conn->msg.netbuf + conn->rx_len, data, n);
+
+        rc = tcp_conn_handle_rx(loop, conn, n);
+        if (rc != TCP_CONN_KEEP)
+            break;
+        data += n;
+        len -= n;
+    }
+
+    return rc;
+}
+
+static void tcp_uring_handle_accept(struct tcp_server_loop *loop,
+        struct io_uring_cqe *cqe)
+{
+    struct tcp_conn *conn;
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int s = cqe->res, enable = 1;
+
+    if (s < 0) {
+        if (s != -EINTR && s != -ECONNABORTED)
+            ERROR("Error accepting connection errno=%d\n", -s);
+        return;
+    }
+
+    /* a multishot accept would write every peer into the same sockaddr */
+    if (getpeername(s, (struct sockaddr *) &addr, &len)) {
+        ERROR("Error calling getpeername() errno=%d\n", errno);
+        close(s);
+        return;
+    }
+
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+    conn = tcp_conn_alloc(loop);
+    if (!conn) {
+        ERROR("Could not allocate connection\n");
+        close(s);
+        return;
+    }
+    conn->msg.connection = s;
+    conn->msg.client_addr = addr;
+    loop->stats.conns++;
+
+    DEBUG("Connection accepted from %s:%d\n",
+        inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+
+    if (loop->ops->conn_open && loop->ops->conn_open(loop, conn)) {
+        tcp_conn_free(loop, conn);
+        return;
+    }
+
+    if (tcp_uring_recv(loop, conn))
+        tcp_conn_free(loop, conn);
+}
+
+static void tcp_uring_handle_recv(struct tcp_server_loop *loop,
+        struct tcp_conn *conn, struct io_uring_cqe *cqe)
+{
+    struct net_uring *u = loop->uring;
+    int bid, rc;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        conn->uring_state &= ~TCP_CONN_URING_RECV;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0 && !conn->closing) {
+            rc = tcp_uring_rx(loop, conn, os_uring_buf(&u->bufs, bid),
+                    cqe->res);
+            if (rc < 0)
+                tcp_uring_abort(conn);
+            else if (rc == TCP_CONN_CLOSE)
+                conn->closing = 1;
+        }
+        os_uring_buf_recycle(&u->bufs, bid);
+    }
+
+    if (cqe->res == 0) {
+        /* peer closed, nothing more to send */
+        tcp_uring_abort(conn);
+
+    } else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+        ERROR("Error receiving errno=%d\n", -cqe->res);
+        tcp_uring_abort(conn);
+    }
+
+    /*
+     * The kernel ends multishot receives when it runs out of buffers. A
+     * reply going out re-arms the recv linked after it, otherwise do it here.
+     */
+    tcp_uring_flush(loop, conn);
+    if (!conn->closing && !(conn->uring_state & TCP_CONN_URING_RECV) &&
+        tcp_uring_recv(loop, conn))
+        tcp_uring_abort(conn);
+
+    tcp_uring_update(loop, conn);
+}
+
+static void tcp_uring_handle_send(struct tcp_server_loop *loop,
+        struct tcp_conn *conn, struct io_uring_cqe *cqe)
+{
+    conn->uring_state &= ~TCP_CONN_URING_SEND;
+
+    if (cqe->res < 0) {
+        if (!(conn->uring_state & TCP_CONN_URING_ABORT))
+            ERROR("Error sending errno=%d\n", -cqe->res);
+        tcp_uring_abort(conn);
+    } else {
+        conn->tx_inflight_off += cqe->res;
+        loop->stats.bytes_tx += cqe->res;
+    }
+
+    if (conn->tx_inflight &&
+        (conn->tx_inflight_off == conn->tx_inflight_len ||
+         (conn->uring_state & TCP_CONN_URING_ABORT))) {
+        net_buf_free(conn->tx_inflight);
+        conn->tx_inflight = NULL;
+    }
+
+    tcp_uring_update(loop, conn);
+}
+
+static int tcp_uring_run(struct tcp_server_loop *loop)
+{
+    struct net_uring *u = loop->uring;
+    struct io_uring_cqe *cqe, c;
+    struct tcp_conn *conn;
+    int rc;
+
+    rc = tcp_uring_accept(loop);
+    if (rc)
         goto out;
+
+    while (loop->running) {
+        rc = os_uring_submit_and_wait(&u->ring, 1, NET_URING_WAIT_MS);
+        if (rc == -ETIME)
+            rc = 0;
+        else if (rc < 0) {
+            ERROR("Error calling io_uring_enter() rc=%d\n", rc);
+            break;
+        }
+
+        while ((cqe = os_uring_peek_cqe(&u->ring))) {
+            c = *cqe;
+            os_uring_cqe_seen(&u->ring);
+
+            conn = (struct tcp_conn *) (c.user_data & ~NET_URING_OP_MASK);
+            switch (c.user_data & NET_URING_OP_MASK) {
+            case NET_URING_OP_ACCEPT:
+                tcp_uring_handle_accept(loop, &c);
+                if (!(c.flags & IORING_CQE_F_MORE)) {
+                    rc = tcp_uring_accept(loop);
+                    if (rc)
+                        goto out;
+                }
+                break;
+            case NET_URING_OP_RECV:
+                tcp_uring_handle_recv(loop, conn, &c);
+                break;
+            case NET_URING_OP_SEND:
+                tcp_uring_handle_send(loop, conn, &c);
+                break;
+            default:
+                /* cancellations, the recv completion does the work */
+                break;
+            }
+        }
     }
 
 out:
     return rc;
 }
+#endif
+
+int tcp_server_loop_init(struct tcp_server_loop *loop, struct os_server *srv,
+        const struct tcp_server_loop_ops *ops, void *priv)
+{
+    int rc = 0;
+
+    if (!loop || !srv || !ops || !ops->conn_recv) {
+        rc = -EINVAL;
+        goto out;
+    }
+
+    memset(loop, 0, sizeof(*loop));
+    loop->srv = srv;
+    loop->ops = ops;
+    loop->priv = priv;
+    /* set here, not in _run(), so that a stop before the loop runs sticks */
+    loop->running = 1;
+#if CFG_NET_EPOLL
+    loop->epfd = -1;
+#endif
+
+#if CFG_NET_URING
+    if (do_io_uring) {
+        rc = tcp_uring_init(loop);
+        if (!rc)
+            goto out;
+        INFO("io_uring not available rc=%d, falling back to epoll\n", rc);
+        rc = 0;
+    }
+#endif
+
+#if CFG_NET_EPOLL
+    {
+        struct epoll_event ev;
+        int flags;
+
+        flags = fcntl(srv->listener_socket.s, F_GETFL, 0);
+        rc = fcntl(srv->listener_socket.s, F_SETFL, flags | O_NONBLOCK);
+        if (rc < 0) {
+            ERROR("Error calling fcntl() errno=%d\n", errno);
+            rc = -errno;
+            goto out;
+        }
+
+        loop->epfd = epoll_create1(0);
+        if (loop->epfd < 0) {
+            ERROR("Error calling epoll_create1() errno=%d\n", errno);
+            rc = -errno;
+            goto out;
+        }
+
+        /* the listener is the only entry without a connection */
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = NULL;
+        rc = epoll_ctl(loop->epfd, EPOLL_CTL_ADD, srv->listener_socket.s, &ev);
+        if (rc < 0) {
+            ERROR("Error calling epoll_ctl() errno=%d\n", errno);
+            rc = -errno;
+            close(loop->epfd);
+            loop->epfd = -1;
+            goto out;
+        }
+    }
+#endif
+
+out:
+    return rc;
+}
+
+void tcp_server_loop_stop(struct tcp_server_loop *loop)
+{
+    loop->running = 0;
+}
+
+void tcp_server_loop_fini(struct tcp_server_loop *loop)
+{
+    struct tcp_conn *conn;
+
+#if CFG_NET_URING
+    if (loop->uring) {
+        /* first, so that nothing is in flight when the buffers are freed */
+        net_uring_fini(loop->uring);
+        free(loop->uring);
+        loop->uring = NULL;
+    }
+#endif
+
+    while (loop->conns)
+        tcp_conn_free(loop, loop->conns);
+
+    while (loop->free_conns) {
+        conn = loop->free_conns;
+        loop->free_conns = conn->next;
+        free(conn);
+    }
+
+    /* the thread is done serving, unless it still holds buffers */
+    if (net_arena.start && !net_arena.live) {
+        arena_print_stats(&net_arena, "net");
+        arena_fini(&net_arena);
+    }
+
+#if CFG_NET_EPOLL
+    if (loop->epfd >= 0) {
+        close(loop->epfd);
+        loop->epfd = -1;
+    }
+#endif
+}
+
+/*
+ * For a process forked from inside the loop, which shares the epoll set (or
+ * io_uring) and the listener with its parent: drops its copies without
+ * unregistering anything from the parent and keeps only conn open.
+ */
+void tcp_server_loop_detach(struct tcp_server_loop *loop,
+        struct tcp_conn *conn)
+{
+    struct tcp_conn *c, *next;
+
+#if CFG_NET_EPOLL
+    if (loop->epfd >= 0) {
+        close(loop->epfd);
+        loop->epfd = -1;
+    }
+#endif
+#if CFG_NET_URING
+    if (loop->uring) {
+        net_uring_fini(loop->uring);
+        free(loop->uring);
+        loop->uring = NULL;
+    }
+#endif
+    tcp_server_stop(loop->srv);
+
+    for (c = loop->conns; c; c = next) {
+        next = c->next;
+        if (c != conn)
+            tcp_conn_free(loop, c);
+    }
+    loop->running = 0;
+}
+
+#if CFG_NET_EPOLL
+static void tcp_server_loop_accept(struct tcp_server_loop *loop)
+{
+    struct tcp_conn *conn;
+    struct epoll_event ev;
+    struct sockaddr_in addr;
+    socklen_t len;
+    int s, enable = 1, rc;
+
+    while (1) {
+        len = sizeof(addr);
+        s = accept4(loop->srv->listener_socket.s,
+                (struct sockaddr *) &addr, &len, SOCK_NONBLOCK);
+        if (s < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                ERROR("Error calling accept4() errno=%d\n", errno);
+            break;
+        }
+
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+        conn = tcp_conn_alloc(loop);
+        if (!conn) {
+            ERROR("Could not allocate connection\n");
+            close(s);
+            continue;
+        }
+        conn->msg.connection = s;
+        conn->msg.client_addr = addr;
+        loop->stats.conns++;
+
+        DEBUG("Connection accepted from %s:%d\n",
+            inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+
+        if (loop->ops->conn_open) {
+            rc = loop->ops->conn_open(loop, conn);
+            if (rc) {
+                tcp_conn_free(loop, conn);
+                continue;
+            }
+        }
+
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        rc = epoll_ctl(loop->epfd, EPOLL_CTL_ADD, s, &ev);
+        if (rc < 0) {
+            ERROR("Error calling epoll_ctl() errno=%d\n", errno);
+            tcp_conn_free(loop, conn);
+        }
+    }
+}
+
+static void tcp_server_loop_serve(struct tcp_server_loop *loop,
+        struct tcp_conn *conn, unsigned int events)
+{
+    int len, rc = 0;
+
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        rc = -1;
+        goto out;
+    }
+
+    if ((events & (EPOLLIN | EPOLLRDHUP)) && !conn->closing) {
+        /* edge-triggered: drain the socket until it would block */
+        while (1) {
+            len = recv(conn->msg.connection,
+                    (char *) conn->msg.netbuf + conn->rx_len,
+                    conn->msg.netbuf_size - conn->rx_len - 1, 0);
+            if (len < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    ERROR("Error calling recv() errno=%d\n", errno);
+                    rc = -1;
+                }
+                break;
+            }
+            if (len == 0) {
+                /* peer closed, nothing more to send */
+                rc = -1;
+                break;
+            }
+
+            rc = tcp_conn_handle_rx(loop, conn, len);
+            if (rc < 0)
+                break;
+            if (rc == TCP_CONN_CLOSE) {
+                conn->closing = 1;
+                rc = 0;
+                break;
+            }
+        }
+        if (rc < 0)
+            goto out;
+    }
+
+    rc = tcp_conn_flush(loop, conn);
+    if (rc < 0)
+        goto out;
+    if (rc == 0 && conn->closing)
+        rc = -1;
+
+out:
+    if (rc < 0)
+        tcp_conn_free(loop, conn);
+}
+
+int tcp_server_loop_run(struct tcp_server_loop *loop)
+{
+    struct epoll_event events[TCP_SERVER_LOOP_EVENTS];
+    int n, rc = 0;
+
+#if CFG_NET_URING
+    if (loop->uring) {
+        rc = tcp_uring_run(loop);
+        goto out;
+    }
+#endif
+
+    while (loop->running) {
+        n = epoll_wait(loop->epfd, events, TCP_SERVER_LOOP_EVENTS,
+                TCP_SERVER_LOOP_TIMEOUT_MS);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            ERROR("Error calling epoll_wait() errno=%d\n", errno);
+            rc = -errno;
+            break;
+        }
+
+        for (int i = 0; i < n && loop->running; i++) {
+            if (!events[i].data.ptr)
+                tcp_server_loop_accept(loop);
+            else
+                tcp_server_loop_serve(loop, events[i].data.ptr,
+                        events[i].events);
+        }
+    }
+
+#if CFG_NET_URING
+out:
+#endif
+    return rc;
+}
+
+#else
+
+int tcp_server_loop_run(struct tcp_server_loop *loop)
+{
+    struct tcp_conn *conn;
+    struct net_msg msg;
+    int len, rc = 0;
+
+    while (loop->running) {
+        rc = tcp_server_accept(loop->srv, &msg);
+        if (rc) {
+            ERROR("Error tcp_server_accept() rc=%d\n", rc);
+            break;
+        }
+
+        conn = tcp_conn_alloc(loop);
+        if (!conn) {
+            ERROR("Could not allocate connection\n");
+            net_msg_cleanup(&msg);
+            rc = -ENOMEM;
+            break;
+        }
+        conn->msg.connection = msg.connection;
+        conn->msg.client_addr = msg.client_addr;
+        loop->stats.conns++;
+
+        if (loop->ops->conn_open && loop->ops->conn_open(loop, conn)) {
+            tcp_conn_free(loop, conn);
+            continue;
+        }
+
+        while (loop->running) {
+            len = recv(conn->msg.connection,
+                    (char *) conn->msg.netbuf + conn->rx_len,
+                    conn->msg.netbuf_size - conn->rx_len - 1, 0);
+            if (len <= 0)
+                break;
+
+            rc = tcp_conn_handle_rx(loop, conn, len);
+            if (rc >= 0 && tcp_conn_flush(loop, conn))
+                rc = -1;
+            if (rc != TCP_CONN_KEEP)
+                break;
+        }
+
+        tcp_conn_free(loop, conn);
+        rc = 0;
+    }
+
+    return rc;
+}
+#endif
+
+/*******************************************************************************
+ * UDP
+ ******************************************************************************/
+
+int udp_server_start(struct mysocket *sock, unsigned short port)
+{
+    return mysocket_init(sock, SOCK_DGRAM, port);
+}
+
+int udp_server_start_flags(struct mysocket *sock, unsigned short port,
+        int flags)
+{
+    return mysocket_init_flags(sock, SOCK_DGRAM, port, flags);
+}
+
+int udp_server_recv_msg(struct mysocket *sock, struct net_msg *m)
+{
+    socklen_t len = sizeof(m->client_addr);
+    int rc = -1;
+
+    if (!m->netbuf) {
+        rc = net_msg_init_buffer(m);
+        if (rc) {
+            ERROR("Error calling net_msg_init_buffer() rc=%d\n", rc);
+            goto out;
+        }
+    }
+
+    rc = recvfrom(sock->s, m->netbuf, m->netbuf_size, 0,
+            (struct sockaddr *) &m->client_addr, &len);
+    if (rc < 0) {
+        ERROR("Error calling recvfrom() rc=%d\n", rc);
+        goto out;
+    }
+
+out:
+    return rc;
+}
+
+#if CFG_NET_MMSG
+static void udp_batch_prepare(struct udp_batch *b, int num, int recv)
+{
+    struct mmsghdr *hdrs = b->hdrs;
+    struct iovec *iovs = (struct iovec *) (hdrs + b->size);
+
+    for (int i = 0; i < num; i++) {
+        iovs[i].iov_base = b->msgs[i].netbuf;
+        iovs[i].iov_len = recv ? b->buf_size : b->msgs[i].netbuf_size;
+
+        memset(&hdrs[i].msg_hdr, 0, sizeof(hdrs[i].msg_hdr));
+        hdrs[i].msg_hdr.msg_name = &b->msgs[i].client_addr;
+        hdrs[i].msg_hdr.msg_namelen = sizeof(b->msgs[i].client_addr);
+        hdrs[i].msg_hdr.msg_iov = &iovs[i];
+        hdrs[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+#endif
+
+#if CFG_NET_URING
+#define UDP_URING_STASH     (2 * NET_URING_BUFS)
+
+struct udp_uring {
+    struct net_uring u;
+    struct msghdr hdr;
+    int armed;
+    int held[UDP_BATCH_MAX];
+    int held_num;
+    /* receive completions reaped while waiting for sends */
+    struct io_uring_cqe stash[UDP_URING_STASH];
+    int stash_head;
+    int stash_num;
+};
+
+static int udp_uring_init(struct udp_batch *b)
+{
+    struct udp_uring *uu;
+    int rc;
+
+    uu = calloc(1, sizeof(*uu));
+    if (!uu) {
+        rc = -ENOMEM;
+        goto out;
+    }
+
+    /* each ring buffer holds the recvmsg header, the sender and the payload */
+    rc = net_uring_init(&uu->u, sizeof(struct io_uring_recvmsg_out) +
+            sizeof(struct sockaddr_in) + b->buf_size);
+    if (rc) {
+        free(uu);
+        goto out;
+    }
+    uu->hdr.msg_namelen = sizeof(struct sockaddr_in);
+
+    b->uring = uu;
+out:
+    return rc;
+}
+
+static void udp_uring_fini(struct udp_batch *b)
+{
+    struct udp_uring *uu = b->uring;
+
+    net_uring_fini(&uu->u);
+    free(uu);
+    b->uring = NULL;
+}
+
+static int udp_uring_recvmsg(struct udp_uring *uu, int s)
+{
+    struct io_uring_sqe *sqe;
+    int rc = 0;
+
+    sqe = net_uring_sqe(&uu->u, IORING_OP_RECVMSG, s, NET_URING_OP_RECV);
+    if (!sqe) {
+        rc = -EBUSY;
+        goto out;
+    }
+    sqe->addr = (unsigned long) &uu->hdr;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = NET_URING_BGID;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    uu->armed = 1;
+out:
+    return rc;
+}
+
+static void udp_uring_stash(struct udp_uring *uu, struct io_uring_cqe *cqe)
+{
+    if (uu->stash_num == UDP_URING_STASH) {
+        /* drop the datagram, not the buffer */
+        if (cqe->flags & IORING_CQE_F_BUFFER)
+            os_uring_buf_recycle(&uu->u.bufs,
+                    cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            uu->armed = 0;
+        return;
+    }
+
+    uu->stash[(uu->stash_head + uu->stash_num) % UDP_URING_STASH] = *cqe;
+    uu->stash_num++;
+}
+
+/* Returns 1 and the next receive completion, if there is one */
+static int udp_uring_next(struct udp_uring *uu, struct io_uring_cqe *c)
+{
+    struct io_uring_cqe *cqe;
+
+    if (uu->stash_num) {
+        *c = uu->stash[uu->stash_head];
+        uu->stash_head = (uu->stash_head + 1) % UDP_URING_STASH;
+        uu->stash_num--;
+        return 1;
+    }
+
+    while ((cqe = os_uring_peek_cqe(&uu->u.ring))) {
+        *c = *cqe;
+        os_uring_cqe_seen(&uu->u.ring);
+        if ((c->user_data & NET_URING_OP_MASK) == NET_URING_OP_RECV)
+            return 1;
+    }
+
+    return 0;
+}
+
+static int udp_uring_recv_batch(struct mysocket *sock, struct udp_batch *b)
+{
+    struct udp_uring *uu = b->uring;
+    struct io_uring_recvmsg_out *out;
+    struct io_uring_cqe c;
+    struct net_msg *m;
+    int bid, rc = 0;
+
+    /* the previous batch has been handled, its buffers go back to the kernel */
+    for (int i = 0; i < uu->held_num; i++)
+        os_uring_buf_recycle(&uu->u.bufs, uu->held[i]);
+    uu->held_num = 0;
+    b->count = 0;
+
+    while (b->count < b->size) {
+        if (!uu->armed) {
+            rc = udp_uring_recvmsg(uu, sock->s);
+            if (rc)
+                goto out;
+        }
+
+        if (!udp_uring_next(uu, &c)) {
+            if (b->count)
+                break;
+
+            /* time out now and then so that the caller can check for stop */
+            rc = os_uring_submit_and_wait(&uu->u.ring, 1, NET_URING_WAIT_MS);
+            if (rc == -ETIME) {
+                rc = 0;
+                break;
+            }
+            if (rc < 0) {
+                ERROR("Error calling io_uring_enter() rc=%d\n", rc);
+                goto out;
+            }
+            continue;
+        }
+
+        if (!(c.flags & IORING_CQE_F_MORE))
+            uu->armed = 0;
+
+        if (c.res < 0) {
+            if (c.res == -ENOBUFS)
+                continue;
+            ERROR("Error receiving datagram errno=%d\n", -c.res);
+            rc = c.res;
+            goto out;
+        }
+        if (!(c.flags & IORING_CQE_F_BUFFER))
+            continue;
+
+        bid = c.flags >> IORING_CQE_BUFFER_SHIFT;
+        uu->held[uu->held_num++] = bid;
+
+        out = os_uring_buf(&uu->u.bufs, bid);
+        m = &b->msgs[b->count++];
+        memcpy(&m->client_addr, out + 1, sizeof(m->client_addr));
+        m->netbuf = (char *) (out + 1) + uu->hdr.msg_namelen;
+        /* payloadlen is the datagram length, even when truncated */
+        m->netbuf_size = out->payloadlen < (unsigned int) b->buf_size ?
+                out->payloadlen : (unsigned int) b->buf_size;
+    }
+    rc = b->count;
+out:
+    return rc;
+}
+
+static int udp_uring_send_batch(struct mysocket *sock, struct udp_batch *b)
+{
+    struct udp_uring *uu = b->uring;
+    struct mmsghdr *hdrs = b->hdrs;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    int pending = 0, sent = 0, err, rc = 0;
+
+    udp_batch_prepare(b, b->count, 0);
+
+    for (int i = 0; i < b->count; i++) {
+        sqe = net_uring_sqe(&uu->u, IORING_OP_SENDMSG, sock->s,
+                NET_URING_OP_SEND);
+        if (!sqe) {
+            rc = -EBUSY;
+            break;
+        }
+        sqe->addr = (unsigned long) &hdrs[i].msg_hdr;
+        sqe->len = 1;
+        pending++;
+    }
+
+    /* the headers and the payloads must outlive the sends */
+    while (pending) {
+        err = os_uring_submit_and_wait(&uu->u.ring, 1, -1);
+        if (err < 0 && err != -ETIME) {
+            ERROR("Error calling io_uring_enter() rc=%d\n", err);
+            rc = err;
+            break;
+        }
+
+        while ((cqe = os_uring_peek_cqe(&uu->u.ring))) {
+            if ((cqe->user_data & NET_URING_OP_MASK) == NET_URING_OP_SEND) {
+                pending--;
+                if (cqe->res >= 0)
+                    sent++;
+                else if (!rc) {
+                    ERROR("Error sending datagram errno=%d\n", -cqe->res);
+                    rc = cqe->res;
+                }
+            } else
+                udp_uring_stash(uu, cqe);
+            os_uring_cqe_seen(&uu->u.ring);
+        }
+    }
+
+    if (!rc)
+        rc = sent;
+    return rc;
+}
+#endif
+
+int udp_batch_init(struct udp_batch *b, int size)
+{
+    int rc = 0;
+
+    if (!b || size <= 0 || size > UDP_BATCH_MAX) {
+        rc = -EINVAL;
+        goto out;
+    }
+
+    memset(b, 0, sizeof(*b));
+    b->size = size;
+    b->buf_size = net_msg_buf_size();
+
+    b->bufs = malloc(size * b->buf_size);
+    if (!b->bufs) {
+        ERROR("could not allocate batch buffers\n");
+        rc = -ENOMEM;
+        goto out;
+    }
+
+#if CFG_NET_MMSG
+    b->hdrs = malloc(size * (sizeof(struct mmsghdr) + sizeof(struct iovec)));
+    if (!b->hdrs) {
+        ERROR("could not allocate batch headers\n");
+        free(b->bufs);
+        b->bufs = NULL;
+        rc = -ENOMEM;
+        goto out;
+    }
+#endif
+
+    for (int i = 0; i < size; i++) {
+        b->msgs[i].connection = -1;
+        b->msgs[i].netbuf = (char *) b->bufs + i * b->buf_size;
+    }
+
+#if CFG_NET_URING
+    if (do_io_uring) {
+        rc = udp_uring_init(b);
+        if (rc) {
+            INFO("io_uring not available rc=%d, falling back to recvmmsg\n", rc);
+            rc = 0;
+        }
+    }
+#endif
+out:
+    return rc;
+}
+
+void udp_batch_fini(struct udp_batch *b)
+{
+#if CFG_NET_URING
+    if (b->uring)
+        udp_uring_fini(b);
+#endif
+    if (b->hdrs) {
+        free(b->hdrs);
+        b->hdrs = NULL;
+    }
+    if (b->bufs) {
+        free(b->bufs);
+        b->bufs = NULL;
+    }
+}
+
+#if CFG_NET_MMSG
+int udp_server_recv_batch(struct mysocket *sock, struct udp_batch *b)
+{
+    struct mmsghdr *hdrs = b->hdrs;
+    int rc;
+
+#if CFG_NET_URING
+    if (b->uring) {
+        rc = udp_uring_recv_batch(sock, b);
+        goto out;
+    }
+#endif
+
+    udp_batch_prepare(b, b->size, 1);
+
+    /* block for the first datagram, then take whatever is queued */
+    do {
+        rc = recvmmsg(sock->s, hdrs, b->size, MSG_WAITFORONE, NULL);
+    } while (rc < 0 && errno == EINTR);
+    if (rc < 0) {
+        ERROR("Error calling recvmmsg() errno=%d\n", errno);
+        rc = -errno;
+        b->count = 0;
+        goto out;
+    }
+
+    for (int i = 0; i < rc; i++)
+        b->msgs[i].netbuf_size = hdrs[i].msg_len;
+    b->count = rc;
+out:
+    return rc;
+}
+
+int udp_server_send_batch(struct mysocket *sock, struct udp_batch *b)
+{
+    struct mmsghdr *hdrs = b->hdrs;
+    int sent = 0, rc = 0;
+
+#if CFG_NET_URING
+    if (b->uring) {
+        rc = udp_uring_send_batch(sock, b);
+        goto out;
+    }
+#endif
+
+    udp_batch_prepare(b, b->count, 0);
+
+    while (sent < b->count) {
+        rc = sendmmsg(sock->s, hdrs + sent, b->count - sent, 0);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            ERROR("Error calling sendmmsg() errno=%d\n", errno);
+            rc = -errno;
+            goto out;
+        }
+        sent += rc;
+    }
+    rc = sent;
+out:
+    return rc;
+}
+
+#else
+
+int udp_server_recv_batch(struct mysocket *sock, struct udp_batch *b)
+{
+    struct net_msg *m = &b->msgs[0];
+    socklen_t len = sizeof(m->client_addr);
+    int rc;
+
+    rc = recvfrom(sock->s, m->netbuf, b->buf_size, 0,
+            (struct sockaddr *) &m->client_addr, &len);
+    if (rc < 0) {
+        ERROR("Error calling recvfrom() rc=%d\n", rc);
+        b->count = 0;
+        goto out;
+    }
+
+    m->netbuf_size = rc;
+    b->count = rc = 1;
+out:
+    return rc;
+}
+
+int udp_server_send_batch(struct mysocket *sock, struct udp_batch *b)
+{
+    struct net_msg *m;
+    int i, rc = 0;
+
+    for (i = 0; i < b->count; i++) {
+        m = &b->msgs[i];
+        rc = sendto(sock->s, m->netbuf, m->netbuf_size, 0,
+                (struct sockaddr *) &m->client_addr, sizeof(m->client_addr));
+        if (rc < 0) {
+            ERROR("Error calling sendto() rc=%d\n", rc);
+            goto out;
+        }
+    }
+    rc = i;
+out:
+    return rc;
+}
+#endif
 
 int udp_client_send(struct mysocket *sock,
         struct os_net_ip *ip, unsigned short port, void *data, int size)
@@ -33,7 +33,10 @@
 #ifndef APP_COMMON_NET_H_
 #define APP_COMMON_NET_H_
 
+#include <common/cfg.h>
+
 #define DEFAULT_SERVER_PORT  6613
+#define NET_MSG_BUF_SIZE     4096
 
 struct mysocket {
     int s;
@@ -51,19 +54,140 @@ void net_msg_cleanup(struct net_msg *m);
 int os_net_ip_get_gw(struct os_net_ip *ip);
 int os_socket_set_timeout(int s, int timeout_ms);
 
+#define MYSOCKET_REUSEPORT  0x1
+
 int mysocket_init(struct mysocket *sock, int type, unsigned short port);
+int mysocket_init_flags(struct mysocket *sock, int type, unsigned short port,
+        int flags);
 int mysocket_fini(struct mysocket *sock);
 
 int tcp_server_start(struct os_server *srv, unsigned short port);
+int tcp_server_start_flags(struct os_server *srv, unsigned short port,
+        int flags);
 int tcp_server_stop(struct os_server *srv);
 int tcp_server_started(struct os_server *srv);
 int tcp_server_accept(struct os_server *srv, struct net_msg *m);
 int tcp_server_recv_msg(struct net_msg *m);
 int tcp_server_send_msg(struct net_msg *m);
 
+/*
+ * TCP event loop
+ *
+ * Multiplexes all the connections of a server on the calling thread. Each
+ * connection gets its own struct tcp_conn, whose msg.netbuf accumulates the
+ * received bytes (always NUL-terminated after rx_len). The conn_recv() hook
+ * consumes whatever it can parse with tcp_conn_consume(), queues replies with
+ * tcp_conn_queue() and returns one of TCP_CONN_KEEP / TCP_CONN_CLOSE, or a
+ * negative value on error. Queued replies are flushed once per read.
+ *
+ * On Linux the loop uses non-blocking sockets and edge-triggered epoll, or
+ * io_uring when do_io_uring is set (multishot accept, multishot recv on a
+ * provided buffer ring and sends linked to the teardown of closing
+ * connections). The io_uring backend leaves msg.client_addr unset. On the
+ * other platforms the loop falls back to serving one connection at a time.
+ */
+
+#define TCP_CONN_KEEP   0
+#define TCP_CONN_CLOSE  1
+
+struct tcp_server_loop;
+
+struct tcp_conn {
+    struct net_msg msg;
+    int rx_len;
+    void *txbuf;
+    int txbuf_size;
+    int tx_len;
+    int tx_off;
+    int closing;
+#if CFG_NET_URING
+    int uring_state;
+    void *tx_inflight;
+    int tx_inflight_len;
+    int tx_inflight_off;
+#endif
+    void *priv;
+    struct tcp_conn *prev, *next;
+};
+
+struct tcp_server_loop_ops {
+    int (*conn_open)(struct tcp_server_loop *loop, struct tcp_conn *conn);
+    int (*conn_recv)(struct tcp_server_loop *loop, struct tcp_conn *conn);
+    void (*conn_close)(struct tcp_server_loop *loop, struct tcp_conn *conn);
+};
+
+struct net_stats {
+    unsigned long conns;
+    unsigned long recvs;
+    unsigned long bytes_rx;
+    unsigned long bytes_tx;
+};
+
+struct tcp_server_loop {
+    struct os_server *srv;
+    const struct tcp_server_loop_ops *ops;
+    void *priv;
+    volatile int running;
+    int conns_num;
+    struct tcp_conn *conns;
+    struct tcp_conn *free_conns;
+#if CFG_NET_EPOLL
+    int epfd;
+#endif
+#if CFG_NET_URING
+    void *uring;
+#endif
+    struct net_stats stats;
+};
+
+int tcp_server_loop_init(struct tcp_server_loop *loop, struct os_server *srv,
+        const struct tcp_server_loop_ops *ops, void *priv);
+int tcp_server_loop_run(struct tcp_server_loop *loop);
+void tcp_server_loop_stop(struct tcp_server_loop *loop);
+void tcp_server_loop_fini(struct tcp_server_loop *loop);
+void tcp_server_loop_detach(struct tcp_server_loop *loop,
+        struct tcp_conn *conn);
+
+int tcp_conn_queue(struct tcp_conn *conn, const void *data, int size);
+void tcp_conn_consume(struct tcp_conn *conn, int size);
+
 int udp_server_start(struct mysocket *sock, unsigned short port);
+int udp_server_start_flags(struct mysocket *sock, unsigned short port,
+        int flags);
 int udp_server_recv_msg(struct mysocket *sock, struct net_msg *m);
 
+/*
+ * Batched UDP
+ *
+ * A batch owns a preallocated ring of up to UDP_BATCH_MAX buffers which are
+ * reused by every udp_server_recv_batch() call. After a receive, msgs[i]
+ * holds the payload (netbuf, netbuf_size) and the sender of the i-th datagram;
+ * udp_server_send_batch() sends msgs[i].netbuf_size bytes of each message back
+ * to its sender. On Linux both calls need a single recvmmsg()/sendmmsg(), or
+ * with do_io_uring a multishot recvmsg on a provided buffer ring, in which
+ * case msgs[i].netbuf points into the ring until the next receive and a
+ * receive may return 0 datagrams when it times out.
+ */
+
+#define UDP_BATCH_MAX  64
+
+struct udp_batch {
+    int size;
+    int count;
+    int buf_size;
+    struct net_msg msgs[UDP_BATCH_MAX];
+    void *bufs;
+    void *hdrs;
+#if CFG_NET_URING
+    void *uring;
+#endif
+};
+
+int udp_batch_init(struct udp_batch *b, int size);
+void udp_batch_fini(struct udp_batch *b);
+int udp_server_recv_batch(struct mysocket *sock, struct udp_batch *b);
+int udp_server_send_batch(struct mysocket *sock, struct udp_batch *b);
+
 int udp_client_send(struct mysocket *sock,
         struct os_net_ip *ip, unsigned short port, void *data, int size);
 int udp_client_recv(struct mysocket *sock,
@@ -20,3 +20,308 @@
 #include <common/profile.h>
 
 __thread int __app_profile_lvl;
+
+#if LIB_PROFILING && !defined(__MINIOS__)
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <common/cmdline.h>
+
+struct profile_ring {
+	struct profile_record recs[PROFILE_RING_SIZE];
+	/* only the owner thread moves head, only the drainer moves tail */
+	unsigned long head __attribute__((aligned(64)));
+	unsigned long tail __attribute__((aligned(64)));
+	unsigned long dropped;
+	int tid;
+	struct profile_ring *next;
+};
+
+static __thread struct profile_ring *profile_ring;
+static struct profile_ring *profile_rings;
+
+static int profile_drain_lock;
+static volatile int profile_drainer_running;
+
+/*
+ * With -T <prefix> the spans also go to <prefix>.<pid>.json as Chrome Trace
+ * Event "complete" events, one per line. Every process writes its own file
+ * and the timestamps are CLOCK_MONOTONIC, so the files of a parent and its
+ * forked children line up once trace-merge puts them together.
+ */
+static FILE *profile_json;
+static int profile_json_pid;
+
+static int profile_gettid(void)
+{
+#if defined(__linux__) && !defined(__Unikraft__)
+	return syscall(SYS_gettid);
+#else
+	return 0;
+#endif
+}
+
+static void profile_json_open(void)
+{
+	char path[256];
+
+	profile_json_pid = getpid();
+	snprintf(path, sizeof(path), "%s.%d.json", trace_json_prefix,
+		profile_json_pid);
+
+	profile_json = fopen(path, "w");
+	if (!profile_json) {
+		fprintf(stderr, "error: Could not open %s\n", path);
+		return;
+	}
+
+	fprintf(profile_json, "[\n{\"name\":\"process_name\",\"ph\":\"M\","
+		"\"pid\":%d,\"args\":{\"name\":\"%d (parent %d)\"}}",
+		profile_json_pid, profile_json_pid, getppid());
+}
+
+static void profile_json_write(struct profile_ring *r,
+		struct profile_record *rec)
+{
+	if (!profile_json)
+		profile_json_open();
+	if (!profile_json)
+		return;
+
+	fputs(",\n{\"name\":\"", profile_json);
+	for (const char *c = rec->label; *c; c++) {
+		if (*c == '"' || *c == '\\')
+			fputc('\\', profile_json);
+		fputc(*c, profile_json);
+	}
+	fprintf(profile_json, "\",\"ph\":\"X\",\"ts\":%.3lf,\"dur\":%.3lf,"
+		"\"pid\":%d,\"tid\":%d,\"args\":{\"lvl\":%d}}",
+		rec->start_ns / 1e3,
+		(rec->end_ns - rec->start_ns) / 1e3,
+		profile_json_pid, r->tid, rec->lvl);
+}
+
+static void profile_print(struct profile_record *rec)
+{
+	double msec = (double) (rec->end_ns - rec->start_ns) / NSECONDS_IN_MSEC;
+	FILE *fp;
+
+	if (rec->flags & PROFILE_REC_FILE) {
+		fp = fopen(PROFILE_FILE, "a");
+		if (fp) {
+			fprintf(fp, "%.6lf%s\n", msec, rec->label);
+			fclose(fp);
+		}
+		return;
+	}
+
+	PRINT_TIMESTAMP(msec, rec->lvl, rec->label);
+}
+
+void profile_flush(void)
+{
+	struct profile_ring *r;
+	struct profile_record *rec;
+	unsigned long head, tail, dropped;
+
+	while (__atomic_exchange_n(&profile_drain_lock, 1, __ATOMIC_ACQUIRE))
+		;
+
+	for (r = __atomic_load_n(&profile_rings, __ATOMIC_ACQUIRE); r;
+			r = r->next) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		for (tail = r->tail; tail != head; tail++) {
+			rec = &r->recs[tail & (PROFILE_RING_SIZE - 1)];
+			profile_print(rec);
+			if (trace_json_prefix)
+				profile_json_write(r, rec);
+		}
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+		dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+		if (dropped)
+			fprintf(stderr, PROFILE_PREFIX "# tid=%d dropped=%lu\n",
+				r->tid, dropped);
+	}
+	fflush(stderr);
+	if (profile_json)
+		fflush(profile_json);
+
+	__atomic_store_n(&profile_drain_lock, 0, __ATOMIC_RELEASE);
+}
+
+static void *profile_drainer(void *arg)
+{
+	(void) arg;
+
+	while (1) {
+		usleep(PROFILE_DRAIN_MSEC * 1000);
+		profile_flush();
+	}
+
+	return NULL;
+}
+
+/* Nothing half-drained or unflushed gets duplicated into the child */
+static void profile_atfork_prepare(void)
+{
+	while (__atomic_exchange_n(&profile_drain_lock, 1, __ATOMIC_ACQUIRE))
+		;
+	if (profile_json)
+		fflush(profile_json);
+}
+
+static void profile_atfork_parent(void)
+{
+	__atomic_store_n(&profile_drain_lock, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * A forked child starts with the parent's records, which the parent
+ * prints itself, and without the drainer thread. It writes its own json.
+ */
+static void profile_atfork_child(void)
+{
+	struct profile_ring *r;
+
+	if (profile_json) {
+		fclose(profile_json);
+		profile_json = NULL;
+	}
+	profile_drain_lock = 0;
+	for (r = profile_rings; r; r = r->next) {
+		r->tail = r->head;
+		r->dropped = 0;
+	}
+	if (profile_ring)
+		profile_ring->tid = profile_gettid();
+	profile_drainer_running = 0;
+}
+
+/* Registered once, the children inherit them */
+static void profile_init_once(void)
+{
+	atexit(profile_flush);
+	pthread_atfork(profile_atfork_prepare, profile_atfork_parent,
+		profile_atfork_child);
+}
+
+static void profile_start_drainer(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_attr_t attr;
+	pthread_t thread;
+	sigset_t set, old;
+
+	if (__atomic_exchange_n(&profile_drainer_running, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	pthread_once(&once, profile_init_once);
+
+	/* signals stay with the app threads */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, profile_drainer, NULL))
+		/* at exit then */
+		fprintf(stderr, "error: Could not start the profile drainer\n");
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static struct profile_ring *profile_ring_new(void)
+{
+	struct profile_ring *r;
+
+	tsc_init();
+
+	if (posix_memalign((void **) &r, 64, sizeof(*r)))
+		return NULL;
+	/* the records are written before they are read */
+	memset(&r->head, 0, sizeof(*r) - offsetof(struct profile_ring, head));
+	r->tid = profile_gettid();
+
+	r->next = __atomic_load_n(&profile_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&profile_rings, &r->next, r, 0,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	return r;
+}
+
+/* The next free record of the thread's ring, NULL if it is full */
+static struct profile_record *profile_record_next(void)
+{
+	struct profile_ring *r = profile_ring;
+	unsigned long head;
+
+	if (__builtin_expect(!r, 0)) {
+		r = profile_ring = profile_ring_new();
+		if (!r)
+			return NULL;
+	}
+	if (__builtin_expect(!profile_drainer_running, 0))
+		profile_start_drainer();
+
+	head = r->head;
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) ==
+			PROFILE_RING_SIZE) {
+		__atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	return &r->recs[head & (PROFILE_RING_SIZE - 1)];
+}
+
+/* Hands the record profile_record_next() returned over to the drainer */
+static void profile_record_push(void)
+{
+	__atomic_store_n(&profile_ring->head, profile_ring->head + 1,
+		__ATOMIC_RELEASE);
+}
+
+void profile_record(uint64_t start_ns, uint64_t end_ns,
+		const char *label, int lvl, int flags)
+{
+	struct profile_record *rec;
+
+	rec = profile_record_next();
+	if (!rec)
+		return;
+
+	rec->start_ns = start_ns;
+	rec->end_ns = end_ns;
+	rec->label = label;
+	rec->lvl = lvl;
+	rec->flags = flags;
+	profile_record_push();
+}
+
+void profile_record_fmt(uint64_t start_ns, uint64_t end_ns, int flags,
+		const char *fmt, ...)
+{
+	struct profile_record *rec;
+	va_list ap;
+
+	rec = profile_record_next();
+	if (!rec)
+		return;
+
+	va_start(ap, fmt);
+	vsnprintf(rec->text, sizeof(rec->text), fmt, ap);
+	va_end(ap);
+
+	rec->start_ns = start_ns;
+	rec->end_ns = end_ns;
+	rec->label = rec->text;
+	rec->lvl = 0;
+	rec->flags = flags;
+	profile_record_push();
+}
+#endif
@@ -21,6 +21,7 @@
 #define __XENCLONE_PROFILE_H__
 
 #include <stdio.h>
+#include <stdint.h>
 #include <time.h>
 
 //#define LIB_PROFILING 1
@@ -87,12 +88,6 @@ extern __thread int __app_profile_lvl;
 #define PRINT_TIMESTAMP(value, lvl, str) \
     OS_PRINT_OUT(PROFILE_PREFIX "%ld.%ld %d %s\n", \
             (long) value, (long)((value - (long) value) * 1000), lvl, str)
-#else
-#define PRINT_TIMESTAMP(value, lvl, str) \
-    fprintf(stderr, PROFILE_PREFIX "%11.6lf %d %*s %s\n", \
-    		value, lvl, 2 * lvl, "", str)
-#endif
-
 
 #define PROFILE_NESTED_TICK() \
 	{ \
@@ -109,6 +104,62 @@ extern __thread int __app_profile_lvl;
 		__app_profile_lvl--; \
 	}
 
+#define PROFILE_FLUSH()
+
+#else
+#include <common/tsc.h>
+
+#define PRINT_TIMESTAMP(value, lvl, str) \
+    fprintf(stderr, PROFILE_PREFIX "%11.6lf %d %*s %s\n", \
+    		value, lvl, 2 * lvl, "", str)
+
+/*
+ * The spans are not printed where they are measured: each thread appends
+ * fixed-size records to its own lock-free ring, which a background thread
+ * drains every PROFILE_DRAIN_MSEC and at exit, printing the same
+ * CLONING_TRACE lines as before. The label must be a static string, only
+ * its address is stored, unless it is formatted into the record's text by
+ * profile_record_fmt(). A full ring drops records and counts them.
+ */
+#define PROFILE_RING_SIZE	4096	/* records, power of 2 */
+#define PROFILE_DRAIN_MSEC	100
+#define PROFILE_TEXT_SIZE	96	/* longer formatted labels are cut */
+
+#define PROFILE_REC_FILE	(1 << 0)	/* goes to PROFILE_FILE */
+
+struct profile_record {
+	uint64_t start_ns;
+	uint64_t end_ns;
+	const char *label;
+	int lvl;
+	int flags;
+	char text[PROFILE_TEXT_SIZE];
+};
+
+void profile_record(uint64_t start_ns, uint64_t end_ns,
+		const char *label, int lvl, int flags);
+void profile_record_fmt(uint64_t start_ns, uint64_t end_ns, int flags,
+		const char *fmt, ...) __attribute__((format(printf, 4, 5)));
+
+/* Drains all the rings now, e.g. before _exit() */
+void profile_flush(void);
+
+/* timed with the TSC clock, see common/tsc.h */
+#define PROFILE_NESTED_TICK() \
+	{ \
+		uint64_t __profile_tick; \
+		__app_profile_lvl++; \
+		__profile_tick = tsc_now_nsec(); \
+
+#define PROFILE_NESTED_TOCK_MSEC(_str) \
+		profile_record(__profile_tick, tsc_now_nsec(), _str, \
+			__app_profile_lvl, 0); \
+		__app_profile_lvl--; \
+	}
+
+#define PROFILE_FLUSH()	profile_flush()
+#endif
+
 #define PROFILE_TS_SEC(fmt, ...) \
 	do { \
 		struct timespec __profile_ts; \
@@ -119,6 +170,7 @@ extern __thread int __app_profile_lvl;
 
 
 #ifndef __MINIOS__
+/* CLOCK_MONOTONIC, the timeline of the TSC spans, see common/tsc.h */
 struct profile {
 	struct timespec start;
 	struct timespec stop;
@@ -126,12 +178,12 @@ struct profile {
 
 static inline int profile_start(struct profile *p)
 {
-	return clock_gettime(CLOCK_REALTIME, &p->start);
+	return clock_gettime(CLOCK_MONOTONIC, &p->start);
 }
 
 static inline int profile_stop(struct profile *p)
 {
-    return clock_gettime(CLOCK_REALTIME, &p->stop);
+    return clock_gettime(CLOCK_MONOTONIC, &p->stop);
 }
 
 static inline double profile_msec(struct profile *p)
@@ -148,13 +200,16 @@ static inline time_t profile_sec(struct profile *p)
 
 extern int libxl_domain_create_new_profile_trigger;
 
+/*
+ * Recorded like the nested spans, with the label formatted into the
+ * record, and appended to PROFILE_FILE by the drainer.
+ */
 #define PROFILE_PRINT_MSEC(p, fmt, ...) \
     do { \
-        if (libxl_domain_create_new_profile_trigger) { \
-            FILE *fp = fopen(PROFILE_FILE, "a"); \
-            fprintf(fp, "%.6lf" fmt "\n", profile_msec(p), ## __VA_ARGS__); \
-            fclose(fp); \
-        } \
+        if (libxl_domain_create_new_profile_trigger) \
+            profile_record_fmt(timespec_nsec(&(p)->start), \
+                timespec_nsec(&(p)->stop), PROFILE_REC_FILE, \
+                fmt, ## __VA_ARGS__); \
     } while (0)
 
 #endif
@@ -163,7 +218,9 @@ extern int libxl_domain_create_new_profile_trigger;
 #define __noinstrument
 
 #define PROFILE_NESTED_TICK()
-#define PROFILE_NESTED_TOCK_MSEC(_str)
+#define PROFILE_NESTED_TOCK_MSEC(_str) \
+    do { (void) (_str); } while (0)
+#define PROFILE_FLUSH()
 
 #define profile_start(p)
 #define profile_stop(p)
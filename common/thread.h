@@ -45,5 +45,10 @@ int os_thread_create(char *name, thread_func_t func, void *arg,
         struct os_thread **pt);
 int os_thread_destroy(struct os_thread *t);
 int os_thread_wait(struct os_thread *t, void **thread_return);
+int os_thread_set_cpu(struct os_thread *t, int cpu);
+
+int os_cpus_num(void);
+/* The n-th CPU, modulo their number, of those the process may run on */
+int os_cpu_nth(int n);
 
 #endif /* APP_COMMON_THREAD_H_ */
@@ -33,6 +33,7 @@
 #ifndef APP_COMMON_TIME_H_
 #define APP_COMMON_TIME_H_
 
+#include <stdint.h>
 #include <common/cfg.h>
 #include <common/net.h>
 #ifdef __MINIOS__
@@ -43,6 +44,15 @@
 
 void os_sleep_msec(unsigned long millis);
 
+/* CLOCK_MONOTONIC in nanoseconds, for latency measurements */
+static inline uint64_t os_now_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 #if CFG_NETWORK
 int send_time(struct mysocket *sock, struct timeval *tv, char *suffix);
 #endif
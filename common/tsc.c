@@ -0,0 +1,108 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Authors: Costin Lupu <costin.lupu@cs.pub.ro>
+ *
+ * Copyright (c) 2022, University Politehnica of Bucharest. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <common/log.h>
+#include <common/tsc.h>
+
+/* long enough for a ~0.01% frequency error with a microsecond clock */
+#define TSC_CALIBRATION_NSEC    20000000ULL
+
+struct tsc_clock tsc_clock;
+
+#ifdef __x86_64__
+static inline void cpuid(uint32_t leaf, uint32_t *a, uint32_t *b,
+        uint32_t *c, uint32_t *d)
+{
+    __asm__ __volatile__("cpuid"
+        : "=a" (*a), "=b" (*b), "=c" (*c), "=d" (*d)
+        : "a" (leaf), "c" (0));
+}
+
+int tsc_init(void)
+{
+    uint64_t tsc0, tsc1, ns0, ns1;
+    uint32_t a, b, c, d;
+    int rc = 0;
+
+    if (__atomic_exchange_n(&tsc_clock.initialized, 1, __ATOMIC_ACQ_REL))
+        return tsc_clock.usable ? 0 : -1;
+
+    cpuid(0x80000000, &a, &b, &c, &d);
+    if (a < 0x80000007) {
+        rc = -1;
+        goto out;
+    }
+
+    /* invariant TSC: constant rate, ticking in all C/P-states */
+    cpuid(0x80000007, &a, &b, &c, &d);
+    if (!(d & (1U << 8))) {
+        rc = -1;
+        goto out;
+    }
+
+    cpuid(0x80000001, &a, &b, &c, &d);
+    tsc_clock.rdtscp = !!(d & (1U << 27));
+
+    /* spin rather than sleep, a descheduled sample is off by a tick */
+    ns0 = tsc_monotonic_nsec();
+    tsc0 = tsc_read();
+    do {
+        ns1 = tsc_monotonic_nsec();
+        tsc1 = tsc_read();
+    } while (ns1 - ns0 < TSC_CALIBRATION_NSEC);
+
+    if (tsc1 <= tsc0) {
+        rc = -1;
+        goto out;
+    }
+
+    tsc_clock.hz = (tsc1 - tsc0) * 1000000000ULL / (ns1 - ns0);
+    tsc_clock.mult = (uint64_t) (((unsigned __int128) (ns1 - ns0) << TSC_SHIFT) /
+        (tsc1 - tsc0));
+    tsc_clock.base_tsc = tsc1;
+    tsc_clock.base_nsec = ns1;
+    __atomic_store_n(&tsc_clock.usable, 1, __ATOMIC_RELEASE);
+
+out:
+    if (tsc_clock.usable)
+        INFO("TSC clock %.3lf GHz%s\n", tsc_clock.hz / 1e9,
+            tsc_clock.rdtscp ? " rdtscp" : "");
+    else
+        INFO("No invariant TSC, timing with clock_gettime()\n");
+    return rc;
+}
+#else
+int tsc_init(void)
+{
+    return -1;
+}
+#endif
@@ -0,0 +1,108 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Authors: Costin Lupu <costin.lupu@cs.pub.ro>
+ *
+ * Copyright (c) 2022, University Politehnica of Bucharest. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef APP_COMMON_TSC_H_
+#define APP_COMMON_TSC_H_
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Low-overhead clock for the profile macros and mem_touch_pages().
+ *
+ * On x86 with an invariant TSC, tsc_init() calibrates the TSC against
+ * CLOCK_MONOTONIC and tsc_now_nsec() turns a rdtscp (or lfence; rdtsc)
+ * reading into nanoseconds on the CLOCK_MONOTONIC timeline, without
+ * entering the kernel or the hypervisor. Everywhere else, and until
+ * tsc_init() has run, it falls back to clock_gettime(CLOCK_MONOTONIC).
+ *
+ * The calibration spins for 20ms, so it is done by the first user rather
+ * than at boot, which -t measures; later calls return right away.
+ */
+
+struct tsc_clock {
+    int initialized;
+    int usable;
+    int rdtscp;
+    uint64_t base_tsc;
+    uint64_t base_nsec;
+    uint64_t mult;      /* ns = cycles * mult >> TSC_SHIFT */
+    uint64_t hz;
+};
+
+#define TSC_SHIFT   32
+
+extern struct tsc_clock tsc_clock;
+
+int tsc_init(void);
+
+static inline uint64_t tsc_monotonic_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#ifdef __x86_64__
+static inline uint64_t tsc_read(void)
+{
+    uint32_t lo, hi, aux;
+
+    if (tsc_clock.rdtscp)
+        /* waits for the previous instructions to retire */
+        __asm__ __volatile__("rdtscp" : "=a" (lo), "=d" (hi), "=c" (aux));
+    else
+        __asm__ __volatile__("lfence; rdtsc" : "=a" (lo), "=d" (hi));
+
+    return ((uint64_t) hi << 32) | lo;
+}
+
+static inline uint64_t tsc_now_nsec(void)
+{
+    uint64_t cycles;
+
+    if (__builtin_expect(!tsc_clock.usable, 0))
+        return tsc_monotonic_nsec();
+
+    cycles = tsc_read() - tsc_clock.base_tsc;
+    return tsc_clock.base_nsec +
+        (uint64_t) (((unsigned __int128) cycles * tsc_clock.mult) >> TSC_SHIFT);
+}
+#else
+static inline uint64_t tsc_now_nsec(void)
+{
+    return tsc_monotonic_nsec();
+}
+#endif
+
+#endif /* APP_COMMON_TSC_H_ */
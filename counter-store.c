@@ -0,0 +1,158 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Authors: Costin Lupu <costin.lupu@cs.pub.ro>
+ *
+ * Copyright (c) 2022, University Politehnica of Bucharest. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <common/log.h>
+#include <common/mem.h>
+#include <counter-store.h>
+
+#define ENTRY_EMPTY     0
+#define ENTRY_BUSY      1
+#define ENTRY_READY     2
+
+#define DIV_ROUND_UP(v, d) (((v) + (d)-1) / (d))
+
+/* FNV-1a */
+static unsigned int counter_hash(const char *name, int len)
+{
+    unsigned int h = 2166136261u;
+
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char) name[i];
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+int counter_store_init(struct counter_store *cs, unsigned int capacity)
+{
+    struct counter_shard *shard;
+    unsigned int entries = 1;
+    int rc = 0;
+
+    memset(cs, 0, sizeof(*cs));
+
+    if (!os_page_size)
+        os_page_size = os_get_page_size();
+
+    /* a power of 2 per shard, probing wraps with a mask */
+    while (entries * COUNTER_STORE_SHARDS < capacity)
+        entries *= 2;
+
+    for (int i = 0; i < COUNTER_STORE_SHARDS; i++) {
+        shard = &cs->shards[i];
+        shard->pages_num = DIV_ROUND_UP(entries * sizeof(struct counter_entry),
+                os_page_size);
+
+        rc = os_alloc_pages(shard->pages_num, (char **) &shard->entries);
+        if (rc) {
+            ERROR("Error allocating counter shard rc=%d\n", rc);
+            shard->entries = NULL;
+            goto out;
+        }
+        memset(shard->entries, 0, shard->pages_num * os_page_size);
+        shard->mask = entries - 1;
+    }
+
+out:
+    if (rc)
+        counter_store_fini(cs);
+    return rc;
+}
+
+void counter_store_fini(struct counter_store *cs)
+{
+    struct counter_shard *shard;
+
+    for (int i = 0; i < COUNTER_STORE_SHARDS; i++) {
+        shard = &cs->shards[i];
+        if (shard->entries) {
+            os_free_pages((char *) shard->entries, shard->pages_num);
+            shard->entries = NULL;
+        }
+    }
+}
+
+static inline int counter_entry_match(struct counter_entry *e,
+        unsigned int hash, const char *name, int len)
+{
+    return e->hash == hash && !memcmp(e->name, name, len) && !e->name[len];
+}
+
+struct counter_entry *counter_store_lookup(struct counter_store *cs,
+        const char *name, int len, int create)
+{
+    struct counter_shard *shard;
+    struct counter_entry *e = NULL;
+    unsigned int hash, idx;
+    int state;
+
+    if (len < 0 || len > COUNTER_NAME_MAX)
+        goto out;
+
+    hash = counter_hash(name, len);
+    /* low bits pick the shard, the others the first slot in it */
+    shard = &cs->shards[hash % COUNTER_STORE_SHARDS];
+    idx = hash / COUNTER_STORE_SHARDS;
+
+    for (unsigned int i = 0; i <= shard->mask; i++) {
+        e = &shard->entries[(idx + i) & shard->mask];
+
+        state = __atomic_load_n(&e->state, __ATOMIC_ACQUIRE);
+        if (state == ENTRY_EMPTY) {
+            if (!create)
+                break;
+            if (__atomic_compare_exchange_n(&e->state, &state, ENTRY_BUSY,
+                    0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+                e->hash = hash;
+                memcpy(e->name, name, len);
+                e->name[len] = '\0';
+                __atomic_store_n(&e->state, ENTRY_READY, __ATOMIC_RELEASE);
+                goto out;
+            }
+            /* lost the race, the slot is now BUSY or READY */
+        }
+
+        /* the name of a slot being claimed is only a few stores away */
+        while (state == ENTRY_BUSY)
+            state = __atomic_load_n(&e->state, __ATOMIC_ACQUIRE);
+
+        if (counter_entry_match(e, hash, name, len))
+            goto out;
+    }
+    e = NULL;
+
+out:
+    return e;
+}
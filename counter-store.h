@@ -0,0 +1,93 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Authors: Costin Lupu <costin.lupu@cs.pub.ro>
+ *
+ * Copyright (c) 2022, University Politehnica of Bucharest. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef COUNTER_STORE_H_
+#define COUNTER_STORE_H_
+
+#include <counter.h>
+
+/*
+ * In-memory store of named 64-bit counters shared by all the workers.
+ *
+ * The table is split in COUNTER_STORE_SHARDS independent open addressing
+ * shards, picked by the name hash. Every counter sits alone in a cache line
+ * and nothing takes a lock: a new name claims an empty slot with a CAS and
+ * publishes it once its name is written, values are updated with atomic
+ * operations. Counters are never removed, so the capacity is fixed at init
+ * time and a full shard fails the creation of new names.
+ */
+
+#define COUNTER_STORE_SHARDS    64
+#define COUNTER_STORE_DEFAULT_CAPACITY  16384
+
+struct counter_entry {
+    int state;
+    unsigned int hash;
+    long long value;
+    char name[COUNTER_NAME_MAX + 1];
+} __attribute__((aligned(64)));
+
+struct counter_shard {
+    struct counter_entry *entries;
+    unsigned long pages_num;
+    unsigned int mask;
+} __attribute__((aligned(64)));
+
+struct counter_store {
+    struct counter_shard shards[COUNTER_STORE_SHARDS];
+};
+
+int counter_store_init(struct counter_store *cs, unsigned int capacity);
+void counter_store_fini(struct counter_store *cs);
+
+/* Returns NULL if the name is unknown and create is 0, or the shard is full */
+struct counter_entry *counter_store_lookup(struct counter_store *cs,
+        const char *name, int len, int create);
+
+static inline long long counter_entry_get(struct counter_entry *e)
+{
+    return __atomic_load_n(&e->value, __ATOMIC_RELAXED);
+}
+
+static inline long long counter_entry_add(struct counter_entry *e,
+        long long delta)
+{
+    return __atomic_add_fetch(&e->value, delta, __ATOMIC_RELAXED);
+}
+
+/* Returns the value before the reset */
+static inline long long counter_entry_reset(struct counter_entry *e)
+{
+    return __atomic_exchange_n(&e->value, 0, __ATOMIC_RELAXED);
+}
+
+#endif /* COUNTER_STORE_H_ */
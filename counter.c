@@ -30,73 +30,371 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <string.h>
+#include <errno.h>
+#include <common/cfg.h>
+#if CFG_SERVER_WORKERS
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#endif
 #include <common/log.h>
+#include <common/cmdline.h>
 #include <common/net.h>
+#include <common/thread.h>
+#include <common/time.h>
 #include <server-common.h>
+#include <counter.h>
+#include <counter-store.h>
 
 
-void *thread_func_counter(void *p)
+static int counter_handle(struct counter_store *store, int op,
+        const unsigned char *payload, int size, long long *value)
 {
-    struct os_server server;
-    struct net_msg msg;
-    int counter;
-    long rc;
+    struct counter_entry *e;
+    const char *name = "";
+    int len = 0, delta_size = 0;
+    long long delta = 1;
 
-    (void) p;
+    switch (op) {
+    case COUNTER_OP_ADD:
+        delta_size = 8;
+        break;
+    case COUNTER_OP_GET:
+    case COUNTER_OP_INCR:
+    case COUNTER_OP_RESET:
+        break;
+    default:
+        return COUNTER_EINVAL;
+    }
 
-    rc = server_prologue(NULL);
-    if (rc) {
-        ERROR("Error server_prologue() rc=%ld\n", rc);
-        goto out;
+    /* the name is optional, the delta is not */
+    if (size != delta_size) {
+        if (size < 1)
+            return COUNTER_EINVAL;
+        len = payload[0];
+        if (len > COUNTER_NAME_MAX || size != 1 + len + delta_size)
+            return COUNTER_EINVAL;
+        name = (const char *) payload + 1;
+    }
+    if (delta_size)
+        delta = counter_get64(payload + size - delta_size);
+
+    e = counter_store_lookup(store, name, len,
+            op == COUNTER_OP_INCR || op == COUNTER_OP_ADD);
+
+    switch (op) {
+    case COUNTER_OP_GET:
+        *value = e ? counter_entry_get(e) : 0;
+        break;
+    case COUNTER_OP_RESET:
+        *value = e ? counter_entry_reset(e) : 0;
+        break;
+    default:
+        if (!e)
+            return COUNTER_ENOSPC;
+        *value = counter_entry_add(e, delta);
+        break;
+    }
+
+    DEBUG("op=%d name=%.*s counter=%lld\n", op, len, name, *value);
+    return COUNTER_OK;
+}
+
+static int counter_conn_recv(struct tcp_server_loop *loop,
+        struct tcp_conn *conn)
+{
+    struct counter_store *store = loop->priv;
+    unsigned char *buf = conn->msg.netbuf;
+    unsigned char reply[COUNTER_REPLY_SIZE];
+    unsigned int len;
+    long long value;
+    int off = 0, status, rc = TCP_CONN_KEEP;
+
+    /* handle every complete frame, the loop sends all the replies at once */
+    while (conn->rx_len - off >= COUNTER_HDR_SIZE) {
+        len = counter_get32(buf + off);
+        if (len < 1 || len > COUNTER_FRAME_MAX - 4) {
+            ERROR("Invalid frame length %u\n", len);
+            rc = -EPROTO;
+            break;
+        }
+        if (conn->rx_len - off < (int) (4 + len))
+            break;
+
+        value = 0;
+        status = counter_handle(store, buf[off + 4],
+                buf + off + COUNTER_HDR_SIZE, len - 1, &value);
+
+        counter_put32(reply, COUNTER_REPLY_SIZE - 4);
+        reply[4] = status;
+        counter_put64(reply + COUNTER_HDR_SIZE, value);
+        rc = tcp_conn_queue(conn, reply, sizeof(reply));
+        if (rc) {
+            ERROR("Error tcp_conn_queue() rc=%d\n", rc);
+            break;
+        }
+
+        off += 4 + len;
     }
 
-    rc = tcp_server_start(&server, DEFAULT_SERVER_PORT);
+    if (off)
+        tcp_conn_consume(conn, off);
+
+    return rc;
+}
+
+static const struct tcp_server_loop_ops counter_ops = {
+    .conn_recv = counter_conn_recv,
+};
+
+static long counter_serve(struct counter_store *store, struct server_worker *w)
+{
+    struct os_server server;
+    struct tcp_server_loop loop;
+    long rc;
+
+    rc = tcp_server_start_flags(&server, DEFAULT_SERVER_PORT,
+            w ? MYSOCKET_REUSEPORT : 0);
     if (rc) {
         ERROR("Error tcp_server_start() rc=%ld\n", rc);
         goto out;
     }
     INFO("Listening....\n");
 
-    /* TODO try fork() here */
+    rc = tcp_server_loop_init(&loop, &server, &counter_ops, store);
+    if (rc) {
+        ERROR("Error tcp_server_loop_init() rc=%ld\n", rc);
+        goto out_server_stop;
+    }
+
+    if (w)
+        __atomic_store_n(&w->loop, &loop, __ATOMIC_SEQ_CST);
+    if (!w || !__atomic_load_n(&w->stop, __ATOMIC_SEQ_CST)) {
+        rc = tcp_server_loop_run(&loop);
+        if (rc)
+            ERROR("Error tcp_server_loop_run() rc=%ld\n", rc);
+    }
+    if (w) {
+        w->loop = NULL;
+        w->stats = loop.stats;
+    }
+
+    tcp_server_loop_fini(&loop);
+out_server_stop:
+    tcp_server_stop(&server);
+out:
+    return rc;
+}
+
+static long counter_worker(struct server_worker *w)
+{
+    return counter_serve(w->priv, w);
+}
+
+#if CFG_SERVER_WORKERS
+/*
+ * Benchmark (-B): 1, 2, 4, .. threads up to the number of workers (or CPUs)
+ * increment counters picked at random among COUNTER_BENCH_KEYS names, going
+ * through the same lookup as the requests. Each round reports the increments
+ * per second and checks that none of them got lost.
+ */
+#define COUNTER_BENCH_KEYS  1024
+#define COUNTER_BENCH_MSEC  1000
+
+struct counter_bench {
+    struct counter_store *store;
+    char names[COUNTER_BENCH_KEYS][16];
+    int lens[COUNTER_BENCH_KEYS];
+    volatile int stop;
+};
+
+struct counter_bench_thread {
+    struct counter_bench *b;
+    struct os_thread *thread;
+    unsigned int seed;
+    unsigned long ops;
+} __attribute__((aligned(64)));
+
+static void *counter_bench_thread_func(void *p)
+{
+    struct counter_bench_thread *t = p;
+    struct counter_bench *b = t->b;
+    struct counter_entry *e;
+    unsigned int x = t->seed, k;
+    unsigned long ops = 0;
+
+    while (!b->stop) {
+        /* xorshift32 */
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        k = x % COUNTER_BENCH_KEYS;
+
+        e = counter_store_lookup(b->store, b->names[k], b->lens[k], 1);
+        if (!e)
+            break;
+        counter_entry_add(e, 1);
+        ops++;
+    }
+    t->ops = ops;
 
-    while (1) {
-        rc = tcp_server_accept(&server, &msg);
+    return NULL;
+}
+
+static int counter_bench_round(struct counter_bench *b,
+        struct counter_bench_thread *threads, int num,
+        unsigned long *pops, double *psec)
+{
+    struct timespec ts_start, ts_stop;
+    struct counter_entry *e;
+    unsigned long ops = 0;
+    long long total = 0;
+    char thread_name[16];
+    void *ret;
+    int started, rc = 0;
+
+    b->stop = 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    for (started = 0; started < num; started++) {
+        threads[started].b = b;
+        threads[started].seed = 2463534242u + started * 7919;
+        threads[started].ops = 0;
+
+        snprintf(thread_name, sizeof(thread_name), "counter-b%d", started);
+        rc = os_thread_create(thread_name, counter_bench_thread_func,
+                &threads[started], &threads[started].thread);
         if (rc) {
-            ERROR("Error tcp_server_accept() rc=%ld\n", rc);
-            goto out_server_stop;
+            ERROR("Error os_thread_create() rc=%d\n", rc);
+            break;
         }
+        os_thread_set_cpu(threads[started].thread, os_cpu_nth(started));
+    }
 
-        rc = tcp_server_recv_msg(&msg);
-        if (rc == 0)
-            goto cleanup;
-        if (rc < 0) {
-            ERROR("Error tcp_server_recv_msg() rc=%ld\n", rc);
-            goto cleanup;
-        }
+    if (!rc)
+        os_sleep_msec(COUNTER_BENCH_MSEC);
+    b->stop = 1;
+    clock_gettime(CLOCK_MONOTONIC, &ts_stop);
 
-        memcpy(&counter, msg.netbuf, sizeof(counter));
-        INFO("counter=%d\n", counter);
+    for (int i = 0; i < started; i++) {
+        os_thread_wait(threads[i].thread, &ret);
+        os_thread_destroy(threads[i].thread);
+        ops += threads[i].ops;
+    }
+    if (rc)
+        goto out;
 
-        counter += 1;
-        memcpy(msg.netbuf, &counter, sizeof(counter));
-        msg.netbuf_size = sizeof(counter);
+    /* every increment must have landed, and the next round starts from 0 */
+    for (int k = 0; k < COUNTER_BENCH_KEYS; k++) {
+        e = counter_store_lookup(b->store, b->names[k], b->lens[k], 0);
+        if (e)
+            total += counter_entry_reset(e);
+    }
 
-        rc = tcp_server_send_msg(&msg);
-        if (rc < 0) {
-            ERROR("Error tcp_server_send_msg() rc=%ld\n", rc);
-            goto cleanup;
-        }
+    if ((long long) ops != total) {
+        ERROR("Lost %lld increments\n", (long long) ops - total);
+        rc = -EIO;
+        goto out;
+    }
 
-cleanup:
-        net_msg_cleanup(&msg);
-        if (rc < 0)
+    *pops = ops;
+    *psec = (ts_stop.tv_sec - ts_start.tv_sec) +
+        (ts_stop.tv_nsec - ts_start.tv_nsec) / 1e9;
+out:
+    return rc;
+}
+
+static int counter_bench(struct counter_store *store)
+{
+    struct counter_bench_thread *threads = NULL;
+    struct counter_bench *b;
+    unsigned long ops;
+    double sec, base = 0;
+    int max, num, rc;
+
+    max = workers_num ?: os_cpus_num();
+
+    b = malloc(sizeof(*b));
+    if (posix_memalign((void **) &threads, sizeof(*threads),
+            max * sizeof(*threads)))
+        threads = NULL;
+    if (!b || !threads) {
+        ERROR("Error allocating benchmark\n");
+        rc = -ENOMEM;
+        goto out;
+    }
+
+    b->store = store;
+    for (int k = 0; k < COUNTER_BENCH_KEYS; k++)
+        b->lens[k] = snprintf(b->names[k], sizeof(b->names[k]), "bench-%d", k);
+
+    for (num = 1; ; num = num * 2 < max ? num * 2 : max) {
+        rc = counter_bench_round(b, threads, num, &ops, &sec);
+        if (rc)
+            break;
+
+        if (!base)
+            base = ops / sec;
+        fprintf(stderr, "COUNTER_TRACE threads=%d duration=%.3lf ops=%lu "
+            "ops/s=%.0lf speedup=%.2lf\n",
+            num, sec, ops, ops / sec, ops / sec / base);
+
+        if (num == max)
             break;
     }
 
-out_server_stop:
-    tcp_server_stop(&server);
+out:
+    free(threads);
+    free(b);
+    return rc;
+}
+
+#else
+
+static int counter_bench(struct counter_store *store)
+{
+    (void) store;
+
+    ERROR("Counter benchmark not supported\n");
+    return -ENOTSUP;
+}
+#endif
+
+void *thread_func_counter(void *p)
+{
+    struct counter_store store;
+    long rc;
+
+    (void) p;
+
+    rc = counter_store_init(&store, COUNTER_STORE_DEFAULT_CAPACITY);
+    if (rc) {
+        ERROR("Error counter_store_init() rc=%ld\n", rc);
+        goto out;
+    }
+
+    if (do_bench) {
+        rc = counter_bench(&store);
+        goto out_store_fini;
+    }
+
+    rc = server_prologue(NULL);
+    if (rc) {
+        ERROR("Error server_prologue() rc=%ld\n", rc);
+        goto out_store_fini;
+    }
+
+    /* TODO try fork() here */
+
+    if (workers_num)
+        rc = server_run_workers(APP_NAME_COUNTER, counter_worker, &store);
+    else
+        rc = counter_serve(&store, NULL);
+
+out_store_fini:
+    counter_store_fini(&store);
 out:
     INFO("Exiting\n");
     return (void *) rc;
 }
-
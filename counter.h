@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Authors: Costin Lupu <costin.lupu@cs.pub.ro>
+ *
+ * Copyright (c) 2022, University Politehnica of Bucharest. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef COUNTER_H_
+#define COUNTER_H_
+
+/*
+ * Counter protocol
+ *
+ * Requests and replies are frames made of a 32-bit length, a one byte opcode
+ * and a payload. The length counts the opcode and the payload; all integers
+ * are in network byte order. Connections are persistent and clients may
+ * pipeline any number of requests: the replies come back in order, all the
+ * replies to one read in a single send.
+ *
+ * A request payload names the counter with a length byte followed by up to
+ * COUNTER_NAME_MAX characters; ADD appends a 64-bit delta. Requests without
+ * the name operate on the counter with the empty name.
+ *
+ *   GET   [name]          -> current value, 0 for unknown names
+ *   INCR  [name]          -> value after the increment
+ *   ADD   [name] delta    -> value after the addition
+ *   RESET [name]          -> value before the reset
+ *
+ * A reply carries a status (COUNTER_OK or COUNTER_E*) in the opcode byte and
+ * the 64-bit value as payload. Frames longer than COUNTER_FRAME_MAX close
+ * the connection.
+ */
+
+#define COUNTER_OP_GET      1
+#define COUNTER_OP_INCR     2
+#define COUNTER_OP_ADD      3
+#define COUNTER_OP_RESET    4
+
+#define COUNTER_OK          0
+#define COUNTER_EINVAL      1
+#define COUNTER_ENOSPC      2   /* no room for a new name */
+
+#define COUNTER_HDR_SIZE    5
+#define COUNTER_REPLY_SIZE  (COUNTER_HDR_SIZE + 8)
+#define COUNTER_FRAME_MAX   64
+#define COUNTER_NAME_MAX    47
+
+static inline void counter_put32(unsigned char *p, unsigned int v)
+{
+    for (int i = 3; i >= 0; i--, v >>= 8)
+        p[i] = v & 0xff;
+}
+
+static inline unsigned int counter_get32(const unsigned char *p)
+{
+    return ((unsigned int) p[0] << 24) | ((unsigned int) p[1] << 16) |
+        ((unsigned int) p[2] << 8) | p[3];
+}
+
+static inline void counter_put64(unsigned char *p, long long v)
+{
+    counter_put32(p, (unsigned long long) v >> 32);
+    counter_put32(p + 4, (unsigned long long) v & 0xffffffff);
+}
+
+static inline long long counter_get64(const unsigned char *p)
+{
+    return (long long) (((unsigned long long) counter_get32(p) << 32) |
+        counter_get32(p + 4));
+}
+
+/*
+ * Returns the size of the request frame written to buf, which needs room for
+ * COUNTER_FRAME_MAX bytes. A NULL name leaves the name out.
+ */
+static inline int counter_request(unsigned char *buf, int op,
+        const char *name, int len, long long delta)
+{
+    int size = COUNTER_HDR_SIZE;
+
+    buf[4] = op;
+    if (name) {
+        buf[size++] = len;
+        for (int i = 0; i < len; i++)
+            buf[size++] = name[i];
+    }
+    if (op == COUNTER_OP_ADD) {
+        counter_put64(buf + size, delta);
+        size += 8;
+    }
+    counter_put32(buf, size - 4);
+
+    return size;
+}
+
+#endif /* COUNTER_H_ */
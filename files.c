@@ -39,6 +39,7 @@
 
 #include <common/log.h>
 #include <common/cmdline.h>
+#include <common/arena.h>
 #include <common/net.h>
 #include <common/clone.h>
 #include <common/profile.h>
@@ -46,6 +47,11 @@
 
 #define SIMPLE_TEST_FILENAME "/root/files/test"
 
+#define FILES_DATA_SIZE (4 * 1024 * 1024)
+
+/* backs the write_buffer() data, reset at the end of every request */
+static struct arena files_arena;
+
 #define SIMPLE_TEST_WRITE_STR(fd, str) \
     do { \
         INFO("writing %s", str); \
@@ -200,7 +206,9 @@ static int write_buffer(int fd, unsigned long size)
     unsigned long offset;
     int rc;
 
-    buf = malloc(size);
+    buf = arena_alloc(&files_arena, size);
+    if (!buf)
+        buf = malloc(size);
     if (!buf) {
         ERROR("Error no memory");
         rc = -ENOMEM;
@@ -212,12 +220,16 @@ static int write_buffer(int fd, unsigned long size)
         rc = write(fd, buf + offset, size - offset);
         if (rc < 0) {
             ERROR("Error writing buffer rc=%d errno=%d\n", rc, errno);
-            goto out;
+            goto out_free;
         }
         offset += rc;
     }
-    free(buf);
     rc = 0;
+out_free:
+    if (arena_owns(&files_arena, buf))
+        arena_free(&files_arena, buf);
+    else
+        free(buf);
 out:
     return rc;
 }
@@ -248,13 +260,50 @@ out:
     return rc;
 }
 
+static int files_conn_recv(struct tcp_server_loop *loop,
+        struct tcp_conn *conn)
+{
+    long *result = loop->priv;
+    const char *filename;
+    char *cmd = conn->msg.netbuf;
+    int rc;
+
+    if (!strncmp(cmd, "stop", strlen("stop")))
+        tcp_server_loop_stop(loop);
+
+    else {
+        rc = str_to_write_type(cmd);
+        if (rc < 0) {
+            ERROR("Invalid write type: %s\n", cmd);
+            goto out;
+        }
+
+        filename = "/root/data";
+
+        PROFILE_NESTED_TICK();
+        rc = create_file_write_data(filename, FILES_DATA_SIZE, rc);
+        if (rc) {
+            ERROR("Error creating file '%s' errno=%d\n", filename, errno);
+            *result = rc;
+            tcp_server_loop_stop(loop);
+        }
+        PROFILE_NESTED_TOCK_MSEC("create_file_data");
+    }
+
+out:
+    tcp_conn_consume(conn, conn->rx_len);
+    return TCP_CONN_CLOSE;
+}
+
+static const struct tcp_server_loop_ops files_ops = {
+    .conn_recv = files_conn_recv,
+};
+
 static long run_server(void)
 {
     struct os_server server;
-    int keep_running;
-    struct net_msg msg;
-    const char *filename;
-    long rc;
+    struct tcp_server_loop loop;
+    long rc, result = 0;
 
     rc = tcp_server_start(&server, DEFAULT_SERVER_PORT);
     if (rc) {
@@ -263,45 +312,28 @@ static long run_server(void)
     }
     INFO("Listening....\n");
 
-    keep_running = 1;
-    while (keep_running) {
-        rc = tcp_server_accept(&server, &msg);
-        if (rc) {
-            ERROR("Error tcp_server_accept() rc=%ld\n", rc);
-            break;
-        }
-
-        rc = tcp_server_recv_msg(&msg);
-        if (rc < 0) {
-            ERROR("Error tcp_server_recv_msg() rc=%ld\n", rc);
-            keep_running = 0;
-            goto cleanup;
-        }
+    /* not fatal, write_buffer() then falls back to the heap */
+    if (arena_init(&files_arena, FILES_DATA_SIZE))
+        ERROR("Error arena_init(), using the heap\n");
 
-        if (!strncmp(msg.netbuf, "stop", strlen("stop")))
-            keep_running = 0;
-
-        else {
-            rc = str_to_write_type(msg.netbuf);
-            if (rc < 0) {
-                ERROR("Invalid write type: %s\n", (char *) msg.netbuf);
-                goto cleanup;
-            }
-
-            filename = "/root/data";
-
-            PROFILE_NESTED_TICK();
-            rc = create_file_write_data(filename, 4 * 1024 * 1024, rc);
-            if (rc) {
-                ERROR("Error creating file '%s' errno=%d\n", filename, errno);
-                keep_running = 0;
-            }
-            PROFILE_NESTED_TOCK_MSEC("create_file_data");
-        }
-cleanup:
-        net_msg_cleanup(&msg);
+    rc = tcp_server_loop_init(&loop, &server, &files_ops, &result);
+    if (rc) {
+        ERROR("Error tcp_server_loop_init() rc=%ld\n", rc);
+        goto out_server_stop;
     }
 
+    rc = tcp_server_loop_run(&loop);
+    if (rc)
+        ERROR("Error tcp_server_loop_run() rc=%ld\n", rc);
+    else
+        rc = result;
+
+    tcp_server_loop_fini(&loop);
+out_server_stop:
+    if (files_arena.start) {
+        arena_print_stats(&files_arena, "files");
+        arena_fini(&files_arena);
+    }
     tcp_server_stop(&server);
 out:
     return rc;
@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Authors: Costin Lupu <costin.lupu@cs.pub.ro>
+ *
+ * Copyright (c) 2022, University Politehnica of Bucharest. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Merges histogram dumps (-H) of several runs or machines and prints the
+ * aggregated percentiles:
+ *
+ *   hist-merge [-o merged.hist] [-n name] a.hist b.hist ...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <common/histogram.h>
+
+
+static void usage(const char *cmd)
+{
+    fprintf(stderr, "Usage: %s [-o OUT] [-n NAME] DUMP...\n", cmd);
+}
+
+int main(int argc, char **argv)
+{
+    static struct histogram total, h;
+    const char *out = NULL, *name = "merged";
+    int opt, rc = 0;
+
+    while ((opt = getopt(argc, argv, "o:n:h")) != -1) {
+        switch (opt) {
+        case 'o':
+            out = optarg;
+            break;
+        case 'n':
+            name = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            rc = opt == 'h' ? 0 : 1;
+            goto out;
+        }
+    }
+
+    if (optind == argc) {
+        usage(argv[0]);
+        rc = 1;
+        goto out;
+    }
+
+    histogram_init(&total);
+    for (int i = optind; i < argc; i++) {
+        rc = histogram_load(&h, argv[i]);
+        if (rc)
+            goto out;
+        histogram_merge(&total, &h);
+    }
+
+    histogram_print(&total, name);
+
+    if (out)
+        rc = histogram_dump(&total, out);
+out:
+    return rc ? 1 : 0;
+}
@@ -0,0 +1,670 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Authors: Costin Lupu <costin.lupu@cs.pub.ro>
+ *
+ * Copyright (c) 2022, University Politehnica of Bucharest. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Multi-threaded load generator for the counter, server-udp -e (echo) and
+ * server-udp (raw) apps, reporting throughput and latency percentiles:
+ *
+ *   loadgen [-p counter|echo|udp] [-m closed|open] [-r RATE] [-t THREADS]
+ *           [-c CONNS] [-s SIZE] [-d SECS] [-a ADDR] [-P PORT]
+ *           [-o OUT] [-n NAME]
+ *
+ * The connections are spread over the threads. In closed loop every
+ * connection keeps one request in flight and sends the next one as soon as
+ * the reply arrives. In open loop the threads schedule RATE requests per
+ * second in total, whatever the replies, and pipeline them on their
+ * connections; latency runs from the scheduled time, not from the actual
+ * send, so that a stalled server is charged for the requests it held back
+ * (coordinated omission). Raw UDP gets no replies, only its send rate is
+ * reported.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <common/histogram.h>
+#include <counter.h>
+
+/* DEFAULT_SERVER_PORT of the apps */
+#define LOADGEN_PORT            6613
+#define LOADGEN_INFLIGHT_MAX    256
+#define LOADGEN_UDP_MAX         65507
+/* echo payloads start with the scheduled time and a sequence number */
+#define LOADGEN_ECHO_HDR        16
+/* a closed loop echo request without reply for that long is lost */
+#define LOADGEN_TIMEOUT_NSEC    1000000000ULL
+#define LOADGEN_POLL_MAX_NSEC   100000000ULL
+
+#define NSEC_PER_SEC            1000000000ULL
+
+enum loadgen_proto {
+    PROTO_COUNTER,
+    PROTO_ECHO,
+    PROTO_UDP,
+};
+
+enum loadgen_mode {
+    MODE_CLOSED,
+    MODE_OPEN,
+};
+
+static const char *proto_names[] = {
+    [PROTO_COUNTER] = "counter",
+    [PROTO_ECHO] = "echo",
+    [PROTO_UDP] = "udp",
+};
+
+static const char *mode_names[] = {
+    [MODE_CLOSED] = "closed",
+    [MODE_OPEN] = "open",
+};
+
+struct loadgen_conn {
+    int fd;
+    /* scheduled times of the requests in flight, oldest first */
+    uint64_t inflight[LOADGEN_INFLIGHT_MAX];
+    unsigned int head, count;
+    unsigned char tx[LOADGEN_INFLIGHT_MAX * COUNTER_FRAME_MAX];
+    int tx_len;
+    unsigned char rx[LOADGEN_INFLIGHT_MAX * COUNTER_REPLY_SIZE];
+    int rx_len;
+};
+
+struct loadgen_thread {
+    pthread_t pthread;
+    int id;
+    struct loadgen_conn *conns;
+    int conns_num;
+    int next_conn;
+    unsigned char *buf;
+    uint64_t seq;
+    uint64_t sent;
+    uint64_t recvd;
+    uint64_t errors;
+    uint64_t lost;
+    uint64_t inflight;
+    struct histogram hist;
+    int rc;
+};
+
+static enum loadgen_proto proto = PROTO_COUNTER;
+static enum loadgen_mode mode = MODE_CLOSED;
+static struct sockaddr_in server_addr;
+static int threads_num = 1;
+static int conns_num = 1;
+static int payload_size = 64;
+static double rate;
+static uint64_t duration_nsec = 10 * NSEC_PER_SEC;
+static char counter_name[COUNTER_NAME_MAX];
+static int counter_name_len;
+static pthread_barrier_t start_barrier;
+
+
+static inline uint64_t now_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static int lookup(const char **names, int num, const char *s)
+{
+    for (int i = 0; i < num; i++) {
+        if (!strcmp(s, names[i]))
+            return i;
+    }
+
+    return -1;
+}
+
+static int conn_open(struct loadgen_conn *c)
+{
+    int one = 1, rc = 0;
+
+    memset(c, 0, sizeof(*c));
+
+    c->fd = socket(AF_INET, proto == PROTO_COUNTER ? SOCK_STREAM : SOCK_DGRAM,
+        0);
+    if (c->fd < 0) {
+        rc = -errno;
+        goto out;
+    }
+
+    if (connect(c->fd, (struct sockaddr *) &server_addr,
+            sizeof(server_addr))) {
+        rc = -errno;
+        fprintf(stderr, "error connecting to %s:%d errno=%d\n",
+            inet_ntoa(server_addr.sin_addr), ntohs(server_addr.sin_port),
+            errno);
+        goto out_close;
+    }
+
+    if (proto == PROTO_COUNTER)
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK)) {
+        rc = -errno;
+        goto out_close;
+    }
+
+    return 0;
+
+out_close:
+    close(c->fd);
+out:
+    c->fd = -1;
+    return rc;
+}
+
+static void conn_fail(struct loadgen_thread *t, struct loadgen_conn *c)
+{
+    t->errors++;
+    t->lost += c->count;
+    c->count = 0;
+    close(c->fd);
+    c->fd = -1;
+}
+
+static void conn_flush(struct loadgen_thread *t, struct loadgen_conn *c)
+{
+    ssize_t n;
+
+    if (c->fd < 0 || !c->tx_len)
+        return;
+
+    n = send(c->fd, c->tx, c->tx_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            conn_fail(t, c);
+        return;
+    }
+
+    c->tx_len -= n;
+    memmove(c->tx, c->tx + n, c->tx_len);
+}
+
+/* Issues a request scheduled at sched_nsec, -EAGAIN if c cannot take one */
+static int conn_send(struct loadgen_thread *t, struct loadgen_conn *c,
+        uint64_t sched_nsec)
+{
+    ssize_t n;
+
+    if (c->fd < 0)
+        return -EAGAIN;
+
+    switch (proto) {
+    case PROTO_COUNTER:
+        if (c->count == LOADGEN_INFLIGHT_MAX)
+            return -EAGAIN;
+        c->tx_len += counter_request(c->tx + c->tx_len, COUNTER_OP_INCR,
+            counter_name_len ? counter_name : NULL, counter_name_len, 0);
+        c->inflight[(c->head + c->count++) % LOADGEN_INFLIGHT_MAX] =
+            sched_nsec;
+        break;
+
+    case PROTO_ECHO:
+        counter_put64(t->buf, sched_nsec);
+        counter_put64(t->buf + 8, t->seq++);
+        /* fall through */
+    case PROTO_UDP:
+        n = send(c->fd, t->buf, payload_size, MSG_DONTWAIT);
+        if (n < 0) {
+            /* a full socket buffer drops the datagram, like the network */
+            if (errno != EAGAIN && errno != EWOULDBLOCK &&
+                    errno != ECONNREFUSED)
+                conn_fail(t, c);
+            t->errors++;
+            return 0;
+        }
+        if (proto == PROTO_ECHO) {
+            c->inflight[c->head] = sched_nsec;
+            c->count = 1;
+        }
+        break;
+    }
+
+    t->sent++;
+    return 0;
+}
+
+static struct loadgen_conn *conn_pick(struct loadgen_thread *t,
+        uint64_t sched_nsec)
+{
+    struct loadgen_conn *c;
+
+    for (int i = 0; i < t->conns_num; i++) {
+        c = &t->conns[t->next_conn];
+        t->next_conn = (t->next_conn + 1) % t->conns_num;
+        if (!conn_send(t, c, sched_nsec))
+            return c;
+    }
+
+    return NULL;
+}
+
+static void conn_recv_counter(struct loadgen_thread *t, struct loadgen_conn *c,
+        uint64_t now)
+{
+    unsigned int len;
+    int off = 0;
+    ssize_t n;
+
+    n = recv(c->fd, c->rx + c->rx_len, sizeof(c->rx) - c->rx_len,
+        MSG_DONTWAIT);
+    if (n <= 0) {
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            conn_fail(t, c);
+        return;
+    }
+    c->rx_len += n;
+
+    while (c->rx_len - off >= COUNTER_HDR_SIZE) {
+        len = counter_get32(c->rx + off);
+        if (len + 4 > COUNTER_FRAME_MAX || !c->count) {
+            fprintf(stderr, "error unexpected counter reply\n");
+            conn_fail(t, c);
+            return;
+        }
+        if (c->rx_len - off < (int) len + 4)
+            break;
+
+        if (c->rx[off + 4] != COUNTER_OK)
+            t->errors++;
+        histogram_record(&t->hist, now - c->inflight[c->head]);
+        c->head = (c->head + 1) % LOADGEN_INFLIGHT_MAX;
+        c->count--;
+        t->recvd++;
+        off += len + 4;
+    }
+
+    c->rx_len -= off;
+    memmove(c->rx, c->rx + off, c->rx_len);
+}
+
+static void conn_recv_echo(struct loadgen_thread *t, struct loadgen_conn *c,
+        uint64_t now)
+{
+    ssize_t n;
+
+    while ((n = recv(c->fd, t->buf, LOADGEN_UDP_MAX, MSG_DONTWAIT)) > 0) {
+        if (n < LOADGEN_ECHO_HDR) {
+            t->errors++;
+            continue;
+        }
+        histogram_record(&t->hist, now - counter_get64(t->buf));
+        c->count = 0;
+        t->recvd++;
+    }
+
+    /* e.g. ECONNREFUSED while nothing listens on the port */
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        t->errors++;
+}
+
+static void thread_run(struct loadgen_thread *t)
+{
+    struct loadgen_conn *c;
+    struct pollfd *pfds;
+    struct timespec timeout;
+    uint64_t start, deadline, now, next, wait, issued = 0;
+    double interval = 0;
+    int alive;
+
+    pfds = calloc(t->conns_num, sizeof(*pfds));
+    if (!pfds) {
+        t->rc = -ENOMEM;
+        return;
+    }
+
+    start = now = now_nsec();
+    deadline = start + duration_nsec;
+    if (mode == MODE_OPEN) {
+        interval = NSEC_PER_SEC / (rate / threads_num);
+        /* spread the threads' schedules over one interval */
+        start += interval * t->id / threads_num;
+    } else {
+        for (int i = 0; i < t->conns_num; i++)
+            conn_send(t, &t->conns[i], now);
+    }
+
+    while (now < deadline) {
+        if (mode == MODE_OPEN) {
+            /* late requests keep their scheduled time */
+            for (next = start + (uint64_t) (issued * interval);
+                    next <= now && conn_pick(t, next);
+                    next = start + (uint64_t) (issued * interval))
+                issued++;
+        } else if (proto == PROTO_UDP) {
+            /* no replies to wait for */
+            for (int i = 0; i < t->conns_num; i++)
+                conn_send(t, &t->conns[i], now);
+        }
+
+        alive = 0;
+        for (int i = 0; i < t->conns_num; i++) {
+            c = &t->conns[i];
+            conn_flush(t, c);
+            pfds[i].fd = c->fd;
+            pfds[i].events = proto == PROTO_UDP ? 0 : POLLIN;
+            if (c->tx_len)
+                pfds[i].events |= POLLOUT;
+            pfds[i].revents = 0;
+            alive += c->fd >= 0;
+        }
+        if (!alive) {
+            fprintf(stderr, "error thread %d lost all its connections\n",
+                t->id);
+            t->rc = -ECONNRESET;
+            break;
+        }
+
+        /* a due request waits for room, i.e. for replies */
+        next = start + (uint64_t) (issued * interval);
+        wait = deadline - now;
+        if (mode == MODE_OPEN && next > now && next < deadline)
+            wait = next - now;
+        else if (mode == MODE_CLOSED && proto == PROTO_UDP)
+            wait = 0;
+        if (wait > LOADGEN_POLL_MAX_NSEC)
+            wait = LOADGEN_POLL_MAX_NSEC;
+        timeout.tv_sec = wait / NSEC_PER_SEC;
+        timeout.tv_nsec = wait % NSEC_PER_SEC;
+
+        if (ppoll(pfds, t->conns_num, &timeout, NULL) < 0 && errno != EINTR) {
+            t->rc = -errno;
+            break;
+        }
+
+        now = now_nsec();
+        for (int i = 0; i < t->conns_num; i++) {
+            c = &t->conns[i];
+            if (c->fd < 0)
+                continue;
+            if (pfds[i].revents & (POLLIN | POLLERR | POLLHUP)) {
+                if (proto == PROTO_COUNTER)
+                    conn_recv_counter(t, c, now);
+                else if (proto == PROTO_ECHO)
+                    conn_recv_echo(t, c, now);
+            }
+
+            if (mode == MODE_CLOSED && proto == PROTO_ECHO && c->count &&
+                    now - c->inflight[c->head] > LOADGEN_TIMEOUT_NSEC) {
+                t->lost++;
+                c->count = 0;
+            }
+            if (mode == MODE_CLOSED && !c->count && proto != PROTO_UDP)
+                conn_send(t, c, now);
+        }
+    }
+
+    for (int i = 0; i < t->conns_num; i++)
+        if (proto == PROTO_COUNTER)
+            t->inflight += t->conns[i].count;
+    if (proto == PROTO_ECHO && mode == MODE_OPEN)
+        t->lost = t->sent - t->recvd;
+
+    free(pfds);
+}
+
+static void *thread_func(void *arg)
+{
+    struct loadgen_thread *t = arg;
+    int opened = 0;
+
+    histogram_init(&t->hist);
+
+    t->buf = calloc(1, LOADGEN_UDP_MAX);
+    if (!t->buf)
+        t->rc = -ENOMEM;
+
+    for (; !t->rc && opened < t->conns_num; opened++)
+        t->rc = conn_open(&t->conns[opened]);
+
+    /* every thread gets there, so that none waits forever */
+    pthread_barrier_wait(&start_barrier);
+
+    if (!t->rc)
+        thread_run(t);
+
+    for (int i = 0; i < opened; i++)
+        if (t->conns[i].fd >= 0)
+            close(t->conns[i].fd);
+    free(t->buf);
+
+    return NULL;
+}
+
+static void usage(const char *cmd)
+{
+    fprintf(stderr, "Usage: %s [OPTION]...\n", cmd);
+    fprintf(stderr, "  -p PROTO   counter (TCP), echo (server-udp -e) or udp "
+        "(raw datagrams) [counter]\n");
+    fprintf(stderr, "  -m MODE    closed (one request in flight per "
+        "connection) or open (fixed rate) [closed]\n");
+    fprintf(stderr, "  -r RATE    requests per second in open loop\n");
+    fprintf(stderr, "  -t NUM     threads [1]\n");
+    fprintf(stderr, "  -c NUM     connections, spread over the threads [1]\n");
+    fprintf(stderr, "  -s BYTES   payload size; the counter name, at most %d "
+        "[64]\n", COUNTER_NAME_MAX);
+    fprintf(stderr, "  -d SECS    duration [10]\n");
+    fprintf(stderr, "  -a ADDR    server address [127.0.0.1]\n");
+    fprintf(stderr, "  -P PORT    server port [%d]\n", LOADGEN_PORT);
+    fprintf(stderr, "  -o OUT     also dump the latency histogram, see "
+        "hist-merge\n");
+    fprintf(stderr, "  -n NAME    histogram name [loadgen-PROTO-MODE]\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct loadgen_thread *threads;
+    static struct histogram total;
+    const char *addr = "127.0.0.1", *out = NULL, *name = NULL;
+    char default_name[32];
+    uint64_t start, elapsed, sent = 0, recvd = 0, errors = 0, lost = 0;
+    uint64_t inflight = 0;
+    struct loadgen_conn *conns;
+    int port = LOADGEN_PORT, opt, created, rc = 0;
+
+    while ((opt = getopt(argc, argv, "p:m:r:t:c:s:d:a:P:o:n:h")) != -1) {
+        switch (opt) {
+        case 'p':
+            rc = lookup(proto_names, 3, optarg);
+            if (rc < 0) {
+                fprintf(stderr, "Unsupported protocol: %s\n", optarg);
+                goto out;
+            }
+            proto = rc;
+            rc = 0;
+            break;
+        case 'm':
+            rc = lookup(mode_names, 2, optarg);
+            if (rc < 0) {
+                fprintf(stderr, "Unsupported mode: %s\n", optarg);
+                goto out;
+            }
+            mode = rc;
+            rc = 0;
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 't':
+            threads_num = atoi(optarg);
+            break;
+        case 'c':
+            conns_num = atoi(optarg);
+            break;
+        case 's':
+            payload_size = atoi(optarg);
+            break;
+        case 'd':
+            duration_nsec = atof(optarg) * NSEC_PER_SEC;
+            break;
+        case 'a':
+            addr = optarg;
+            break;
+        case 'P':
+            port = atoi(optarg);
+            break;
+        case 'o':
+            out = optarg;
+            break;
+        case 'n':
+            name = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            rc = opt == 'h' ? 0 : 1;
+            goto out;
+        }
+    }
+
+    if (threads_num < 1 || conns_num < 1 || !duration_nsec ||
+            (mode == MODE_OPEN && rate <= 0)) {
+        fprintf(stderr, "Threads, connections, duration and the open loop "
+            "rate should be positive\n");
+        rc = 1;
+        goto out;
+    }
+    if (threads_num > conns_num)
+        threads_num = conns_num;
+
+    if (proto == PROTO_COUNTER) {
+        if (payload_size < 0 || payload_size > COUNTER_NAME_MAX)
+            payload_size = payload_size < 0 ? 0 : COUNTER_NAME_MAX;
+        counter_name_len = payload_size;
+        for (int i = 0; i < counter_name_len; i++)
+            counter_name[i] = "loadgen"[i % 7];
+    } else if (payload_size < (proto == PROTO_ECHO ? LOADGEN_ECHO_HDR : 1) ||
+            payload_size > LOADGEN_UDP_MAX) {
+        fprintf(stderr, "Payload size should be between %d and %d\n",
+            proto == PROTO_ECHO ? LOADGEN_ECHO_HDR : 1, LOADGEN_UDP_MAX);
+        rc = 1;
+        goto out;
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, addr, &server_addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid address: %s\n", addr);
+        rc = 1;
+        goto out;
+    }
+
+    threads = calloc(threads_num, sizeof(*threads));
+    conns = calloc(conns_num, sizeof(*conns));
+    if (!threads || !conns) {
+        fprintf(stderr, "Error no memory\n");
+        rc = 1;
+        goto out_free;
+    }
+
+    pthread_barrier_init(&start_barrier, NULL, threads_num + 1);
+
+    for (created = 0; created < threads_num; created++) {
+        struct loadgen_thread *t = &threads[created];
+
+        t->id = created;
+        /* the first conns_num % threads_num threads get one more */
+        t->conns_num = conns_num / threads_num +
+            (created < conns_num % threads_num);
+        t->conns = conns + created * (conns_num / threads_num) +
+            (created < conns_num % threads_num ? created :
+             conns_num % threads_num);
+
+        rc = pthread_create(&t->pthread, NULL, thread_func, t);
+        if (rc) {
+            fprintf(stderr, "Error pthread_create() rc=%d\n", rc);
+            /* the barrier still expects threads_num + 1 waiters */
+            exit(1);
+        }
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    start = now_nsec();
+
+    histogram_init(&total);
+    for (int i = 0; i < threads_num; i++) {
+        pthread_join(threads[i].pthread, NULL);
+        if (threads[i].rc)
+            rc = threads[i].rc;
+        histogram_merge(&total, &threads[i].hist);
+        sent += threads[i].sent;
+        recvd += threads[i].recvd;
+        errors += threads[i].errors;
+        lost += threads[i].lost;
+        inflight += threads[i].inflight;
+    }
+    elapsed = now_nsec() - start;
+
+    fprintf(stderr, "LOADGEN_TRACE proto=%s mode=%s threads=%d conns=%d "
+        "size=%d rate=%.0lf duration=%.3lf sent=%llu recvd=%llu "
+        "errors=%llu lost=%llu inflight=%llu throughput=%.0lf\n",
+        proto_names[proto], mode_names[mode], threads_num, conns_num,
+        payload_size, rate, (double) elapsed / NSEC_PER_SEC,
+        (unsigned long long) sent, (unsigned long long) recvd,
+        (unsigned long long) errors, (unsigned long long) lost,
+        (unsigned long long) inflight,
+        (double) (proto == PROTO_UDP ? sent : recvd) * NSEC_PER_SEC / elapsed);
+
+    if (proto != PROTO_UDP) {
+        if (!name) {
+            snprintf(default_name, sizeof(default_name), "loadgen-%s-%s",
+                proto_names[proto], mode_names[mode]);
+            name = default_name;
+        }
+        histogram_print(&total, name);
+        if (out && histogram_dump(&total, out))
+            rc = 1;
+    }
+
+    pthread_barrier_destroy(&start_barrier);
+out_free:
+    free(conns);
+    free(threads);
+out:
+    return rc ? 1 : 0;
+}
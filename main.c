@@ -47,7 +47,9 @@
 #include <common/cmdline.h>
 #include <common/boot.h>
 #include <common/thread.h>
+#include <common/bufpool.h>
 #include <apps.h>
+#include <server-common.h>
 
 
 enum app app;
@@ -57,6 +59,24 @@ int do_clone = 0;
 int children_num = 1;
 int sleep_between_clones_msec = 1000;
 char *memory_str;
+int workers_num = 0;
+int do_echo = 0;
+int netbuf_size = BUFPOOL_DEFAULT_BUF_SIZE;
+int netbuf_count = BUFPOOL_DEFAULT_BUF_COUNT;
+int do_io_uring = 0;
+int do_bench = 0;
+int pool_size = 0;
+enum fork_mode fork_mode = FORK_MODE_LINEAR;
+int fork_fanout = 2;
+enum clone_mode clone_mode = CLONE_MODE_FORK;
+enum touch_mode touch_mode = TOUCH_MODE_WORD;
+int touch_threads = 1;
+enum page_mode page_mode = PAGE_MODE_DEFAULT;
+char *regions_str;
+char *numa_str;
+char *cpus_str;
+char *hist_dump_prefix;
+char *trace_json_prefix;
 
 struct app_entry {
     const char *name;
@@ -105,6 +125,102 @@ enum app string_to_app(const char *s)
     return APP_NONE;
 }
 
+static const char *fork_mode_names[] = {
+    [FORK_MODE_LINEAR] = "linear",
+    [FORK_MODE_TREE] = "tree",
+    [FORK_MODE_HELPER] = "helper",
+};
+
+int string_to_fork_mode(const char *s, enum fork_mode *mode)
+{
+    int i;
+
+    for (i = 0; i < (int) (sizeof(fork_mode_names) / sizeof(fork_mode_names[0])); i++) {
+        if (!strcmp(s, fork_mode_names[i])) {
+            *mode = i;
+            return 0;
+        }
+    }
+
+    return -EINVAL;
+}
+
+const char *fork_mode_to_string(enum fork_mode mode)
+{
+    return fork_mode_names[mode];
+}
+
+static const char *clone_mode_names[] = {
+    [CLONE_MODE_FORK] = "fork",
+    [CLONE_MODE_LAZY] = "lazy",
+};
+
+int string_to_clone_mode(const char *s, enum clone_mode *mode)
+{
+    int i;
+
+    for (i = 0; i < (int) (sizeof(clone_mode_names) / sizeof(clone_mode_names[0])); i++) {
+        if (!strcmp(s, clone_mode_names[i])) {
+            *mode = i;
+            return 0;
+        }
+    }
+
+    return -EINVAL;
+}
+
+const char *clone_mode_to_string(enum clone_mode mode)
+{
+    return clone_mode_names[mode];
+}
+
+static const char *touch_mode_names[] = {
+    [TOUCH_MODE_WORD] = "word",
+    [TOUCH_MODE_FILL] = "fill",
+    [TOUCH_MODE_NT] = "nt",
+};
+
+int string_to_touch_mode(const char *s, enum touch_mode *mode)
+{
+    int i;
+
+    for (i = 0; i < (int) (sizeof(touch_mode_names) / sizeof(touch_mode_names[0])); i++) {
+        if (!strcmp(s, touch_mode_names[i])) {
+            *mode = i;
+            return 0;
+        }
+    }
+
+    return -EINVAL;
+}
+
+static const char *page_mode_names[] = {
+    [PAGE_MODE_DEFAULT] = "default",
+    [PAGE_MODE_4K] = "4k",
+    [PAGE_MODE_THP] = "thp",
+    [PAGE_MODE_2M] = "2m",
+    [PAGE_MODE_1G] = "1g",
+};
+
+int string_to_page_mode(const char *s, enum page_mode *mode)
+{
+    int i;
+
+    for (i = 0; i < (int) (sizeof(page_mode_names) / sizeof(page_mode_names[0])); i++) {
+        if (!strcmp(s, page_mode_names[i])) {
+            *mode = i;
+            return 0;
+        }
+    }
+
+    return -EINVAL;
+}
+
+const char *page_mode_to_string(enum page_mode mode)
+{
+    return page_mode_names[mode];
+}
+
 void print_usage(char *cmd)
 {
     OS_PRINT_OUT("Usage: %s [OPTION]..\n", cmd);
@@ -114,9 +230,28 @@ void print_usage(char *cmd)
     OS_PRINT_OUT("-a, --app                     Application name\n");
     OS_PRINT_OUT("-t, --send-time               Report boot time via UDP [default: false]\n");
     OS_PRINT_OUT("-f, --fork                    Create clones [default: false]\n");
+    OS_PRINT_OUT("-x, --clone                   Create clones with os_clone() [default: false]\n");
+    OS_PRINT_OUT("-F, --fork-mode               How -f forks: linear (parent forks all), tree (children fork too), helper (slim process forked at startup forks all) [default: linear]\n");
+    OS_PRINT_OUT("-k, --fork-fanout             # of children each process forks in tree mode [default: 2]\n");
+    OS_PRINT_OUT("-X, --clone-mode              How os_clone() copies the measure-fork memory: fork (page tables copied) or lazy (snapshot faulted in through userfaultfd, Linux only) [default: fork]\n");
+    OS_PRINT_OUT("-H, --hist-dump               Also write the latency histograms to <prefix><name>.hist, see hist-merge\n");
+    OS_PRINT_OUT("-T, --trace-json              Also write profile spans to <prefix>.<pid>.json, see trace-merge (LIB_PROFILING builds)\n");
     OS_PRINT_OUT("-c, --children                Children number [default: 1]\n");
     OS_PRINT_OUT("-s, --sleep                   # of milliseconds to sleep between each cloning [default: 1]\n");
     OS_PRINT_OUT("-m, --memory                  Memory size\n");
+    OS_PRINT_OUT("-W, --touch-mode              How memory pages are touched: word (one word per page), fill (whole page), nt (whole page, non-temporal stores) [default: word]\n");
+    OS_PRINT_OUT("-j, --touch-threads           # of threads touching memory pages, 0 for one per CPU (Linux only) [default: 1]\n");
+    OS_PRINT_OUT("-P, --page-mode               Pages backing the -m memory: default, 4k (no THP), thp (madvise), 2m or 1g (hugetlb, Linux only) [default: default]\n");
+    OS_PRINT_OUT("-R, --regions                 Extra regions by what forked children inherit, e.g. cow:1GB,shared:64MB,dontfork:512MB,wipe:512MB (measure-fork, children; Linux only except cow)\n");
+    OS_PRINT_OUT("-N, --numa                    Memory policy of the allocated pages: default, bind, interleave or preferred, optionally followed by :<node list> (Linux only) [default: default]\n");
+    OS_PRINT_OUT("-C, --cpus                    CPU list the app and its children run on, e.g. 0-3,8 (Linux only) [default: all]\n");
+    OS_PRINT_OUT("-e, --echo                    Echo received datagrams back to the sender [default: false]\n");
+    OS_PRINT_OUT("-b, --netbuf-size             Size of the preallocated network buffers [default: 4096]\n");
+    OS_PRINT_OUT("-n, --netbuf-count            # of preallocated network buffers, 0 to disable the pool [default: 1024]\n");
+    OS_PRINT_OUT("-u, --io-uring                Serve the network with io_uring, falls back to epoll (Linux only) [default: false]\n");
+    OS_PRINT_OUT("-B, --bench                   Run the app's built-in benchmark instead of serving (counter) [default: false]\n");
+    OS_PRINT_OUT("-p, --pool                    # of pre-forked children kept ready by the children app, 0 clones on request (Linux only) [default: 0]\n");
+    OS_PRINT_OUT("-w, --workers                 # of server worker threads, each with its own SO_REUSEPORT socket [default: 0]\n");
 }
 
 #if CONFIG_LIBPROFILING_TRACING
@@ -144,6 +279,18 @@ int main(int argc, char **argv)
         goto out;
     }
 
+    rc = server_fork_helper_start();
+    if (rc) {
+        ERROR("Error calling server_fork_helper_start() rc=%d\n", rc);
+        goto out;
+    }
+
+    rc = bufpool_init(netbuf_size, netbuf_count);
+    if (rc) {
+        ERROR("Error calling bufpool_init() rc=%d\n", rc);
+        goto out;
+    }
+
     switch (app) {
 #if CONFIG_CLONING_APP_COUNTER
     case APP_COUNTER:
@@ -196,6 +343,9 @@ int main(int argc, char **argv)
         goto out;
     }
 
+    if (netbuf_count)
+        bufpool_print_stats();
+    bufpool_fini();
 out:
     return rc;
 }
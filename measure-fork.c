@@ -30,40 +30,239 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <errno.h>
+#include <poll.h>
 #include <string.h>
 #include <unistd.h>
+#include <common/cfg.h>
 #include <common/log.h>
 #include <common/cmdline.h>
 #include <common/boot.h>
 #include <common/time.h>
 #include <common/mem.h>
+#include <common/clone.h>
 #include <common/net.h>
 #include <common/profile.h>
 #include <server-common.h>
+#if CFG_NUMA
+#include <os/posix/numa.h>
+#endif
 
 
 #define DIV_ROUND_UP(v, d) (((v) + (d)-1) / (d))
+/* how long "clone" waits for the child to report it runs */
+#define MEASURE_CLONE_READY_MS  10000
 
-void *thread_func_measure_fork(void *p)
-{
+struct measure_fork {
     char *start;
     unsigned long pages_num;
+    /* -R regions, forked along with the -m memory */
+    struct mem_regions regions;
+    struct histogram fork_hist;
+    /* "clone": os_clone() latency and until the child runs */
+    struct histogram clone_hist;
+    struct histogram clone_ready_hist;
+    /* the first error that stopped the loop */
+    long rc;
+};
+
+static int measure_clone(struct measure_fork *mf)
+{
+    uint64_t start_nsec, ready_nsec;
+    struct pollfd pfd;
+    int ready[2], rc;
+
+    /* one pipe per clone, so one dying before it reports closes it */
+    if (pipe(ready)) {
+        rc = -errno;
+        ERROR("Error pipe() rc=%d\n", rc);
+        goto out;
+    }
+
+    start_nsec = os_now_nsec();
+    rc = os_clone(1);
+    if (rc == 1) {
+        /* child, after a lazy clone set its snapshot up */
+        ready_nsec = os_now_nsec() - start_nsec;
+        if (write(ready[1], &ready_nsec, sizeof(ready_nsec)) < 0)
+            os_exit(1);
+        os_exit(0);
+    }
+    if (!rc)
+        histogram_record(&mf->clone_hist, os_now_nsec() - start_nsec);
+    close(ready[1]);
+    if (rc) {
+        ERROR("Error os_clone() rc=%d\n", rc);
+        goto out_close;
+    }
+
+    pfd.fd = ready[0];
+    pfd.events = POLLIN;
+    do {
+        rc = poll(&pfd, 1, MEASURE_CLONE_READY_MS);
+    } while (rc < 0 && errno == EINTR);
+    if (rc < 0) {
+        rc = -errno;
+        ERROR("Error poll() rc=%d\n", rc);
+        goto out_close;
+    }
+    if (!rc) {
+        ERROR("Clone not running after %d ms\n", MEASURE_CLONE_READY_MS);
+        rc = -ETIMEDOUT;
+        goto out_close;
+    }
+
+    if (read(ready[0], &ready_nsec, sizeof(ready_nsec)) !=
+            sizeof(ready_nsec)) {
+        ERROR("Clone exited before running\n");
+        rc = -ECHILD;
+        goto out_close;
+    }
+    histogram_record(&mf->clone_ready_hist, ready_nsec);
+    rc = 0;
+
+out_close:
+    close(ready[0]);
+out:
+    return rc;
+}
+
+static int measure_fork_alloc(struct measure_fork *mf)
+{
+    if (!mf->pages_num)
+        return 0;
+#if CFG_LAZY_CLONE
+    if (clone_mode == CLONE_MODE_LAZY)
+        return os_clone_region_alloc(mf->pages_num, &mf->start);
+#endif
+    return os_alloc_pages_mode(mf->pages_num, page_mode, &mf->start);
+}
+
+static void measure_fork_free(struct measure_fork *mf)
+{
+    if (!mf->pages_num)
+        return;
+#if CFG_LAZY_CLONE
+    if (clone_mode == CLONE_MODE_LAZY) {
+        os_clone_region_free(mf->start, mf->pages_num);
+        return;
+    }
+#endif
+    os_free_pages_mode(mf->start, mf->pages_num, page_mode);
+}
+
+/* "cow:1GB,wipe:512MB" is reported as measure-fork-cow1GB-wipe512MB */
+static void measure_fork_name_regions(char *name, size_t size)
+{
+    size_t len = strlen(name);
+    const char *p;
+
+    if (!regions_str || len + 1 >= size)
+        return;
+
+    name[len++] = '-';
+    for (p = regions_str; *p && len + 1 < size; p++) {
+        if (*p == ':')
+            continue;
+        name[len++] = *p == ',' ? '-' : *p;
+    }
+    name[len] = '\0';
+}
+
+static void measure_fork_report(struct measure_fork *mf)
+{
+    char name[128];
+
+    if (page_mode == PAGE_MODE_DEFAULT)
+        snprintf(name, sizeof(name), "measure-fork");
+    else
+        snprintf(name, sizeof(name), "measure-fork-%s",
+            page_mode_to_string(page_mode));
+    measure_fork_name_regions(name, sizeof(name));
+    server_report_histogram(&mf->fork_hist, name);
+
+    if (!mf->clone_hist.count)
+        return;
+
+    snprintf(name, sizeof(name), "measure-clone-%s",
+        clone_mode_to_string(clone_mode));
+    server_report_histogram(&mf->clone_hist, name);
+    snprintf(name, sizeof(name), "measure-clone-ready-%s",
+        clone_mode_to_string(clone_mode));
+    server_report_histogram(&mf->clone_ready_hist, name);
+}
+
+static int measure_fork_conn_recv(struct tcp_server_loop *loop,
+        struct tcp_conn *conn)
+{
+    char *cmd = conn->msg.netbuf;
+
+    if (!strncmp(cmd, "fork", strlen("fork"))) {
+        struct measure_fork *mf = loop->priv;
+        uint64_t start_nsec;
+        pid_t pid;
+        const char *label;
+
+        PROFILE_NESTED_TICK();
+        start_nsec = os_now_nsec();
+        pid = fork();
+        if (pid > 0)
+            histogram_record(&mf->fork_hist, os_now_nsec() - start_nsec);
+        if (pid == 0)
+            label = "fork child";
+        else if (pid > 0)
+            label = "fork parent";
+        else {
+            label = "fork error";
+            tcp_server_loop_stop(loop);
+        }
+
+        PROFILE_NESTED_TOCK_MSEC(label);
+
+        if (pid == 0) {
+            /* _exit() skips the drain at exit */
+            PROFILE_FLUSH();
+            os_exit(0);
+        }
+
+    } else if (!strncmp(cmd, "clone", strlen("clone"))) {
+        struct measure_fork *mf = loop->priv;
+
+        mf->rc = measure_clone(mf);
+        if (mf->rc)
+            tcp_server_loop_stop(loop);
+
+    } else if (!strncmp(cmd, "stop", strlen("stop")))
+        tcp_server_loop_stop(loop);
+
+    tcp_conn_consume(conn, conn->rx_len);
+    return TCP_CONN_CLOSE;
+}
+
+static const struct tcp_server_loop_ops measure_fork_ops = {
+    .conn_recv = measure_fork_conn_recv,
+};
+
+void *thread_func_measure_fork(void *p)
+{
+    static struct measure_fork mf;
     struct os_server server;
-    int keep_running;
-    struct net_msg msg;
+    struct tcp_server_loop loop;
     long rc = -1;
 
     (void) p;
 
-    if (!memory_str) {
+    if (!memory_str && !regions_str) {
         ERROR("Memory value not provided\n");
         goto out;
     }
 
-    pages_num = memsize_str2pages(memory_str);
-    if (!pages_num) {
-        ERROR("Invalid memory value\n");
-        goto out;
+    if (memory_str) {
+        mf.pages_num = memsize_str2pages(memory_str);
+        if (!mf.pages_num) {
+            ERROR("Invalid memory value\n");
+            goto out;
+        }
     }
 
     rc = server_prologue(NULL);
@@ -75,69 +274,67 @@ void *thread_func_measure_fork(void *p)
     if (!os_page_size)
         os_page_size = os_get_page_size();
 
-    rc = os_alloc_pages(pages_num, &start);
+    rc = measure_fork_alloc(&mf);
     if (rc) {
-        ERROR("Could not allocate %s\n", memory_str);
+        ERROR("Could not allocate %s of %s pages\n", memory_str,
+            page_mode_to_string(page_mode));
         goto out;
     }
 
-    rc = mem_touch_pages(start, pages_num, NULL);
+    if (regions_str) {
+        rc = mem_regions_alloc(&mf.regions, regions_str);
+        if (rc) {
+            ERROR("Could not allocate regions %s\n", regions_str);
+            goto out_free_pages;
+        }
+    }
+
+    if (mf.pages_num)
+        rc = mem_touch_pages(mf.start, mf.pages_num, NULL);
+    if (!rc)
+        rc = mem_regions_touch(&mf.regions);
     if (rc) {
         ERROR("Could not write on memory\n");
-        goto out_free_pages;
+        goto out_free_regions;
     }
+    mem_regions_print(&mf.regions);
+#if CFG_NUMA
+    if (mf.pages_num)
+        os_numa_print_layout("measure-fork", mf.start, mf.pages_num);
+#endif
 
     rc = tcp_server_start(&server, DEFAULT_SERVER_PORT);
     if (rc) {
         ERROR("Error tcp_server_start() rc=%ld\n", rc);
-        goto out_free_pages;
+        goto out_free_regions;
     }
     INFO("Listening....\n");
-    keep_running = 1;
-    while (keep_running) {
-        rc = tcp_server_accept(&server, &msg);
-        if (rc) {
-            ERROR("Error tcp_server_accept() rc=%ld\n", rc);
-            break;
-        }
 
-        rc = tcp_server_recv_msg(&msg);
-        if (rc < 0) {
-            ERROR("Error tcp_server_recv_msg() rc=%ld\n", rc);
-            net_msg_cleanup(&msg);
-            break;
-        }
-
-        if (!strncmp(msg.netbuf, "fork", strlen("fork"))) {
-            pid_t pid;
-            const char *label;
-
-            PROFILE_NESTED_TICK();
-            pid = fork();
-            if (pid == 0)
-                label = "fork child";
-            else if (pid > 0)
-                label = "fork parent";
-            else {
-                label = "fork error";
-                keep_running = 0;
-            }
-
-            PROFILE_NESTED_TOCK_MSEC(label);
+    histogram_init(&mf.fork_hist);
+    histogram_init(&mf.clone_hist);
+    histogram_init(&mf.clone_ready_hist);
 
-            if (pid == 0)
-                os_exit(0);
+    rc = tcp_server_loop_init(&loop, &server, &measure_fork_ops, &mf);
+    if (rc) {
+        ERROR("Error tcp_server_loop_init() rc=%ld\n", rc);
+        goto out_server_stop;
+    }
 
-        } else if (!strncmp(msg.netbuf, "stop", strlen("stop")))
-            keep_running = 0;
+    rc = tcp_server_loop_run(&loop);
+    if (rc)
+        ERROR("Error tcp_server_loop_run() rc=%ld\n", rc);
+    else
+        rc = mf.rc;
 
-        net_msg_cleanup(&msg);
-    }
+    measure_fork_report(&mf);
 
+    tcp_server_loop_fini(&loop);
+out_server_stop:
     tcp_server_stop(&server);
-
+out_free_regions:
+    mem_regions_free(&mf.regions);
 out_free_pages:
-    os_free_pages(start, pages_num);
+    measure_fork_free(&mf);
 out:
     INFO("Exiting\n");
     return (void *) rc;
@@ -30,17 +30,351 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <common/cfg.h>
 #include <common/log.h>
 #include <common/cmdline.h>
 #include <common/boot.h>
 #include <common/time.h>
 #include <common/mem.h>
+#include <common/tsc.h>
 #include <common/net.h>
 #include <server-common.h>
+#if CFG_PERF_COUNTERS
+#include <os/posix/perf.h>
+#endif
+#if CFG_NUMA
+#include <os/posix/numa.h>
+#endif
+#if CFG_MEM_ACCOUNT
+#include <os/posix/memacct.h>
+#endif
 
 
-static void print_stats(const char *prefix, unsigned long pages_num,
+/*
+ * Access patterns of the "overhead" command, given as key=value arguments:
+ *
+ *   overhead [pattern=seq|stride|random|zipf] [op=write|read|rw|partial]
+ *            [fraction=F] [stride=N] [theta=T] [bytes=N] [seed=N]
+ *
+ * pattern picks the order of the fraction F (0 < F <= 1) of pages accessed:
+ * sequential, every N-th page with wrap-around, a uniform random subset or
+ * Zipf(T) distributed draws (0 < T < 1) concentrated on a hot set. op picks
+ * what is done to each page: write one word, read one word, read and write
+ * it back, or write its first N bytes. Without arguments the whole region
+ * is touched with mem_touch_pages(), honoring -W and -j.
+ */
+enum access_order {
+    ACCESS_ORDER_SEQ,
+    ACCESS_ORDER_STRIDE,
+    ACCESS_ORDER_RANDOM,
+    ACCESS_ORDER_ZIPF,
+};
+
+enum access_op {
+    ACCESS_OP_WRITE,
+    ACCESS_OP_READ,
+    ACCESS_OP_RW,
+    ACCESS_OP_PARTIAL,
+};
+
+static const char *access_order_names[] = {
+    [ACCESS_ORDER_SEQ] = "seq",
+    [ACCESS_ORDER_STRIDE] = "stride",
+    [ACCESS_ORDER_RANDOM] = "random",
+    [ACCESS_ORDER_ZIPF] = "zipf",
+};
+
+static const char *access_op_names[] = {
+    [ACCESS_OP_WRITE] = "write",
+    [ACCESS_OP_READ] = "read",
+    [ACCESS_OP_RW] = "rw",
+    [ACCESS_OP_PARTIAL] = "partial",
+};
+
+struct access_pattern {
+    enum access_order order;
+    enum access_op op;
+    double fraction;
+    unsigned long stride;
+    double theta;
+    unsigned long bytes;
+    uint64_t seed;
+};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+static int access_name_lookup(const char *s, const char **names, int num)
+{
+    int i;
+
+    for (i = 0; i < num; i++) {
+        if (!strcmp(s, names[i]))
+            return i;
+    }
+
+    return -1;
+}
+
+static int access_pattern_parse(char *args, struct access_pattern *ap)
+{
+    char *saveptr, *tok, *val = NULL, *end;
+    int i, rc = 0;
+
+    ap->order = ACCESS_ORDER_SEQ;
+    ap->op = ACCESS_OP_WRITE;
+    ap->fraction = 1.0;
+    ap->stride = 16;
+    ap->theta = 0.99;
+    ap->bytes = 64;
+    ap->seed = 1;
+
+    for (tok = strtok_r(args, " \t\r\n", &saveptr); tok;
+            tok = strtok_r(NULL, " \t\r\n", &saveptr)) {
+        val = strchr(tok, '=');
+        if (!val) {
+            rc = -EINVAL;
+            goto out;
+        }
+        *val++ = '\0';
+
+        if (!strcmp(tok, "pattern")) {
+            i = access_name_lookup(val, access_order_names,
+                ARRAY_SIZE(access_order_names));
+            if (i < 0) {
+                rc = -EINVAL;
+                goto out;
+            }
+            ap->order = i;
+
+        } else if (!strcmp(tok, "op")) {
+            i = access_name_lookup(val, access_op_names,
+                ARRAY_SIZE(access_op_names));
+            if (i < 0) {
+                rc = -EINVAL;
+                goto out;
+            }
+            ap->op = i;
+
+        } else if (!strcmp(tok, "fraction")) {
+            ap->fraction = strtod(val, &end);
+            if (*end || !(ap->fraction > 0 && ap->fraction <= 1)) {
+                rc = -EINVAL;
+                goto out;
+            }
+
+        } else if (!strcmp(tok, "stride")) {
+            ap->stride = strtoul(val, &end, 10);
+            if (*end || !ap->stride) {
+                rc = -EINVAL;
+                goto out;
+            }
+
+        } else if (!strcmp(tok, "theta")) {
+            ap->theta = strtod(val, &end);
+            if (*end || !(ap->theta > 0 && ap->theta < 1)) {
+                rc = -EINVAL;
+                goto out;
+            }
+
+        } else if (!strcmp(tok, "bytes")) {
+            ap->bytes = strtoul(val, &end, 10);
+            if (*end || !ap->bytes || ap->bytes > os_page_size) {
+                rc = -EINVAL;
+                goto out;
+            }
+
+        } else if (!strcmp(tok, "seed")) {
+            ap->seed = strtoull(val, &end, 10);
+            if (*end) {
+                rc = -EINVAL;
+                goto out;
+            }
+
+        } else {
+            rc = -EINVAL;
+            goto out;
+        }
+    }
+
+out:
+    if (rc)
+        ERROR("Invalid overhead argument '%s%s%s'\n", tok,
+            val ? "=" : "", val ? val : "");
+    return rc;
+}
+
+static int access_pattern_is_default(struct access_pattern *ap)
+{
+    return ap->order == ACCESS_ORDER_SEQ && ap->op == ACCESS_OP_WRITE &&
+        ap->fraction == 1.0;
+}
+
+/* xorshift64*, the seed must not be 0 */
+static inline uint64_t access_rand(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+
+    return x * 2685821657736338717ULL;
+}
+
+static inline double access_rand_double(uint64_t *state)
+{
+    return (access_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * Zipf draws with the method of Gray et al., "Quickly Generating
+ * Billion-Record Synthetic Databases". The ranks are scattered over the
+ * region so that the hot pages are not all adjacent.
+ */
+static void access_zipf_fill(unsigned long *idx, unsigned long n,
+        unsigned long pages_num, double theta, uint64_t *state)
+{
+    double zetan = 0, zeta2, alpha, eta, u, uz;
+    unsigned long i, rank;
+
+    for (i = 1; i <= pages_num; i++)
+        zetan += 1.0 / pow(i, theta);
+    zeta2 = 1.0 + pow(0.5, theta);
+    alpha = 1.0 / (1.0 - theta);
+    eta = (1.0 - pow(2.0 / pages_num, 1.0 - theta)) / (1.0 - zeta2 / zetan);
+
+    for (i = 0; i < n; i++) {
+        u = access_rand_double(state);
+        uz = u * zetan;
+        if (uz < 1.0)
+            rank = 0;
+        else if (uz < zeta2)
+            rank = 1;
+        else
+            rank = pages_num * pow(eta * u - eta + 1.0, alpha);
+        if (rank >= pages_num)
+            rank = pages_num - 1;
+
+        idx[i] = (rank * 2654435761UL) % pages_num;
+    }
+}
+
+/* Returns the array of the n page indices to access, in order */
+static unsigned long *access_indices(struct access_pattern *ap,
+        unsigned long pages_num, unsigned long *pn)
+{
+    unsigned long *idx, n, i, j, k, tmp;
+    uint64_t state = ap->seed ? ap->seed : 1;
+
+    n = ap->fraction * pages_num;
+    if (!n)
+        n = 1;
+
+    /* random picks a subset of all the pages */
+    idx = malloc((ap->order == ACCESS_ORDER_RANDOM ? pages_num : n) *
+        sizeof(*idx));
+    if (!idx)
+        goto out;
+
+    switch (ap->order) {
+    case ACCESS_ORDER_SEQ:
+        for (i = 0; i < n; i++)
+            idx[i] = i;
+        break;
+
+    case ACCESS_ORDER_STRIDE:
+        /* every stride-th page, shifted by one page on each pass */
+        for (i = 0, j = 0, k = 0; i < n; i++) {
+            idx[i] = j;
+            j += ap->stride;
+            if (j >= pages_num)
+                j = ++k % ap->stride;
+        }
+        break;
+
+    case ACCESS_ORDER_RANDOM:
+        for (i = 0; i < pages_num; i++)
+            idx[i] = i;
+        /* partial Fisher-Yates, only the first n slots are used */
+        for (i = 0; i < n; i++) {
+            j = i + access_rand(&state) % (pages_num - i);
+            tmp = idx[i];
+            idx[i] = idx[j];
+            idx[j] = tmp;
+        }
+        break;
+
+    case ACCESS_ORDER_ZIPF:
+        access_zipf_fill(idx, n, pages_num, ap->theta, &state);
+        break;
+    }
+
+    *pn = n;
+out:
+    return idx;
+}
+
+static void access_run(char *start, struct access_pattern *ap,
+        unsigned long *idx, unsigned long n)
+{
+    volatile unsigned long *w;
+    unsigned long i;
+
+    for (i = 0; i < n; i++) {
+        w = (volatile unsigned long *) (start + idx[i] * os_page_size);
+
+        switch (ap->op) {
+        case ACCESS_OP_WRITE:
+            *w = idx[i];
+            break;
+        case ACCESS_OP_READ:
+            (void) *w;
+            break;
+        case ACCESS_OP_RW:
+            *w = *w + 1;
+            break;
+        case ACCESS_OP_PARTIAL:
+            memset((char *) w, (int) idx[i], ap->bytes);
+            break;
+        }
+    }
+}
+
+/* Distinct pages among the accessed ones, the zipf draws repeat */
+static unsigned long access_pages_count(unsigned long *idx, unsigned long n,
+        unsigned long pages_num)
+{
+    unsigned long *bitmap, bits = 8 * sizeof(*bitmap), i, count = 0;
+
+    bitmap = calloc(pages_num / bits + 1, sizeof(*bitmap));
+    if (!bitmap)
+        return n;
+
+    for (i = 0; i < n; i++) {
+        if (!(bitmap[idx[i] / bits] & (1UL << (idx[i] % bits)))) {
+            bitmap[idx[i] / bits] |= 1UL << (idx[i] % bits);
+            count++;
+        }
+    }
+
+    free(bitmap);
+    return count;
+}
+
+static void nsec_to_timeval(uint64_t nsec, struct timeval *tv)
+{
+    tv->tv_sec = nsec / 1000000000ULL;
+    tv->tv_usec = nsec % 1000000000ULL / 1000;
+}
+
+static void print_stats(const char *prefix, struct access_pattern *ap,
+        unsigned long pages_num, unsigned long accesses,
         struct timeval *duration)
 {
     unsigned long msec, usec;
@@ -48,17 +382,203 @@ static void print_stats(const char *prefix, unsigned long pages_num,
     msec = duration->tv_sec * 1000 + duration->tv_usec / 1000;
     usec = duration->tv_usec % 1000;
 
-    fprintf(stderr, "OVERHEAD_TRACE %s pages=%lu duration=%lu.%03lu\n",
-        prefix, pages_num, msec, usec);
+    if (!ap) {
+        fprintf(stderr, "OVERHEAD_TRACE %s pages=%lu duration=%lu.%03lu "
+            "page-mode=%s\n", prefix, pages_num, msec, usec,
+            page_mode_to_string(page_mode));
+        return;
+    }
+
+    fprintf(stderr, "OVERHEAD_TRACE %s pages=%lu duration=%lu.%03lu "
+        "pattern=%s op=%s accesses=%lu page-mode=%s\n", prefix, pages_num,
+        msec, usec, access_order_names[ap->order], access_op_names[ap->op],
+        accesses, page_mode_to_string(page_mode));
 }
 
-void *thread_func_memory_overhead(void *p)
-{
+struct memory_overhead {
     char *start;
     unsigned long pages_num;
+    long result;
+#if CFG_PERF_COUNTERS
+    struct os_perf perf;
+    int perf_on;
+#endif
+};
+
+#if CFG_PERF_COUNTERS
+static void perf_init(struct memory_overhead *mo)
+{
+    mo->perf_on = os_perf_open(&mo->perf) > 0;
+    if (!mo->perf_on)
+        INFO("No perf counters available\n");
+}
+
+static void perf_start(struct memory_overhead *mo)
+{
+    if (mo->perf_on)
+        os_perf_start(&mo->perf);
+}
+
+static void perf_stop(struct memory_overhead *mo, const char *prefix)
+{
+    if (mo->perf_on) {
+        os_perf_stop(&mo->perf);
+        os_perf_print(&mo->perf, prefix);
+    }
+}
+
+static void perf_fini(struct memory_overhead *mo)
+{
+    os_perf_close(&mo->perf);
+    mo->perf_on = 0;
+}
+#else
+#define perf_init(mo)           do { (void) (mo); } while (0)
+#define perf_start(mo)          do { (void) (mo); } while (0)
+#define perf_stop(mo, prefix)   do { (void) (mo); (void) (prefix); } while (0)
+#define perf_fini(mo)           do { (void) (mo); } while (0)
+#endif
+
+#if CFG_MEM_ACCOUNT
+static void print_mem_account(const char *prefix, struct memory_overhead *mo)
+{
+    struct os_mem_account acct;
+
+    if (!os_mem_account(mo->start, mo->pages_num, &acct))
+        os_mem_account_print(prefix, &acct);
+}
+#else
+#define print_mem_account(prefix, mo) \
+    do { (void) (prefix); (void) (mo); } while (0)
+#endif
+
+static int memory_overhead_touch(struct memory_overhead *mo,
+        struct access_pattern *ap, const char *prefix)
+{
+    struct timeval duration;
+    unsigned long *idx, n, pages;
+    uint64_t ns_before, ns_after;
+    int rc = 0;
+
+    if (access_pattern_is_default(ap)) {
+        perf_start(mo);
+        rc = mem_touch_pages(mo->start, mo->pages_num, &duration);
+        if (rc) {
+            ERROR("Could not write on memory\n");
+            goto out;
+        }
+        print_stats(prefix, NULL, mo->pages_num, mo->pages_num, &duration);
+        perf_stop(mo, prefix);
+        goto out;
+    }
+
+    /* generating the indices is not part of the measurement */
+    idx = access_indices(ap, mo->pages_num, &n);
+    if (!idx) {
+        ERROR("Could not allocate the access indices\n");
+        rc = -ENOMEM;
+        goto out;
+    }
+
+    perf_start(mo);
+    ns_before = tsc_now_nsec();
+    access_run(mo->start, ap, idx, n);
+    ns_after = tsc_now_nsec();
+    perf_stop(mo, prefix);
+
+    pages = ap->order == ACCESS_ORDER_ZIPF ?
+        access_pages_count(idx, n, mo->pages_num) : n;
+    nsec_to_timeval(ns_after - ns_before, &duration);
+    print_stats(prefix, ap, pages, n, &duration);
+
+    free(idx);
+out:
+    return rc;
+}
+
+static int memory_overhead_conn_recv(struct tcp_server_loop *loop,
+        struct tcp_conn *conn)
+{
+    struct memory_overhead *mo = loop->priv;
+    char *cmd = conn->msg.netbuf;
+    int rc = TCP_CONN_CLOSE;
+
+    if (!strncmp(cmd, "overhead", strlen("overhead"))) {
+        pid_t pid = -1;
+        struct access_pattern ap;
+        struct timeval duration;
+        uint64_t ns_before;
+        char args[256];
+        int len;
+
+        len = conn->rx_len - strlen("overhead");
+        if (len > (int) sizeof(args) - 1)
+            len = sizeof(args) - 1;
+        memcpy(args, cmd + strlen("overhead"), len);
+        args[len] = '\0';
+
+        if (access_pattern_parse(args, &ap))
+            goto out;
+
+        if (do_fork) {
+            perf_start(mo);
+            ns_before = tsc_now_nsec();
+            pid = fork();
+            if (pid < 0) {
+                ERROR("Error fork() pid=%d\n", pid);
+                mo->result = rc = -1;
+                tcp_server_loop_stop(loop);
+                goto out;
+            }
+
+            if (pid == 0) {
+                /* child, the inherited counters follow the parent */
+                perf_fini(mo);
+                perf_init(mo);
+                rc = memory_overhead_touch(mo, &ap, "child");
+                print_mem_account("child", mo);
+#if CFG_NUMA
+                /* where the copy-on-write copies went */
+                os_numa_print_layout("child", mo->start, mo->pages_num);
+#endif
+                os_exit(rc ? 1 : 0);
+            }
+            /* fork() latency, mostly copying the page tables */
+            nsec_to_timeval(tsc_now_nsec() - ns_before, &duration);
+            print_stats("fork", NULL, mo->pages_num, 0, &duration);
+            perf_stop(mo, "fork");
+            print_mem_account("fork", mo);
+
+        } else {
+            rc = memory_overhead_touch(mo, &ap, "parent");
+            if (rc) {
+                mo->result = rc;
+                tcp_server_loop_stop(loop);
+                goto out;
+            }
+            rc = TCP_CONN_CLOSE;
+        }
+
+    } else if (!strncmp(cmd, "account", strlen("account")))
+        print_mem_account("parent", mo);
+
+    else if (!strncmp(cmd, "stop", strlen("stop")))
+        tcp_server_loop_stop(loop);
+
+out:
+    tcp_conn_consume(conn, conn->rx_len);
+    return rc;
+}
+
+static const struct tcp_server_loop_ops memory_overhead_ops = {
+    .conn_recv = memory_overhead_conn_recv,
+};
+
+void *thread_func_memory_overhead(void *p)
+{
+    struct memory_overhead mo;
     struct os_server server;
-    int keep_running;
-    struct net_msg msg;
+    struct tcp_server_loop loop;
     long rc = -1;
 
     (void) p;
@@ -68,89 +588,64 @@ void *thread_func_memory_overhead(void *p)
         goto out;
     }
 
-    pages_num = memsize_str2pages(memory_str);
-    if (!pages_num) {
+    mo.pages_num = memsize_str2pages(memory_str);
+    if (!mo.pages_num) {
         ERROR("Invalid memory value\n");
         goto out;
     }
+    mo.result = 0;
 
     if (!os_page_size)
         os_page_size = os_get_page_size();
 
-    rc = os_alloc_pages(pages_num, &start);
+    rc = os_alloc_pages_mode(mo.pages_num, page_mode, &mo.start);
     if (rc) {
-        ERROR("Could not allocate %s (rc=%ld)\n", memory_str, rc);
+        ERROR("Could not allocate %s of %s pages (rc=%ld)\n", memory_str,
+            page_mode_to_string(page_mode), rc);
         goto out;
     }
 
-    rc = mem_touch_pages(start, pages_num, NULL);
+    tsc_init();
+
+    rc = mem_touch_pages(mo.start, mo.pages_num, NULL);
     if (rc) {
         ERROR("Could not write on memory\n");
         goto out_free_pages;
     }
+#if CFG_NUMA
+    os_numa_print_layout("parent", mo.start, mo.pages_num);
+#endif
+    print_mem_account("parent", &mo);
+
+    perf_init(&mo);
 
     rc = tcp_server_start(&server, DEFAULT_SERVER_PORT);
     if (rc) {
         ERROR("Error tcp_server_start() rc=%ld\n", rc);
-        goto out_free_pages;
+        goto out_perf_fini;
     }
     INFO("Listening....\n");
-    keep_running = 1;
-    while (keep_running) {
-        rc = tcp_server_accept(&server, &msg);
-        if (rc) {
-            ERROR("Error tcp_server_accept() rc=%ld\n", rc);
-            break;
-        }
-
-        rc = tcp_server_recv_msg(&msg);
-        if (rc < 0) {
-            ERROR("Error tcp_server_recv_msg() rc=%ld\n", rc);
-            net_msg_cleanup(&msg);
-            break;
-        }
 
-        if (!strncmp(msg.netbuf, "overhead", strlen("overhead"))) {
-            pid_t pid = -1;
-            struct timeval duration;
-
-            if (do_fork) {
-                pid = fork();
-                if (pid < 0) {
-                    ERROR("Error fork() pid=%d\n", pid);
-                    goto out;
-                }
-
-                if (pid == 0) {
-                    /* child */
-                    rc = mem_touch_pages(start, pages_num, &duration);
-                    if (rc) {
-                        ERROR("Could not write on memory\n");
-                        goto out;
-                    }
-                    print_stats("child", pages_num, &duration);
-                    os_exit(0);
-                }
-
-            } else {
-                rc = mem_touch_pages(start, pages_num, &duration);
-                if (rc) {
-                    ERROR("Could not write on memory\n");
-                    goto out;
-                }
-                print_stats("parent", pages_num, &duration);
-            }
-
-        } else if (!strncmp(msg.netbuf, "stop", strlen("stop")))
-            keep_running = 0;
-
-        net_msg_cleanup(&msg);
+    rc = tcp_server_loop_init(&loop, &server, &memory_overhead_ops, &mo);
+    if (rc) {
+        ERROR("Error tcp_server_loop_init() rc=%ld\n", rc);
+        goto out_server_stop;
     }
 
+    rc = tcp_server_loop_run(&loop);
+    if (rc)
+        ERROR("Error tcp_server_loop_run() rc=%ld\n", rc);
+    else
+        rc = mo.result;
+
+    tcp_server_loop_fini(&loop);
+out_server_stop:
     tcp_server_stop(&server);
+out_perf_fini:
+    perf_fini(&mo);
 
 out_free_pages:
-    os_free_pages(start, pages_num);
+    os_free_pages_mode(mo.start, mo.pages_num, page_mode);
 
     /*os_sleep_msec(5000);*/
 
@@ -114,6 +114,50 @@ int os_parse_args(int argc, char **argv)
             memory_str = argv[i + 1];
             i++;
 
+        } else if (!strcmp(argv[i], "-H") || !strcmp(argv[i], "--hist-dump")) {
+            hist_dump_prefix = argv[i + 1];
+            i++;
+
+        } else if (!strcmp(argv[i], "-w") || !strcmp(argv[i], "--workers")) {
+            sscanf(argv[i + 1], "%d", &workers_num);
+            i++;
+
+        } else if (!strcmp(argv[i], "-e") || !strcmp(argv[i], "--echo")) {
+            do_echo = 1;
+
+        } else if (!strcmp(argv[i], "-F") || !strcmp(argv[i], "--fork-mode")) {
+            if (string_to_fork_mode(argv[i + 1], &fork_mode)) {
+                ERROR("Unsupported fork mode: %s\n", argv[i + 1]);
+                do_exit();
+            }
+            i++;
+
+        } else if (!strcmp(argv[i], "-k") || !strcmp(argv[i], "--fork-fanout")) {
+            sscanf(argv[i + 1], "%d", &fork_fanout);
+            if (fork_fanout < 1) {
+                ERROR("Fork fanout should be positive\n");
+                do_exit();
+            }
+            i++;
+
+        } else if (!strcmp(argv[i], "-W") || !strcmp(argv[i], "--touch-mode")) {
+            if (string_to_touch_mode(argv[i + 1], &touch_mode)) {
+                ERROR("Unsupported touch mode: %s\n", argv[i + 1]);
+                do_exit();
+            }
+            i++;
+
+        } else if (!strcmp(argv[i], "-B") || !strcmp(argv[i], "--bench")) {
+            do_bench = 1;
+
+        } else if (!strcmp(argv[i], "-b") || !strcmp(argv[i], "--netbuf-size")) {
+            sscanf(argv[i + 1], "%d", &netbuf_size);
+            i++;
+
+        } else if (!strcmp(argv[i], "-n") || !strcmp(argv[i], "--netbuf-count")) {
+            sscanf(argv[i + 1], "%d", &netbuf_count);
+            i++;
+
         } else
             ERROR("Invalid argument \'%s\'\n", argv[i]);
     }
@@ -102,3 +102,21 @@ int os_thread_wait(struct os_thread *t, void **thread_return)
     *thread_return = t->result;
     return 0;
 }
+
+int os_thread_set_cpu(struct os_thread *t, int cpu)
+{
+    (void) t;
+    (void) cpu;
+    return -ENOTSUP;
+}
+
+int os_cpus_num(void)
+{
+    return 1;
+}
+
+int os_cpu_nth(int n)
+{
+    (void) n;
+    return 0;
+}
@@ -31,10 +31,18 @@
  */
 
 #include <unistd.h>
+#include <common/cfg.h>
+#if CFG_NUMA
+#include <os/posix/numa.h>
+#endif
 
 int os_app_init(void)
 {
+#if CFG_NUMA
+    return os_numa_init();
+#else
     return 0;
+#endif
 }
 
 void os_exit(int status)
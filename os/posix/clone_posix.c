@@ -30,19 +30,556 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/userfaultfd.h>
+#include <common/cfg.h>
 #include <common/log.h>
 #include <common/cmdline.h>
 #include <common/clone.h>
+#include <common/mem.h>
+#if CFG_NUMA
+#include <os/posix/numa.h>
+#endif
+
+/*
+ * Clones are forked processes. Ids are handed out the way Xen hands out
+ * domain ids to clones: consecutively, starting after the parent's, so
+ * clone_prologue() can derive the child index from os_get_self_id().
+ */
+static unsigned int self_id;
+static unsigned int next_id = 1;
 
+/* clones still to be reaped */
+static pid_t *clone_pids;
+static unsigned int clone_pids_num, clone_pids_size;
 
-int os_clone(unsigned int nr_children)
+static void clone_reap(void)
+{
+    unsigned int i = 0;
+
+    while (i < clone_pids_num) {
+        if (waitpid(clone_pids[i], NULL, WNOHANG) != 0)
+            clone_pids[i] = clone_pids[--clone_pids_num];
+        else
+            i++;
+    }
+}
+
+static int clone_pids_reserve(unsigned int nr)
+{
+    pid_t *pids;
+    unsigned int size;
+
+    if (clone_pids_num + nr <= clone_pids_size)
+        return 0;
+
+    size = clone_pids_size ? clone_pids_size : 16;
+    while (size < clone_pids_num + nr)
+        size *= 2;
+
+    pids = realloc(clone_pids, size * sizeof(*pids));
+    if (!pids)
+        return -ENOMEM;
+
+    clone_pids = pids;
+    clone_pids_size = size;
+    return 0;
+}
+
+/*
+ * Lazy clones (-X lazy). The region of os_clone_region_alloc() lives in a
+ * memfd mapped shared, so fork() copies none of its page tables. The first
+ * lazy os_clone() remaps it private in the parent: the memfd is frozen as
+ * the snapshot and later parent writes stay in the parent. Each later
+ * os_clone() takes a new snapshot if the parent wrote since the last one:
+ * the written pages go back into the memfd, or into a fresh memfd while
+ * clones of the previous snapshot still run. Each child
+ * remaps the snapshot private too and registers it with a userfaultfd
+ * served by a handler thread: the first access to a page maps the memfd
+ * page read-only without copying it (UFFDIO_CONTINUE, a window of pages at
+ * a time), the kernel copies it on the first write and the pages the parent
+ * never wrote are mapped as the zero page.
+ */
+#define LAZY_FAULT_AROUND_PAGES 16
+
+static struct {
+    char *start;
+    size_t length;
+    int memfd;
+    int frozen;
+    int uffd;
+} lazy = {
+    .memfd = -1,
+    .uffd = -1,
+};
+
+/* A userfaultfd the region is registered with for missing and minor faults */
+static int lazy_uffd_open(void)
+{
+    struct uffdio_api api;
+    struct uffdio_register reg;
+    int fd, rc;
+
+    /* user mode faults only, which needs no privileges */
+    fd = syscall(__NR_userfaultfd, O_CLOEXEC | UFFD_USER_MODE_ONLY);
+    if (fd < 0 && errno == EINVAL)
+        fd = syscall(__NR_userfaultfd, O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+
+    api.api = UFFD_API;
+    api.features = UFFD_FEATURE_MINOR_SHMEM;
+    if (ioctl(fd, UFFDIO_API, &api))
+        goto out_close;
+
+    reg.range.start = (unsigned long) lazy.start;
+    reg.range.len = lazy.length;
+    reg.mode = UFFDIO_REGISTER_MODE_MISSING | UFFDIO_REGISTER_MODE_MINOR;
+    if (ioctl(fd, UFFDIO_REGISTER, &reg))
+        goto out_close;
+
+    return fd;
+
+out_close:
+    rc = -errno;
+    close(fd);
+    return rc;
+}
+
+int os_clone_region_alloc(unsigned long pages_num, char **pstart)
+{
+    char *start;
+    int rc = 0;
+
+    if (lazy.start) {
+        rc = -EBUSY;
+        goto out;
+    }
+
+    lazy.length = (size_t) os_get_page_size() * pages_num;
+
+    lazy.memfd = memfd_create("clone-region", MFD_CLOEXEC);
+    if (lazy.memfd < 0) {
+        rc = -errno;
+        ERROR("Error memfd_create() rc=%d\n", rc);
+        goto out;
+    }
+
+    if (ftruncate(lazy.memfd, lazy.length)) {
+        rc = -errno;
+        ERROR("Error ftruncate() rc=%d\n", rc);
+        goto out_close;
+    }
+
+    start = mmap(NULL, lazy.length, PROT_READ | PROT_WRITE, MAP_SHARED,
+        lazy.memfd, 0);
+    if (start == MAP_FAILED) {
+        rc = -errno;
+        goto out_close;
+    }
+
+#if CFG_NUMA
+    rc = os_numa_bind(start, lazy.length);
+    if (rc) {
+        munmap(start, lazy.length);
+        goto out_close;
+    }
+#endif
+
+    lazy.start = start;
+
+    /* here rather than in every clone, which could only exit */
+    rc = lazy_uffd_open();
+    if (rc < 0) {
+        ERROR("Lazy clones need userfaultfd with minor shmem faults "
+            "(Linux 5.13) rc=%d\n", rc);
+        lazy.start = NULL;
+        munmap(start, lazy.length);
+        goto out_close;
+    }
+    close(rc);
+
+    *pstart = start;
+    lazy.frozen = 0;
+    rc = 0;
+    goto out;
+
+out_close:
+    close(lazy.memfd);
+    lazy.memfd = -1;
+out:
+    return rc;
+}
+
+int os_clone_region_free(char *start, unsigned long pages_num)
+{
+    int rc;
+
+    if (start != lazy.start ||
+            (size_t) os_get_page_size() * pages_num != lazy.length)
+        return -EINVAL;
+
+    rc = munmap(lazy.start, lazy.length);
+    close(lazy.memfd);
+    lazy.memfd = -1;
+    lazy.start = NULL;
+
+    return rc;
+}
+
+static char *lazy_remap_private(void)
+{
+    return mmap(lazy.start, lazy.length, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_FIXED, lazy.memfd, 0);
+}
+
+#define PAGEMAP_PRESENT         (1ULL << 63)
+#define PAGEMAP_SWAPPED         (1ULL << 62)
+#define PAGEMAP_FILE            (1ULL << 61)
+#define PAGEMAP_BATCH           512
+
+/* Linux 6.7, walks the page tables instead of reporting every page */
+#ifndef PAGEMAP_SCAN
+#define PAGEMAP_SCAN            _IOWR('f', 16, struct pm_scan_arg)
+#define PAGE_IS_FILE            (1 << 2)
+#define PAGE_IS_PRESENT         (1 << 3)
+#define PAGE_IS_SWAPPED         (1 << 4)
+
+struct page_region {
+    uint64_t start;
+    uint64_t end;
+    uint64_t categories;
+};
+
+struct pm_scan_arg {
+    uint64_t size;
+    uint64_t flags;
+    uint64_t start;
+    uint64_t end;
+    uint64_t walk_end;
+    uint64_t vec;
+    uint64_t vec_len;
+    uint64_t max_pages;
+    uint64_t category_inverted;
+    uint64_t category_mask;
+    uint64_t category_anyof_mask;
+    uint64_t return_mask;
+};
+#endif
+
+/* Writes [start, end) of the parent's region into memfd unless it is -1 */
+static long lazy_dirty_range(unsigned long start, unsigned long end,
+        int memfd)
+{
+    size_t len = end - start;
+
+    if (memfd >= 0 && pwrite(memfd, (void *) start, len,
+            start - (unsigned long) lazy.start) != (ssize_t) len)
+        return errno ? -errno : -EIO;
+
+    return len / os_get_page_size();
+}
+
+static long lazy_dirty_scan(int pagemap, int memfd)
+{
+    struct page_region regions[PAGEMAP_BATCH];
+    struct pm_scan_arg arg;
+    long n, pages, dirty = 0;
+
+    memset(&arg, 0, sizeof(arg));
+    arg.size = sizeof(arg);
+    arg.start = (unsigned long) lazy.start;
+    arg.end = (unsigned long) lazy.start + lazy.length;
+    arg.vec = (unsigned long) regions;
+    arg.vec_len = PAGEMAP_BATCH;
+    /* anonymous, i.e. not file, and present or swapped */
+    arg.category_inverted = PAGE_IS_FILE;
+    arg.category_mask = PAGE_IS_FILE;
+    arg.category_anyof_mask = PAGE_IS_PRESENT | PAGE_IS_SWAPPED;
+    arg.return_mask = PAGE_IS_PRESENT | PAGE_IS_SWAPPED;
+
+    do {
+        n = ioctl(pagemap, PAGEMAP_SCAN, &arg);
+        if (n < 0)
+            return -errno;
+
+        for (long i = 0; i < n; i++) {
+            pages = lazy_dirty_range(regions[i].start, regions[i].end, memfd);
+            if (pages < 0)
+                return pages;
+            dirty += pages;
+        }
+        arg.start = arg.walk_end;
+    } while (arg.walk_end < arg.end);
+
+    return dirty;
+}
+
+static long lazy_dirty_read(int pagemap, int memfd)
 {
-#if 0
-    unsigned short *child_ids;
+    unsigned long page_size = os_get_page_size();
+    unsigned long pages_num = lazy.length / page_size, i, j, n, addr;
+    uint64_t entries[PAGEMAP_BATCH];
+    long pages, dirty = 0;
+    size_t len;
+
+    for (i = 0; i < pages_num; i += n) {
+        n = pages_num - i < PAGEMAP_BATCH ? pages_num - i : PAGEMAP_BATCH;
+        len = n * sizeof(entries[0]);
+        if (pread(pagemap, entries, len,
+                ((unsigned long) lazy.start / page_size + i) *
+                sizeof(entries[0])) != (ssize_t) len)
+            return -EIO;
+
+        for (j = 0; j < n; j++) {
+            if (!(entries[j] & (PAGEMAP_PRESENT | PAGEMAP_SWAPPED)) ||
+                    (entries[j] & PAGEMAP_FILE))
+                continue;
+            addr = (unsigned long) lazy.start + (i + j) * page_size;
+            pages = lazy_dirty_range(addr, addr + page_size, memfd);
+            if (pages < 0)
+                return pages;
+            dirty += pages;
+        }
+    }
+
+    return dirty;
+}
+
+/*
+ * Counts the pages the parent wrote since the last snapshot, which are
+ * anonymous copies of the memfd pages in its private mapping, and writes
+ * them into memfd unless it is -1.
+ */
+static long lazy_dirty_pages(int memfd)
+{
+    long dirty;
+    int fd;
+
+    fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+
+    dirty = lazy_dirty_scan(fd, memfd);
+    if (dirty == -ENOTTY || dirty == -EINVAL)
+        dirty = lazy_dirty_read(fd, memfd);
+
+    close(fd);
+    return dirty;
+}
+
+/* A copy of the parent's view, for the clones to come */
+static int lazy_new_memfd(void)
+{
+    char *copy;
+    int memfd, rc = 0;
+
+    memfd = memfd_create("clone-region", MFD_CLOEXEC);
+    if (memfd < 0)
+        return -errno;
+
+    if (ftruncate(memfd, lazy.length)) {
+        rc = -errno;
+        goto out_close;
+    }
+
+    copy = mmap(NULL, lazy.length, PROT_READ | PROT_WRITE, MAP_SHARED,
+        memfd, 0);
+    if (copy == MAP_FAILED) {
+        rc = -errno;
+        goto out_close;
+    }
+#if CFG_NUMA
+    rc = os_numa_bind(copy, lazy.length);
+#endif
+    if (!rc)
+        memcpy(copy, lazy.start, lazy.length);
+    munmap(copy, lazy.length);
+    if (rc)
+        goto out_close;
+
+    close(lazy.memfd);
+    lazy.memfd = memfd;
+    return 0;
+
+out_close:
+    close(memfd);
+    return rc;
+}
+
+/* The region as the parent sees it now becomes the clones' snapshot */
+static int lazy_snapshot(void)
+{
+    long dirty = 0;
     int rc;
 
+    if (lazy.frozen) {
+        dirty = lazy_dirty_pages(-1);
+        if (dirty <= 0) {
+            rc = dirty;
+            goto out;
+        }
+
+        /* clone_reap() ran, those still listed map the current memfd */
+        if (clone_pids_num)
+            rc = lazy_new_memfd();
+        else {
+            dirty = lazy_dirty_pages(lazy.memfd);
+            rc = dirty < 0 ? dirty : 0;
+        }
+        if (rc)
+            goto out;
+    }
+
+    /* drops the parent's copies, the memfd holds the same data now */
+    if (lazy_remap_private() == MAP_FAILED) {
+        rc = -errno;
+        goto out;
+    }
+    lazy.frozen = 1;
+    rc = 0;
+
+out:
+    if (rc)
+        ERROR("Error taking the clone region snapshot rc=%d\n", rc);
+    DEBUG("clone region snapshot dirty=%ld\n", dirty);
+    return rc;
+}
+
+static void lazy_wake(unsigned long addr)
+{
+    struct uffdio_range range = {
+        .start = addr,
+        .len = os_get_page_size(),
+    };
+
+    ioctl(lazy.uffd, UFFDIO_WAKE, &range);
+}
+
+static void lazy_resolve(struct uffd_msg *msg)
+{
+    unsigned long page_size = os_get_page_size();
+    unsigned long addr, start, end, region_end;
+    struct uffdio_continue cont;
+    struct uffdio_zeropage zero;
+
+    addr = msg->arg.pagefault.address & ~(page_size - 1);
+
+    if (!(msg->arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_MINOR)) {
+        /* not in the snapshot */
+        zero.range.start = addr;
+        zero.range.len = page_size;
+        zero.mode = 0;
+        if (ioctl(lazy.uffd, UFFDIO_ZEROPAGE, &zero) && errno == EEXIST)
+            lazy_wake(addr);
+        return;
+    }
+
+    /* the aligned window around the fault, most accesses are sequential */
+    region_end = (unsigned long) lazy.start + lazy.length;
+    start = addr & ~(LAZY_FAULT_AROUND_PAGES * page_size - 1);
+    if (start < (unsigned long) lazy.start)
+        start = (unsigned long) lazy.start;
+    end = start + LAZY_FAULT_AROUND_PAGES * page_size;
+    if (end > region_end)
+        end = region_end;
+
+    cont.range.start = start;
+    cont.range.len = end - start;
+    cont.mode = 0;
+    if (!ioctl(lazy.uffd, UFFDIO_CONTINUE, &cont))
+        return;
+
+    /* some window pages are mapped already or missing from the snapshot */
+    cont.range.start = addr;
+    cont.range.len = page_size;
+    if (ioctl(lazy.uffd, UFFDIO_CONTINUE, &cont) && errno == EEXIST)
+        lazy_wake(addr);
+}
+
+static void *lazy_handler(void *arg)
+{
+    struct uffd_msg msg;
+    ssize_t n;
+
+    (void) arg;
+
+    for (;;) {
+        n = read(lazy.uffd, &msg, sizeof(msg));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n != sizeof(msg)) {
+            ERROR("Error reading userfaultfd errno=%d\n", errno);
+            break;
+        }
+
+        if (msg.event == UFFD_EVENT_PAGEFAULT)
+            lazy_resolve(&msg);
+    }
+
+    return NULL;
+}
+
+static int lazy_child_init(void)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    sigset_t set, old;
+    int rc = 0;
+
+    if (lazy_remap_private() == MAP_FAILED) {
+        rc = -errno;
+        ERROR("Error remapping the clone region rc=%d\n", rc);
+        goto out;
+    }
+
+    lazy.uffd = lazy_uffd_open();
+    if (lazy.uffd < 0) {
+        rc = lazy.uffd;
+        lazy.uffd = -1;
+        ERROR("Error setting the clone region userfaultfd up rc=%d\n", rc);
+        goto out;
+    }
+
+    /* the app's signal handlers must run on the app thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    rc = -pthread_create(&thread, &attr, lazy_handler, NULL);
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc) {
+        ERROR("Error creating the userfaultfd handler rc=%d\n", rc);
+        goto out_close;
+    }
+    goto out;
+
+out_close:
+    close(lazy.uffd);
+    lazy.uffd = -1;
+out:
+    return rc;
+}
+
+int os_clone(unsigned int nr_children)
+{
+    unsigned int i;
+    pid_t pid;
+    int rc = 0;
+
     DEBUG("cloning children=%d\n", nr_children);
 
     if (!nr_children) {
@@ -50,35 +587,51 @@ int os_clone(unsigned int nr_children)
         goto out;
     }
 
-    child_ids = malloc(sizeof(unsigned short) * nr_children);
-    if (!child_ids) {
-        rc = -ENOMEM;
+    /* the clones of previous calls which have already exited */
+    clone_reap();
+
+    rc = clone_pids_reserve(nr_children);
+    if (rc)
         goto out;
-    }
 
-    rc = ukplat_clone(nr_children, child_ids);
-    if (rc == 0) /* parent */
-        rc = 0;
-    else if (rc == 1) { /* child */
-        rc = 0;
-        do_fork = 0; /* only parent forks */
-    } else {
-        ERROR("Error calling clone() rc=%d\n", rc);
-        rc = -1;
+    if (clone_mode == CLONE_MODE_LAZY && lazy.start) {
+        rc = lazy_snapshot();
+        if (rc)
+            goto out;
     }
 
-    free(child_ids);
+    /* the whole batch first, the children don't wait for each other */
+    for (i = 0; i < nr_children; i++) {
+        pid = fork();
+        if (pid == 0) { /* child */
+            self_id = next_id + i;
+            next_id = self_id + 1;
+            free(clone_pids);
+            clone_pids = NULL;
+            clone_pids_num = clone_pids_size = 0;
+
+            do_fork = 0; /* only parent forks */
+            do_clone = 0;
+
+            if (clone_mode == CLONE_MODE_LAZY && lazy.start &&
+                    lazy_child_init())
+                _exit(1);
+            return 1;
+        }
+        if (pid < 0) {
+            ERROR("Error calling fork() errno=%d\n", errno);
+            rc = -1;
+            break;
+        }
+        clone_pids[clone_pids_num++] = pid;
+    }
+    next_id += i;
 
 out:
     return rc;
-#else
-    /*TODO*/
-    (void) nr_children;
-    return -1;
-#endif
 }
 
 unsigned int os_get_self_id(void)
 {
-    return 0;
+    return self_id;
 }
@@ -40,15 +40,34 @@
 int os_parse_args(int argc, char **argv)
 {
     int opt, opt_index, rc = 0;
-    const char *short_opts = "ha:t:f:m:";
+    const char *short_opts = "ha:tfxc:s:m:w:eb:n:uBp:F:k:H:T:W:j:P:N:C:X:R:";
     const struct option long_opts[] = {
         { "help"               , no_argument       , NULL , 'h' },
         { "app"                , required_argument , NULL , 'a' },
         { "send-time"          , no_argument       , NULL , 't' },
         { "fork"               , no_argument       , NULL , 'f' },
+        { "clone"              , no_argument       , NULL , 'x' },
         { "children"           , required_argument , NULL , 'c' },
         { "sleep"              , required_argument , NULL , 's' },
         { "memory"             , required_argument , NULL , 'm' },
+        { "workers"            , required_argument , NULL , 'w' },
+        { "echo"               , no_argument       , NULL , 'e' },
+        { "netbuf-size"        , required_argument , NULL , 'b' },
+        { "netbuf-count"       , required_argument , NULL , 'n' },
+        { "io-uring"           , no_argument       , NULL , 'u' },
+        { "bench"              , no_argument       , NULL , 'B' },
+        { "pool"               , required_argument , NULL , 'p' },
+        { "fork-mode"          , required_argument , NULL , 'F' },
+        { "fork-fanout"        , required_argument , NULL , 'k' },
+        { "hist-dump"          , required_argument , NULL , 'H' },
+        { "trace-json"         , required_argument , NULL , 'T' },
+        { "touch-mode"         , required_argument , NULL , 'W' },
+        { "touch-threads"      , required_argument , NULL , 'j' },
+        { "page-mode"          , required_argument , NULL , 'P' },
+        { "numa"               , required_argument , NULL , 'N' },
+        { "cpus"               , required_argument , NULL , 'C' },
+        { "clone-mode"         , required_argument , NULL , 'X' },
+        { "regions"            , required_argument , NULL , 'R' },
         { NULL , 0 , NULL , 0 }
     };
 
@@ -109,6 +128,134 @@ int os_parse_args(int argc, char **argv)
             memory_str = optarg;
             break;
 
+        case 'H':
+            hist_dump_prefix = optarg;
+            break;
+
+        case 'T':
+            trace_json_prefix = optarg;
+            break;
+
+        case 'e':
+            do_echo = 1;
+            break;
+
+        case 'u':
+            do_io_uring = 1;
+            break;
+
+        case 'B':
+            do_bench = 1;
+            break;
+
+        case 'F': {
+            if (string_to_fork_mode(optarg, &fork_mode)) {
+                ERROR("Unsupported fork mode: %s\n", optarg);
+                print_usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        }
+
+        case 'X': {
+            if (string_to_clone_mode(optarg, &clone_mode)) {
+                ERROR("Unsupported clone mode: %s\n", optarg);
+                print_usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        }
+
+        case 'k': {
+            fork_fanout = atoi(optarg);
+            if (fork_fanout < 1) {
+                ERROR("Fork fanout should be positive\n");
+                print_usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        }
+
+        case 'W': {
+            if (string_to_touch_mode(optarg, &touch_mode)) {
+                ERROR("Unsupported touch mode: %s\n", optarg);
+                print_usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        }
+
+        case 'j': {
+            touch_threads = atoi(optarg);
+            if (touch_threads < 0) {
+                ERROR("Touch threads number should not be negative\n");
+                print_usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        }
+
+        case 'P': {
+            if (string_to_page_mode(optarg, &page_mode)) {
+                ERROR("Unsupported page mode: %s\n", optarg);
+                print_usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        }
+
+        case 'R':
+            regions_str = optarg;
+            break;
+
+        case 'N':
+            numa_str = optarg;
+            break;
+
+        case 'C':
+            cpus_str = optarg;
+            break;
+
+        case 'p': {
+            pool_size = atoi(optarg);
+            if (pool_size < 0) {
+                ERROR("Pool size should not be negative\n");
+                print_usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        }
+
+        case 'b': {
+            netbuf_size = atoi(optarg);
+            if (netbuf_size < 64) {
+                ERROR("Network buffer size should be at least 64\n");
+                print_usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        }
+
+        case 'n': {
+            netbuf_count = atoi(optarg);
+            if (netbuf_count < 0) {
+                ERROR("Network buffer count should not be negative\n");
+                print_usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        }
+
+        case 'w': {
+            workers_num = atoi(optarg);
+            if (workers_num < 0) {
+                ERROR("Workers number should not be negative\n");
+                print_usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        }
+
         default:
             rc = -1;
             break;
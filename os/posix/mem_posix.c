@@ -30,47 +30,288 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <common/cfg.h>
+#include <common/log.h>
 #include <common/mem.h>
+#if CFG_NUMA
+#include <os/posix/numa.h>
+#endif
 
 
+#define ALIGN_UP(v, a) (((v) + (a) - 1) & ~((a) - 1))
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+#ifdef __linux__
+/* Returns the /proc/meminfo field in kB, 0 if it is missing */
+static unsigned long meminfo_kb(const char *key)
+{
+    char line[128];
+    unsigned long kb = 0;
+    size_t len = strlen(key);
+    FILE *f;
+
+    f = fopen("/proc/meminfo", "r");
+    if (!f)
+        goto out;
+
+    while (fgets(line, sizeof(line), f)) {
+        if (!strncmp(line, key, len) && line[len] == ':') {
+            kb = strtoul(line + len + 1, NULL, 10);
+            break;
+        }
+    }
+
+    fclose(f);
+out:
+    return kb;
+}
+
+static int read_proc_long(const char *path, long *value)
+{
+    FILE *f;
+    int rc = 0;
+
+    f = fopen(path, "r");
+    if (!f)
+        return -errno;
+
+    if (fscanf(f, "%ld", value) != 1)
+        rc = -EINVAL;
+
+    fclose(f);
+    return rc;
+}
+
+/*
+ * Upper bound of the region that can be both mapped and faulted in: the
+ * address space left under RLIMIT_AS, the commit headroom when overcommit
+ * is disabled and MemAvailable (swap excluded, a region that only fits by
+ * swapping is of no use for filling the memory).
+ */
+static unsigned long max_contiguous_limit_pages(void)
+{
+    unsigned long page_kb = os_get_page_size() / 1024, limit, avail_kb;
+    struct rlimit rl;
+    long mapped_pages, overcommit, kb;
+
+    /* 47-bit user address space */
+    limit = (1UL << 47) / os_get_page_size();
+
+    if (!getrlimit(RLIMIT_AS, &rl) && rl.rlim_cur != RLIM_INFINITY &&
+            !read_proc_long("/proc/self/statm", &mapped_pages)) {
+        if (rl.rlim_cur / os_get_page_size() <= (unsigned long) mapped_pages)
+            return 0;
+        limit = MIN(limit, rl.rlim_cur / os_get_page_size() - mapped_pages);
+    }
+
+    if (!read_proc_long("/proc/sys/vm/overcommit_memory", &overcommit) &&
+            overcommit == 2) {
+        kb = meminfo_kb("CommitLimit") - meminfo_kb("Committed_AS");
+        limit = MIN(limit, kb > 0 ? kb / page_kb : 0);
+    }
+
+    avail_kb = meminfo_kb("MemAvailable");
+    if (avail_kb)
+        limit = MIN(limit, avail_kb / page_kb);
+
+    return limit;
+}
+#else
+static unsigned long max_contiguous_limit_pages(void)
+{
+    return (1UL << 47) / os_get_page_size();
+}
+#endif
+
+static int mmap_probe(unsigned long pages_num)
+{
+    size_t length = (size_t) os_get_page_size() * pages_num;
+    char *start;
+
+    start = mmap(NULL, length, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (start == MAP_FAILED)
+        return 0;
+
+    munmap(start, length);
+    return 1;
+}
+
 int os_alloc_max_contiguous_memory(char **pstart, unsigned long *ppages_num)
 {
-    /* TODO */
-    (void) pstart;
-    (void) ppages_num;
-    return -1;
+    unsigned long lo = 0, hi, mid;
+    int rc;
+
+    /*
+     * Binary search of the largest mapping under the limit: lo always
+     * maps, hi never does. The address space may be fragmented or the
+     * kernel may refuse more than the limits we know about.
+     */
+    hi = max_contiguous_limit_pages() + 1;
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (mmap_probe(mid))
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    if (!lo) {
+        rc = -ENOMEM;
+        goto out;
+    }
+
+    rc = os_alloc_pages(lo, pstart);
+    if (rc)
+        goto out;
+
+    *ppages_num = lo;
+    DEBUG("Max contiguous memory %lu pages\n", lo);
+
+out:
+    return rc;
 }
 
 int os_free_max_contiguous_memory(char *start, unsigned long pages_num)
 {
-    /* TODO */
-    (void) start;
-    (void) pages_num;
-    return -1;
+    return os_free_pages(start, pages_num);
 }
 
+#define HUGE_PAGE_SIZE_2M   (2UL << 20)
+#define HUGE_PAGE_SIZE_1G   (1UL << 30)
 
-int os_alloc_pages(unsigned long pages_num, char **pstart)
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT      26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB        (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB        (30 << MAP_HUGE_SHIFT)
+#endif
+
+
+static size_t page_mode_length(unsigned long pages_num, enum page_mode mode)
 {
-    char *start;
+    size_t length = (size_t) os_get_page_size() * pages_num;
+
+    switch (mode) {
+    case PAGE_MODE_THP:
+    case PAGE_MODE_2M:
+        length = ALIGN_UP(length, HUGE_PAGE_SIZE_2M);
+        break;
+    case PAGE_MODE_1G:
+        length = ALIGN_UP(length, HUGE_PAGE_SIZE_1G);
+        break;
+    default:
+        break;
+    }
+
+    return length;
+}
+
+#if defined(MADV_HUGEPAGE) && defined(MADV_NOHUGEPAGE)
+/* THP needs the region to start on a huge page boundary */
+static char *thp_mmap(size_t length)
+{
+    char *start, *aligned;
+    size_t head;
+
+    start = mmap(NULL, length + HUGE_PAGE_SIZE_2M, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (start == MAP_FAILED)
+        return MAP_FAILED;
+
+    aligned = (char *) ALIGN_UP((unsigned long) start, HUGE_PAGE_SIZE_2M);
+    head = aligned - start;
+    if (head)
+        munmap(start, head);
+    munmap(aligned + length, HUGE_PAGE_SIZE_2M - head);
+
+    if (madvise(aligned, length, MADV_HUGEPAGE)) {
+        ERROR("Error madvise(MADV_HUGEPAGE) errno=%d\n", errno);
+        munmap(aligned, length);
+        return MAP_FAILED;
+    }
+
+    return aligned;
+}
+#endif
+
+int os_alloc_pages_mode(unsigned long pages_num, enum page_mode mode,
+        char **pstart)
+{
+    char *start = MAP_FAILED;
     size_t length;
     int rc = 0;
 
-    length = os_get_page_size() * pages_num;
+    length = page_mode_length(pages_num, mode);
 
-    start = mmap(NULL, length, PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (start)
-        *pstart = start;
-    else
-        rc = -ENOMEM;
+    switch (mode) {
+    case PAGE_MODE_DEFAULT:
+    case PAGE_MODE_4K:
+        start = mmap(NULL, length, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_NOHUGEPAGE
+        /* fails without THP support, then the pages are 4 KB anyway */
+        if (start != MAP_FAILED && mode == PAGE_MODE_4K)
+            madvise(start, length, MADV_NOHUGEPAGE);
+#endif
+        break;
 
+    case PAGE_MODE_THP:
+#if defined(MADV_HUGEPAGE) && defined(MADV_NOHUGEPAGE)
+        start = thp_mmap(length);
+#else
+        errno = ENOTSUP;
+#endif
+        break;
+
+    case PAGE_MODE_2M:
+    case PAGE_MODE_1G:
+#ifdef MAP_HUGETLB
+        start = mmap(NULL, length, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+            (mode == PAGE_MODE_2M ? MAP_HUGE_2MB : MAP_HUGE_1GB), -1, 0);
+        if (start == MAP_FAILED)
+            ERROR("Could not map %zu bytes of %s hugetlb pages, "
+                "check /sys/kernel/mm/hugepages (errno=%d)\n", length,
+                mode == PAGE_MODE_2M ? "2 MB" : "1 GB", errno);
+#else
+        errno = ENOTSUP;
+#endif
+        break;
+    }
+
+    if (start == MAP_FAILED) {
+        rc = -errno;
+        goto out;
+    }
+
+#if CFG_NUMA
+    /* before the first touch, the policy only places new pages */
+    rc = os_numa_bind(start, length);
+    if (rc) {
+        munmap(start, length);
+        goto out;
+    }
+#endif
+
+    *pstart = start;
+out:
     return rc;
 }
 
-int os_free_pages(char *start, unsigned long pages_num)
+int os_free_pages_mode(char *start, unsigned long pages_num,
+        enum page_mode mode)
 {
     size_t length;
     int rc = 0;
@@ -80,10 +321,90 @@ int os_free_pages(char *start, unsigned long pages_num)
         goto out;
     }
 
-    length = os_get_page_size() * pages_num;
+    length = page_mode_length(pages_num, mode);
 
     rc = munmap(start, length);
 
 out:
     return rc;
 }
+
+int os_alloc_pages(unsigned long pages_num, char **pstart)
+{
+    return os_alloc_pages_mode(pages_num, PAGE_MODE_DEFAULT, pstart);
+}
+
+int os_free_pages(char *start, unsigned long pages_num)
+{
+    return os_free_pages_mode(start, pages_num, PAGE_MODE_DEFAULT);
+}
+
+int os_alloc_pages_inherit(unsigned long pages_num, enum mem_inherit inherit,
+        char **pstart)
+{
+    size_t length = (size_t) os_get_page_size() * pages_num;
+    char *start;
+    int advice, rc = 0;
+
+    switch (inherit) {
+    case MEM_INHERIT_COW:
+        return os_alloc_pages(pages_num, pstart);
+
+    case MEM_INHERIT_SHARED:
+        start = mmap(NULL, length, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (start == MAP_FAILED) {
+            rc = -errno;
+            goto out;
+        }
+#if CFG_NUMA
+        rc = os_numa_bind(start, length);
+        if (rc) {
+            munmap(start, length);
+            goto out;
+        }
+#endif
+        break;
+
+    case MEM_INHERIT_DONTFORK:
+    case MEM_INHERIT_WIPE:
+#ifdef MADV_WIPEONFORK
+        advice = inherit == MEM_INHERIT_WIPE ? MADV_WIPEONFORK : MADV_DONTFORK;
+#else
+        if (inherit == MEM_INHERIT_WIPE) {
+            rc = -ENOTSUP;
+            goto out;
+        }
+        advice = MADV_DONTFORK;
+#endif
+        rc = os_alloc_pages(pages_num, &start);
+        if (rc)
+            goto out;
+
+        /* fork() now skips (or zero-fills) the pages instead of copying */
+        if (madvise(start, length, advice)) {
+            rc = -errno;
+            ERROR("Error madvise(%s) errno=%d\n",
+                inherit == MEM_INHERIT_WIPE ? "MADV_WIPEONFORK" :
+                "MADV_DONTFORK", errno);
+            munmap(start, length);
+            goto out;
+        }
+        break;
+
+    default:
+        rc = -EINVAL;
+        goto out;
+    }
+
+    *pstart = start;
+out:
+    return rc;
+}
+
+int os_free_pages_inherit(char *start, unsigned long pages_num,
+        enum mem_inherit inherit)
+{
+    (void) inherit;
+    return os_free_pages(start, pages_num);
+}
@@ -86,6 +86,23 @@ int os_alloc_pages(unsigned long pages_num, char **pstart)
     return rc;
 }
 
+int os_alloc_pages_mode(unsigned long pages_num, enum page_mode mode,
+        char **pstart)
+{
+    /* no huge pages, the allocator hands out 4 KB frames */
+    if (mode != PAGE_MODE_DEFAULT && mode != PAGE_MODE_4K)
+        return -ENOTSUP;
+
+    return os_alloc_pages(pages_num, pstart);
+}
+
+int os_free_pages_mode(char *start, unsigned long pages_num,
+        enum page_mode mode)
+{
+    (void) mode;
+    return os_free_pages(start, pages_num);
+}
+
 int os_free_pages(char *start, unsigned long pages_num)
 {
     int rc = 0;
@@ -100,3 +117,20 @@ int os_free_pages(char *start, unsigned long pages_num)
 out:
     return rc;
 }
+
+int os_alloc_pages_inherit(unsigned long pages_num, enum mem_inherit inherit,
+        char **pstart)
+{
+    /* a clone gets the copy-on-write memory of its parent, all of it */
+    if (inherit != MEM_INHERIT_COW)
+        return -ENOTSUP;
+
+    return os_alloc_pages(pages_num, pstart);
+}
+
+int os_free_pages_inherit(char *start, unsigned long pages_num,
+        enum mem_inherit inherit)
+{
+    (void) inherit;
+    return os_free_pages(start, pages_num);
+}
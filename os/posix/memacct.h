@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Authors: Costin Lupu <costin.lupu@cs.pub.ro>
+ *
+ * Copyright (c) 2022, University Politehnica of Bucharest. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef APP_POSIX_MEMACCT_H_
+#define APP_POSIX_MEMACCT_H_
+
+/*
+ * Sharing accounting of a region of the calling process, from the
+ * /proc/self/pagemap entries of its pages. With the privileges to read
+ * /proc/kpageflags the zero page mappings and the private copies are told
+ * apart page by page; without, the private dirty memory comes from the
+ * smaps entries of the region and zero pages are not known.
+ */
+
+struct os_mem_account {
+    unsigned long pages;
+    unsigned long present;
+    unsigned long swapped;
+    /* present pages also mapped by other processes, e.g. after fork() */
+    unsigned long shared;
+    /* present pages mapped by this process only */
+    unsigned long private;
+    /* private pages written by this process, i.e. COW copies */
+    unsigned long private_dirty;
+    /* mappings of the zero page, -1UL if unknown */
+    unsigned long zero;
+    const char *source;
+};
+
+int os_mem_account(char *start, unsigned long pages_num,
+        struct os_mem_account *acct);
+
+/* MEM_TRACE line with the counts in pages */
+void os_mem_account_print(const char *prefix, struct os_mem_account *acct);
+
+#endif /* APP_POSIX_MEMACCT_H_ */
@@ -0,0 +1,185 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Authors: Costin Lupu <costin.lupu@cs.pub.ro>
+ *
+ * Copyright (c) 2022, University Politehnica of Bucharest. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <common/log.h>
+#include <common/mem.h>
+#include <os/posix/memacct.h>
+
+/* Documentation/admin-guide/mm/pagemap.rst */
+#define PM_PFN_MASK             ((1ULL << 55) - 1)
+#define PM_MMAP_EXCLUSIVE       (1ULL << 56)
+#define PM_SWAP                 (1ULL << 62)
+#define PM_PRESENT              (1ULL << 63)
+
+#define KPF_ANON                12
+#define KPF_ZERO_PAGE           24
+
+/* pagemap entries read at once */
+#define PAGEMAP_BATCH           512
+
+static int kpageflags_read(int fd, uint64_t pfn, uint64_t *flags)
+{
+    return pread(fd, flags, sizeof(*flags), pfn * sizeof(*flags)) ==
+        sizeof(*flags) ? 0 : -1;
+}
+
+/* Private_Dirty of the smaps entries overlapping the region, in pages */
+static unsigned long smaps_private_dirty(char *start, unsigned long pages_num)
+{
+    unsigned long vma_start, vma_end, region_start, region_end, kb;
+    unsigned long total_kb = 0;
+    int overlaps = 0;
+    char line[256];
+    FILE *f;
+
+    f = fopen("/proc/self/smaps", "r");
+    if (!f)
+        return 0;
+
+    region_start = (unsigned long) start;
+    region_end = region_start + pages_num * os_page_size;
+
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%lx-%lx ", &vma_start, &vma_end) == 2)
+            overlaps = vma_start < region_end && vma_end > region_start;
+        else if (overlaps && sscanf(line, "Private_Dirty: %lu kB", &kb) == 1)
+            total_kb += kb;
+    }
+
+    fclose(f);
+    return total_kb * 1024 / os_page_size;
+}
+
+int os_mem_account(char *start, unsigned long pages_num,
+        struct os_mem_account *acct)
+{
+    uint64_t entries[PAGEMAP_BATCH], flags, pfn;
+    unsigned long i, j, n;
+    int pagemap_fd, kpageflags_fd, exact = 0, rc = 0;
+    ssize_t len;
+    off_t off;
+
+    if (!os_page_size)
+        os_page_size = os_get_page_size();
+
+    memset(acct, 0, sizeof(*acct));
+    acct->pages = pages_num;
+
+    pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    if (pagemap_fd < 0) {
+        rc = -errno;
+        ERROR("Error opening /proc/self/pagemap rc=%d\n", rc);
+        goto out;
+    }
+
+    /* root only, the PFNs read as 0 otherwise anyway */
+    kpageflags_fd = open("/proc/kpageflags", O_RDONLY | O_CLOEXEC);
+
+    for (i = 0; i < pages_num; i += n) {
+        n = pages_num - i < PAGEMAP_BATCH ? pages_num - i : PAGEMAP_BATCH;
+        off = ((unsigned long) start / os_page_size + i) * sizeof(uint64_t);
+
+        len = pread(pagemap_fd, entries, n * sizeof(uint64_t), off);
+        if (len != (ssize_t) (n * sizeof(uint64_t))) {
+            rc = len < 0 ? -errno : -EIO;
+            ERROR("Error reading /proc/self/pagemap rc=%d\n", rc);
+            goto out_close;
+        }
+
+        for (j = 0; j < n; j++) {
+            if (entries[j] & PM_SWAP) {
+                acct->swapped++;
+                continue;
+            }
+            if (!(entries[j] & PM_PRESENT))
+                continue;
+
+            acct->present++;
+
+            pfn = entries[j] & PM_PFN_MASK;
+            if (kpageflags_fd >= 0 && pfn &&
+                    !kpageflags_read(kpageflags_fd, pfn, &flags)) {
+                exact = 1;
+                if (flags & (1ULL << KPF_ZERO_PAGE)) {
+                    acct->zero++;
+                    continue;
+                }
+                /* anonymous and exclusive: written here, a COW copy */
+                if ((flags & (1ULL << KPF_ANON)) &&
+                        (entries[j] & PM_MMAP_EXCLUSIVE))
+                    acct->private_dirty++;
+            }
+
+            if (entries[j] & PM_MMAP_EXCLUSIVE)
+                acct->private++;
+            else
+                acct->shared++;
+        }
+    }
+
+    if (exact) {
+        acct->source = "kpageflags";
+    } else {
+        acct->source = "smaps";
+        acct->zero = -1UL;
+        acct->private_dirty = smaps_private_dirty(start, pages_num);
+    }
+
+out_close:
+    if (kpageflags_fd >= 0)
+        close(kpageflags_fd);
+    close(pagemap_fd);
+out:
+    return rc;
+}
+
+void os_mem_account_print(const char *prefix, struct os_mem_account *acct)
+{
+    char zero[24];
+
+    if (acct->zero == -1UL)
+        snprintf(zero, sizeof(zero), "n/a");
+    else
+        snprintf(zero, sizeof(zero), "%lu", acct->zero);
+
+    fprintf(stderr, "MEM_TRACE %s pages=%lu present=%lu shared=%lu "
+        "private=%lu private-dirty=%lu zero=%s swapped=%lu source=%s\n",
+        prefix, acct->pages, acct->present, acct->shared, acct->private,
+        acct->private_dirty, zero, acct->swapped, acct->source);
+}
@@ -0,0 +1,298 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Authors: Costin Lupu <costin.lupu@cs.pub.ro>
+ *
+ * Copyright (c) 2022, University Politehnica of Bucharest. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <common/log.h>
+#include <common/cmdline.h>
+#include <common/mem.h>
+#include <os/posix/numa.h>
+
+#define NUMA_MAX_NODES          1024
+#define BITS_PER_LONG           (8 * sizeof(unsigned long))
+#define NUMA_MASK_LONGS         (NUMA_MAX_NODES / BITS_PER_LONG)
+
+#define MASK_TEST(mask, i) \
+    ((mask)[(i) / BITS_PER_LONG] & (1UL << ((i) % BITS_PER_LONG)))
+#define MASK_SET(mask, i) \
+    ((mask)[(i) / BITS_PER_LONG] |= 1UL << ((i) % BITS_PER_LONG))
+/* pages whose node is looked up by os_numa_print_layout() */
+#define NUMA_LAYOUT_SAMPLES     4096
+
+static const char *numa_policy_names[] = {
+    [MPOL_DEFAULT] = "default",
+    [MPOL_PREFERRED] = "preferred",
+    [MPOL_BIND] = "bind",
+    [MPOL_INTERLEAVE] = "interleave",
+};
+
+static struct {
+    int policy;
+    unsigned long nodes[NUMA_MASK_LONGS];
+    int nodes_num;
+    const char *nodes_str;
+} numa = {
+    .policy = MPOL_DEFAULT,
+    .nodes_str = "all",
+};
+
+static long sys_mbind(void *start, unsigned long len, int mode,
+        const unsigned long *nodemask, unsigned long maxnode, unsigned flags)
+{
+    return syscall(__NR_mbind, start, len, mode, nodemask, maxnode, flags);
+}
+
+static long sys_move_pages(int pid, unsigned long count, void **pages,
+        const int *nodes, int *status, int flags)
+{
+    return syscall(__NR_move_pages, pid, count, pages, nodes, status, flags);
+}
+
+/* Parses a "0-3,8" list into a bit mask, returns the bits set or -EINVAL */
+static int parse_list(const char *s, unsigned long *mask, int max)
+{
+    const char *p = s;
+    char *end;
+    long first, last, i;
+    int num = 0;
+
+    memset(mask, 0, max / 8);
+
+    while (*p) {
+        first = last = strtol(p, &end, 10);
+        if (end == p || first < 0)
+            return -EINVAL;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+                return -EINVAL;
+        }
+        if (last >= max)
+            return -EINVAL;
+
+        for (i = first; i <= last; i++) {
+            if (!MASK_TEST(mask, i)) {
+                MASK_SET(mask, i);
+                num++;
+            }
+        }
+
+        if (*end == ',')
+            end++;
+        else if (*end != '\0' && *end != '\n')
+            return -EINVAL;
+        p = end;
+        if (*p == '\n')
+            break;
+    }
+
+    return num;
+}
+
+static int online_nodes(unsigned long *mask)
+{
+    char line[256];
+    FILE *f;
+    int rc = -ENOENT;
+
+    f = fopen("/sys/devices/system/node/online", "r");
+    if (!f)
+        goto out;
+
+    if (fgets(line, sizeof(line), f))
+        rc = parse_list(line, mask, NUMA_MAX_NODES);
+
+    fclose(f);
+out:
+    return rc;
+}
+
+static int numa_policy_parse(const char *s)
+{
+    const char *list;
+    size_t len;
+    int i, rc = -EINVAL;
+
+    list = strchr(s, ':');
+    len = list ? (size_t) (list - s) : strlen(s);
+
+    for (i = 0; i < (int) (sizeof(numa_policy_names) / sizeof(numa_policy_names[0])); i++) {
+        if (numa_policy_names[i] && strlen(numa_policy_names[i]) == len &&
+                !strncmp(s, numa_policy_names[i], len)) {
+            numa.policy = i;
+            rc = 0;
+            break;
+        }
+    }
+    if (rc)
+        goto out;
+
+    /* all the online nodes unless given */
+    if (list) {
+        numa.nodes_str = list + 1;
+        rc = parse_list(list + 1, numa.nodes, NUMA_MAX_NODES);
+    } else
+        rc = online_nodes(numa.nodes);
+    if (rc <= 0) {
+        rc = -EINVAL;
+        goto out;
+    }
+    numa.nodes_num = rc;
+    rc = 0;
+
+out:
+    return rc;
+}
+
+int os_numa_init(void)
+{
+    unsigned long cpus[CPU_SETSIZE / BITS_PER_LONG];
+    cpu_set_t set;
+    int i, rc = 0;
+
+    if (numa_str) {
+        rc = numa_policy_parse(numa_str);
+        if (rc) {
+            ERROR("Invalid NUMA policy '%s'\n", numa_str);
+            goto out;
+        }
+    }
+
+    if (cpus_str) {
+        rc = parse_list(cpus_str, cpus, CPU_SETSIZE);
+        if (rc <= 0) {
+            ERROR("Invalid CPU list '%s'\n", cpus_str);
+            rc = -EINVAL;
+            goto out;
+        }
+
+        CPU_ZERO(&set);
+        for (i = 0; i < CPU_SETSIZE; i++) {
+            if (MASK_TEST(cpus, i))
+                CPU_SET(i, &set);
+        }
+
+        rc = sched_setaffinity(0, sizeof(set), &set);
+        if (rc) {
+            rc = -errno;
+            ERROR("Error sched_setaffinity() rc=%d\n", rc);
+            goto out;
+        }
+    }
+
+    if (numa_str || cpus_str)
+        fprintf(stderr, "NUMA_TRACE config policy=%s nodes=%s cpus=%s\n",
+            numa_policy_names[numa.policy], numa.nodes_str,
+            cpus_str ? cpus_str : "all");
+
+out:
+    return rc;
+}
+
+int os_numa_bind(char *start, size_t length)
+{
+    unsigned long *nodes = numa.nodes;
+    unsigned long preferred[NUMA_MASK_LONGS];
+    int i, rc = 0;
+
+    if (numa.policy == MPOL_DEFAULT)
+        goto out;
+
+    /* the preferred policy takes a single node, the first one given */
+    if (numa.policy == MPOL_PREFERRED) {
+        memset(preferred, 0, sizeof(preferred));
+        for (i = 0; i < NUMA_MAX_NODES; i++) {
+            if (MASK_TEST(numa.nodes, i)) {
+                MASK_SET(preferred, i);
+                break;
+            }
+        }
+        nodes = preferred;
+    }
+
+    if (sys_mbind(start, length, numa.policy, nodes, NUMA_MAX_NODES + 1, 0)) {
+        rc = -errno;
+        ERROR("Error mbind(%s) rc=%d\n", numa_policy_names[numa.policy], rc);
+    }
+
+out:
+    return rc;
+}
+
+void os_numa_print_layout(const char *prefix, char *start,
+        unsigned long pages_num)
+{
+    unsigned long step, count = 0, i;
+    unsigned long per_node[64] = { 0 }, absent = 0;
+    void *pages[NUMA_LAYOUT_SAMPLES];
+    int status[NUMA_LAYOUT_SAMPLES];
+    char line[512];
+    int len, node;
+
+    step = pages_num / NUMA_LAYOUT_SAMPLES + 1;
+    for (i = 0; i < pages_num && count < NUMA_LAYOUT_SAMPLES; i += step)
+        pages[count++] = start + i * os_page_size;
+
+    /* without target nodes move_pages() only reports where pages are */
+    if (sys_move_pages(0, count, pages, NULL, status, 0)) {
+        DEBUG("Error move_pages() errno=%d\n", errno);
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        node = status[i];
+        if (node >= 0 && node < 64)
+            per_node[node]++;
+        else
+            absent++;
+    }
+
+    len = snprintf(line, sizeof(line), "NUMA_TRACE %s policy=%s samples=%lu",
+        prefix, numa_policy_names[numa.policy], count);
+    for (i = 0; i < 64 && len < (int) sizeof(line); i++) {
+        if (per_node[i])
+            len += snprintf(line + len, sizeof(line) - len, " node%lu=%lu",
+                i, per_node[i]);
+    }
+    if (absent && len < (int) sizeof(line))
+        snprintf(line + len, sizeof(line) - len, " absent=%lu", absent);
+
+    fprintf(stderr, "%s\n", line);
+}
@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Authors: Costin Lupu <costin.lupu@cs.pub.ro>
+ *
+ * Copyright (c) 2022, University Politehnica of Bucharest. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef APP_POSIX_PERF_H_
+#define APP_POSIX_PERF_H_
+
+/*
+ * Hardware and software counters of the calling thread via
+ * perf_event_open(2). Events that cannot be opened (no PMU in the VM,
+ * perf_event_paranoid, seccomp) are skipped and reported as n/a.
+ */
+
+#include <stdint.h>
+
+enum os_perf_event {
+    OS_PERF_PAGE_FAULTS,
+    OS_PERF_MINOR_FAULTS,
+    OS_PERF_DTLB_LOAD_MISSES,
+    OS_PERF_CACHE_MISSES,
+    OS_PERF_CYCLES,
+    OS_PERF_INSTRUCTIONS,
+    OS_PERF_EVENTS_NUM
+};
+
+struct os_perf {
+    /* one group for the software and one for the hardware events */
+    int sw_leader;
+    int hw_leader;
+    int fds[OS_PERF_EVENTS_NUM];
+    uint64_t values[OS_PERF_EVENTS_NUM];
+    int opened_num;
+};
+
+/* Returns the number of events opened, 0 if none is available */
+int os_perf_open(struct os_perf *perf);
+void os_perf_close(struct os_perf *perf);
+
+void os_perf_start(struct os_perf *perf);
+void os_perf_stop(struct os_perf *perf);
+
+/* PERF_TRACE line with the values of the last start/stop interval */
+void os_perf_print(struct os_perf *perf, const char *prefix);
+
+#endif /* APP_POSIX_PERF_H_ */
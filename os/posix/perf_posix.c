@@ -0,0 +1,211 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Authors: Costin Lupu <costin.lupu@cs.pub.ro>
+ *
+ * Copyright (c) 2022, University Politehnica of Bucharest. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <common/log.h>
+#include <os/posix/perf.h>
+
+
+static const struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} perf_events[OS_PERF_EVENTS_NUM] = {
+    [OS_PERF_PAGE_FAULTS] = {
+        "page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS
+    },
+    [OS_PERF_MINOR_FAULTS] = {
+        "minor-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MIN
+    },
+    [OS_PERF_DTLB_LOAD_MISSES] = {
+        "dtlb-load-misses", PERF_TYPE_HW_CACHE,
+        PERF_COUNT_HW_CACHE_DTLB |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+    },
+    [OS_PERF_CACHE_MISSES] = {
+        "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES
+    },
+    [OS_PERF_CYCLES] = {
+        "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES
+    },
+    [OS_PERF_INSTRUCTIONS] = {
+        "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS
+    },
+};
+
+static int sys_perf_event_open(struct perf_event_attr *attr, pid_t pid,
+        int cpu, int group_fd, unsigned long flags)
+{
+    return syscall(__NR_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+static int perf_event_open_one(int i, int group_fd)
+{
+    struct perf_event_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = perf_events[i].type;
+    attr.config = perf_events[i].config;
+    /* only the leader starts disabled, members follow it */
+    attr.disabled = (group_fd == -1);
+    attr.exclude_hv = 1;
+    /* threads spawned while counting, e.g. by mem_touch_pages() */
+    attr.inherit = 1;
+    /* multiplexed hardware counters are scaled on read */
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+        PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    fd = sys_perf_event_open(&attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+        /* paranoid level 2 allows user space counting only */
+        attr.exclude_kernel = 1;
+        fd = sys_perf_event_open(&attr, 0, -1, group_fd,
+                PERF_FLAG_FD_CLOEXEC);
+    }
+    if (fd < 0) {
+        DEBUG("perf event %s not available (errno=%d)\n",
+            perf_events[i].name, errno);
+    }
+
+    return fd;
+}
+
+int os_perf_open(struct os_perf *perf)
+{
+    int i, *leader;
+
+    perf->sw_leader = perf->hw_leader = -1;
+    perf->opened_num = 0;
+
+    for (i = 0; i < OS_PERF_EVENTS_NUM; i++) {
+        perf->values[i] = 0;
+
+        leader = perf_events[i].type == PERF_TYPE_SOFTWARE ?
+            &perf->sw_leader : &perf->hw_leader;
+
+        perf->fds[i] = perf_event_open_one(i, *leader);
+        if (perf->fds[i] < 0)
+            continue;
+
+        if (*leader == -1)
+            *leader = perf->fds[i];
+        perf->opened_num++;
+    }
+
+    return perf->opened_num;
+}
+
+void os_perf_close(struct os_perf *perf)
+{
+    int i;
+
+    /* members first, closing the leader would tear down the group */
+    for (i = OS_PERF_EVENTS_NUM - 1; i >= 0; i--) {
+        if (perf->fds[i] >= 0 && perf->fds[i] != perf->sw_leader &&
+                perf->fds[i] != perf->hw_leader)
+            close(perf->fds[i]);
+    }
+    if (perf->sw_leader >= 0)
+        close(perf->sw_leader);
+    if (perf->hw_leader >= 0)
+        close(perf->hw_leader);
+
+    perf->sw_leader = perf->hw_leader = -1;
+    for (i = 0; i < OS_PERF_EVENTS_NUM; i++)
+        perf->fds[i] = -1;
+    perf->opened_num = 0;
+}
+
+static void perf_group_ioctl(struct os_perf *perf, unsigned long request)
+{
+    if (perf->sw_leader >= 0)
+        ioctl(perf->sw_leader, request, PERF_IOC_FLAG_GROUP);
+    if (perf->hw_leader >= 0)
+        ioctl(perf->hw_leader, request, PERF_IOC_FLAG_GROUP);
+}
+
+void os_perf_start(struct os_perf *perf)
+{
+    perf_group_ioctl(perf, PERF_EVENT_IOC_RESET);
+    perf_group_ioctl(perf, PERF_EVENT_IOC_ENABLE);
+}
+
+void os_perf_stop(struct os_perf *perf)
+{
+    uint64_t buf[3];
+    int i;
+
+    perf_group_ioctl(perf, PERF_EVENT_IOC_DISABLE);
+
+    for (i = 0; i < OS_PERF_EVENTS_NUM; i++) {
+        perf->values[i] = 0;
+
+        if (perf->fds[i] < 0)
+            continue;
+
+        if (read(perf->fds[i], buf, sizeof(buf)) != sizeof(buf))
+            continue;
+
+        /* buf[1] time enabled, buf[2] time running */
+        if (buf[2] && buf[2] < buf[1])
+            buf[0] = (uint64_t) ((double) buf[0] * buf[1] / buf[2]);
+        perf->values[i] = buf[0];
+    }
+}
+
+void os_perf_print(struct os_perf *perf, const char *prefix)
+{
+    char line[256];
+    int i, len;
+
+    len = snprintf(line, sizeof(line), "PERF_TRACE %s", prefix);
+
+    for (i = 0; i < OS_PERF_EVENTS_NUM && len < (int) sizeof(line); i++) {
+        if (perf->fds[i] >= 0)
+            len += snprintf(line + len, sizeof(line) - len, " %s=%lu",
+                perf_events[i].name, (unsigned long) perf->values[i]);
+        else
+            len += snprintf(line + len, sizeof(line) - len, " %s=n/a",
+                perf_events[i].name);
+    }
+
+    fprintf(stderr, "%s\n", line);
+}
@@ -32,10 +32,50 @@
 
 #define _GNU_SOURCE
 #include <stdlib.h>
+#include <unistd.h>
 #include <errno.h>
+#include <sched.h>
+#include <pthread.h>
 #include <common/log.h>
+#include <common/arena.h>
 #include <common/thread.h>
 
+/* one page holds the os_thread structs of all the workers */
+#define THREAD_ARENA_SIZE   4096
+
+static struct arena thread_arena;
+static int thread_arena_failed;
+static pthread_mutex_t thread_arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct os_thread *os_thread_alloc(void)
+{
+    struct os_thread *t;
+
+    pthread_mutex_lock(&thread_arena_lock);
+    if (!thread_arena.start && !thread_arena_failed &&
+            arena_init(&thread_arena, THREAD_ARENA_SIZE))
+        thread_arena_failed = 1;
+    t = arena_alloc(&thread_arena, sizeof(*t));
+    pthread_mutex_unlock(&thread_arena_lock);
+
+    if (!t)
+        t = malloc(sizeof(*t));
+
+    return t;
+}
+
+static void os_thread_free(struct os_thread *t)
+{
+    pthread_mutex_lock(&thread_arena_lock);
+    if (arena_owns(&thread_arena, t)) {
+        arena_free(&thread_arena, t);
+        t = NULL;
+    }
+    pthread_mutex_unlock(&thread_arena_lock);
+
+    free(t);
+}
+
 
 int os_thread_create(char *name, thread_func_t func, void *arg,
         struct os_thread **pt)
@@ -45,7 +85,7 @@ int os_thread_create(char *name, thread_func_t func, void *arg,
 
     INFO("Running %s app\n", name);
 
-    os_t = malloc(sizeof(*os_t));
+    os_t = os_thread_alloc();
     if (!os_t) {
         ERROR("Error allocating OS thread\n");
         rc = -ENOMEM;
@@ -69,7 +109,7 @@ int os_thread_create(char *name, thread_func_t func, void *arg,
 
 out:
     if (rc)
-        free(os_t);
+        os_thread_free(os_t);
 
     return rc;
 }
@@ -83,7 +123,7 @@ int os_thread_destroy(struct os_thread *t)
         goto out;
     }
 
-    free(t);
+    os_thread_free(t);
 out:
     return rc;
 }
@@ -92,3 +132,55 @@ int os_thread_wait(struct os_thread *t, void **thread_return)
 {
     return pthread_join(t->pthread, thread_return);
 }
+
+int os_thread_set_cpu(struct os_thread *t, int cpu)
+{
+#ifdef __Unikraft__
+    (void) t;
+    (void) cpu;
+    return -ENOTSUP;
+#else
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    return pthread_setaffinity_np(t->pthread, sizeof(set), &set);
+#endif
+}
+
+int os_cpus_num(void)
+{
+#ifdef __Unikraft__
+    return 1;
+#else
+    long n;
+
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (int) n : 1;
+#endif
+}
+
+int os_cpu_nth(int n)
+{
+#ifdef __Unikraft__
+    (void) n;
+    return 0;
+#else
+    cpu_set_t set;
+    int count, cpu;
+
+    /* -C restricts the set, pinning must not leave it */
+    if (sched_getaffinity(0, sizeof(set), &set) ||
+            !(count = CPU_COUNT(&set)))
+        return n % os_cpus_num();
+
+    n %= count;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set) && !n--)
+            break;
+    }
+
+    return cpu;
+#endif
+}
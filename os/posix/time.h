@@ -34,5 +34,6 @@
 #define APP_POSIX_TIME_H_
 
 #include <sys/time.h>
+#include <time.h>
 
 #endif /* APP_POSIX_TIME_H_ */
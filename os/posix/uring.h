@@ -0,0 +1,126 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Authors: Costin Lupu <costin.lupu@cs.pub.ro>
+ *
+ * Copyright (c) 2022, University Politehnica of Bucharest. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef APP_POSIX_URING_H_
+#define APP_POSIX_URING_H_
+
+/*
+ * Minimal io_uring wrapper on top of the raw system calls (no liburing).
+ *
+ * Only what the network backend needs is provided: submission/completion
+ * ring access, a submit-and-wait call bounded by a timeout and provided
+ * buffer rings. Multishot recv on buffer rings needs Linux 6.0 or newer.
+ */
+
+#include <linux/io_uring.h>
+
+struct os_uring {
+    int fd;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int *sq_array;
+    unsigned int sq_local_tail;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *ring;
+    size_t ring_size;
+    size_t sqes_size;
+};
+
+/* Provided buffer ring: the kernel picks a buffer for each receive */
+struct os_uring_bufs {
+    struct io_uring_buf_ring *br;
+    size_t br_size;
+    void *bufs;
+    int bgid;
+    int count;
+    int buf_size;
+    unsigned short tail;
+};
+
+int os_uring_init(struct os_uring *r, unsigned int entries);
+void os_uring_fini(struct os_uring *r);
+
+/* Returns a zeroed SQE, submitting the pending ones if the ring is full */
+struct io_uring_sqe *os_uring_get_sqe(struct os_uring *r);
+
+/*
+ * Submits the pending SQEs and waits for at least wait_nr completions or
+ * timeout_ms milliseconds (-1 waits forever). Returns 0, -ETIME on timeout
+ * or a negative errno.
+ */
+int os_uring_submit_and_wait(struct os_uring *r, unsigned int wait_nr,
+        int timeout_ms);
+
+static inline struct io_uring_cqe *os_uring_peek_cqe(struct os_uring *r)
+{
+    unsigned int head = *r->cq_head;
+
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    return &r->cqes[head & r->cq_mask];
+}
+
+static inline void os_uring_cqe_seen(struct os_uring *r)
+{
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int os_uring_bufs_init(struct os_uring *r, struct os_uring_bufs *b,
+        int bgid, int count, int buf_size);
+void os_uring_bufs_fini(struct os_uring *r, struct os_uring_bufs *b);
+
+static inline void *os_uring_buf(struct os_uring_bufs *b, int bid)
+{
+    return (char *) b->bufs + (size_t) bid * b->buf_size;
+}
+
+/* Hands a buffer back to the kernel */
+static inline void os_uring_buf_recycle(struct os_uring_bufs *b, int bid)
+{
+    struct io_uring_buf *buf;
+
+    buf = &b->br->bufs[b->tail & (b->count - 1)];
+    buf->addr = (unsigned long) os_uring_buf(b, bid);
+    buf->len = b->buf_size;
+    buf->bid = bid;
+    b->tail++;
+    __atomic_store_n(&b->br->tail, b->tail, __ATOMIC_RELEASE);
+}
+
+#endif /* APP_POSIX_URING_H_ */
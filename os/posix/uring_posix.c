@@ -0,0 +1,306 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Authors: Costin Lupu <costin.lupu@cs.pub.ro>
+ *
+ * Copyright (c) 2022, University Politehnica of Bucharest. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <common/log.h>
+#include <os/posix/uring.h>
+
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+        unsigned int min_complete, unsigned int flags, void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+            flags, arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode,
+        void *arg, unsigned int nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int os_uring_init(struct os_uring *r, unsigned int entries)
+{
+    struct io_uring_params p;
+    void *ptr;
+    int rc = 0;
+
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+
+    /* multishot receives complete far more often than we submit */
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = entries * 4;
+
+    r->fd = sys_io_uring_setup(entries, &p);
+    if (r->fd < 0 && errno == EINVAL) {
+        /* pre 5.19 kernel, COOP_TASKRUN is only an optimization */
+        p.flags &= ~IORING_SETUP_COOP_TASKRUN;
+        r->fd = sys_io_uring_setup(entries, &p);
+    }
+    if (r->fd < 0) {
+        rc = -errno;
+        DEBUG("Error calling io_uring_setup() errno=%d\n", errno);
+        goto out;
+    }
+
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(p.features & IORING_FEAT_EXT_ARG)) {
+        DEBUG("io_uring features missing features=0x%x\n", p.features);
+        rc = -ENOTSUP;
+        goto out;
+    }
+
+    /* with IORING_FEAT_SINGLE_MMAP both rings share one mapping */
+    r->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    if (p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) > r->ring_size)
+        r->ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    ptr = mmap(NULL, r->ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (ptr == MAP_FAILED) {
+        rc = -errno;
+        ERROR("Error mapping io_uring rings errno=%d\n", errno);
+        goto out;
+    }
+    r->ring = ptr;
+
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ptr = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (ptr == MAP_FAILED) {
+        rc = -errno;
+        ERROR("Error mapping io_uring SQEs errno=%d\n", errno);
+        goto out;
+    }
+    r->sqes = ptr;
+
+    r->sq_head = (unsigned int *) ((char *) r->ring + p.sq_off.head);
+    r->sq_tail = (unsigned int *) ((char *) r->ring + p.sq_off.tail);
+    r->sq_mask = *(unsigned int *) ((char *) r->ring + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sq_array = (unsigned int *) ((char *) r->ring + p.sq_off.array);
+    r->sq_local_tail = *r->sq_tail;
+
+    r->cq_head = (unsigned int *) ((char *) r->ring + p.cq_off.head);
+    r->cq_tail = (unsigned int *) ((char *) r->ring + p.cq_off.tail);
+    r->cq_mask = *(unsigned int *) ((char *) r->ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) ((char *) r->ring + p.cq_off.cqes);
+
+out:
+    if (rc)
+        os_uring_fini(r);
+    return rc;
+}
+
+void os_uring_fini(struct os_uring *r)
+{
+    if (r->sqes) {
+        munmap(r->sqes, r->sqes_size);
+        r->sqes = NULL;
+    }
+    if (r->ring) {
+        munmap(r->ring, r->ring_size);
+        r->ring = NULL;
+    }
+    if (r->fd >= 0) {
+        close(r->fd);
+        r->fd = -1;
+    }
+}
+
+static unsigned int os_uring_flush_sq(struct os_uring *r)
+{
+    unsigned int tail = *r->sq_tail;
+    unsigned int pending = r->sq_local_tail - tail;
+
+    if (pending)
+        __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+
+    return pending;
+}
+
+static int os_uring_enter(struct os_uring *r, unsigned int wait_nr,
+        int timeout_ms)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned int to_submit, flags = 0;
+    int rc;
+
+    to_submit = os_uring_flush_sq(r);
+
+    memset(&arg, 0, sizeof(arg));
+    if (wait_nr) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+            arg.ts = (unsigned long) &ts;
+        }
+    }
+    flags |= IORING_ENTER_EXT_ARG;
+
+    rc = sys_io_uring_enter(r->fd, to_submit, wait_nr, flags,
+            &arg, sizeof(arg));
+    if (rc < 0)
+        rc = -errno;
+    else
+        rc = 0;
+
+    return rc;
+}
+
+struct io_uring_sqe *os_uring_get_sqe(struct os_uring *r)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int idx;
+    int rc;
+
+    while (r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >=
+            r->sq_entries) {
+        rc = os_uring_enter(r, 0, 0);
+        if (rc < 0 && rc != -EINTR && rc != -EBUSY && rc != -EAGAIN)
+            return NULL;
+    }
+
+    idx = r->sq_local_tail & r->sq_mask;
+    r->sq_array[idx] = idx;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_local_tail++;
+
+    return sqe;
+}
+
+int os_uring_submit_and_wait(struct os_uring *r, unsigned int wait_nr,
+        int timeout_ms)
+{
+    int rc;
+
+    /* nothing to wait for if completions are already there */
+    if (wait_nr && os_uring_peek_cqe(r))
+        wait_nr = 0;
+
+    rc = os_uring_enter(r, wait_nr, timeout_ms);
+    if (rc == -EINTR)
+        rc = 0;
+
+    return rc;
+}
+
+int os_uring_bufs_init(struct os_uring *r, struct os_uring_bufs *b,
+        int bgid, int count, int buf_size)
+{
+    struct io_uring_buf_reg reg;
+    int rc = 0;
+
+    memset(b, 0, sizeof(*b));
+
+    if (count <= 0 || (count & (count - 1)) || count > 32768) {
+        rc = -EINVAL;
+        goto out;
+    }
+
+    b->bgid = bgid;
+    b->count = count;
+    b->buf_size = buf_size;
+
+    /* the ring must be page aligned */
+    b->br_size = count * sizeof(struct io_uring_buf);
+    b->br = mmap(NULL, b->br_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b->br == MAP_FAILED) {
+        b->br = NULL;
+        rc = -errno;
+        ERROR("Error allocating buffer ring errno=%d\n", errno);
+        goto out;
+    }
+
+    b->bufs = malloc((size_t) count * buf_size);
+    if (!b->bufs) {
+        ERROR("Error allocating ring buffers\n");
+        rc = -ENOMEM;
+        goto out;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long) b->br;
+    reg.ring_entries = count;
+    reg.bgid = bgid;
+
+    rc = sys_io_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1);
+    if (rc < 0) {
+        rc = -errno;
+        DEBUG("Error registering buffer ring errno=%d\n", errno);
+        goto out;
+    }
+
+    for (int i = 0; i < count; i++)
+        os_uring_buf_recycle(b, i);
+
+out:
+    if (rc)
+        os_uring_bufs_fini(NULL, b);
+    return rc;
+}
+
+void os_uring_bufs_fini(struct os_uring *r, struct os_uring_bufs *b)
+{
+    struct io_uring_buf_reg reg;
+
+    if (r && r->fd >= 0 && b->br) {
+        memset(&reg, 0, sizeof(reg));
+        reg.bgid = b->bgid;
+        sys_io_uring_register(r->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    }
+    if (b->bufs) {
+        free(b->bufs);
+        b->bufs = NULL;
+    }
+    if (b->br) {
+        munmap(b->br, b->br_size);
+        b->br = NULL;
+    }
+}
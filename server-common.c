@@ -30,90 +30,338 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <common/cfg.h>
+#if CFG_SERVER_WORKERS
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#endif
 #include <common/log.h>
 #include <common/cmdline.h>
 #include <common/boot.h>
 #include <common/time.h>
 #include <common/net.h>
 #include <common/clone.h>
+#include <common/bufpool.h>
+#include <common/histogram.h>
 #include <server-common.h>
 
 
-static int fork_prologue(struct mysocket *mysock, unsigned short myport,
-        int *is_child)
+void server_report_histogram(const struct histogram *h, const char *name)
 {
-    pid_t pid = -1;
+    char path[256];
+
+    histogram_print(h, name);
+
+    if (hist_dump_prefix) {
+        snprintf(path, sizeof(path), "%s%s.hist", hist_dump_prefix, name);
+        histogram_dump(h, path);
+    }
+}
+
+/* In a child, how long its fork took as seen from the child */
+static uint64_t fork_child_nsec;
+
+/*
+ * Children are numbered 1..children_num and laid out as a fanout-ary tree
+ * rooted at the parent (node 0): node n forks nodes n*fanout+1 ..
+ * n*fanout+fanout. The linear mode is the tree with fanout children_num,
+ * i.e. the parent forks everybody.
+ */
+static int fork_one(struct mysocket *mysock, unsigned short myport, int node,
+        pid_t *ppid)
+{
+    pid_t pid;
     struct timeval tv_before, tv_after, res;
+    uint64_t start_nsec;
     char suffix[32];
     int rc;
 
-    for (int i = 0; i < children_num; i++) {
-        myport -= 1;
+    rc = gettimeofday(&tv_before, NULL);
+    if (rc) {
+        ERROR("Error gettimeofday() rc=%d\n", rc);
+        goto out;
+    }
 
-        rc = gettimeofday(&tv_before, NULL);
-        if (rc) {
-            ERROR("Error gettimeofday() rc=%d\n", rc);
-            goto out;
+    start_nsec = os_now_nsec();
+    pid = fork();
+    if (pid < 0) {
+        rc = -errno;
+        ERROR("Error fork() pid=%d\n", pid);
+        goto out;
+    }
+    if (pid == 0)
+        fork_child_nsec = os_now_nsec() - start_nsec;
+
+    rc = gettimeofday(&tv_after, NULL);
+    if (rc) {
+        ERROR("Error gettimeofday() rc=%d\n", rc);
+        goto out;
+    }
+
+    timersub(&tv_after, &tv_before, &res);
+    INFO("%lu.%6.6lu\n", res.tv_sec, res.tv_usec);
+
+    if (do_send_time) {
+        if (pid > 0) /* parent */
+            sprintf(suffix, "parent;%d", node - 1);
+
+        else if (pid == 0) { /* child */
+            rc = mysocket_fini(mysock);
+            if (rc) {
+                ERROR("Error mysocket_fini() rc=%d\n", rc);
+                goto out;
+            }
+            rc = mysocket_init(mysock, SOCK_DGRAM, myport - node);
+            if (rc) {
+                ERROR("Error mysocket_init() rc=%d\n", rc);
+                goto out;
+            }
+
+            sprintf(suffix, "child;%d", node - 1);
         }
+        send_time(mysock, &res, suffix);
+    }
+
+    *ppid = pid;
+out:
+    return rc;
+}
+
+/* Set in the children forked by the helper, to their node number */
+static int fork_helper_node;
+static int fork_helper_cmd = -1;
+static pid_t fork_helper_pid;
+
+/*
+ * Every child writes its fork latency once it is up, the parent collects
+ * them; writes this small are atomic on pipes.
+ */
+static int fork_ready[2] = { -1, -1 };
+
+static void fork_ready_signal(void)
+{
+    if (write(fork_ready[1], &fork_child_nsec, sizeof(fork_child_nsec)) !=
+            sizeof(fork_child_nsec))
+        ERROR("Error signaling readiness errno=%d\n", errno);
+    close(fork_ready[0]);
+    close(fork_ready[1]);
+}
+
+static struct histogram fork_hist;
+
+static int fork_ready_wait(struct timeval *tv_start)
+{
+    struct timeval tv_now, res;
+    uint64_t lat[32];
+    int ready = 0, n, len = 0;
+
+    histogram_init(&fork_hist);
+
+    /* only the children hold the write end from now on */
+    close(fork_ready[1]);
+
+    while (ready < children_num) {
+        n = read(fork_ready[0], (char *) lat + len, sizeof(lat) - len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        len += n;
+
+        for (n = 0; n < len / (int) sizeof(*lat); n++)
+            histogram_record(&fork_hist, lat[n]);
+        ready += n;
+
+        /* keep a partial record for the next read */
+        memmove(lat, lat + n, len - n * sizeof(*lat));
+        len -= n * sizeof(*lat);
+    }
+    close(fork_ready[0]);
+
+    gettimeofday(&tv_now, NULL);
+    timersub(&tv_now, tv_start, &res);
+
+    fprintf(stderr, "FORK_TRACE mode=%s fanout=%d children=%d ready=%d "
+        "time=%lu.%6.6lu\n", fork_mode_to_string(fork_mode),
+        fork_mode == FORK_MODE_TREE ? fork_fanout : children_num,
+        children_num, ready, res.tv_sec, res.tv_usec);
+
+    server_report_histogram(&fork_hist, "fork");
+
+    return ready == children_num ? 0 : -ECHILD;
+}
+
+/*
+ * The helper is forked early by main(), before the app maps its memory, and
+ * then forks the children when fork_prologue() asks. Its children return
+ * from here and run main() on their own.
+ */
+int server_fork_helper_start(void)
+{
+    int cmd[2], num, rc = 0;
+    pid_t pid;
+
+    if (!do_fork || fork_mode != FORK_MODE_HELPER)
+        goto out;
+
+    rc = pipe(cmd);
+    if (rc) {
+        rc = -errno;
+        ERROR("Error calling pipe() errno=%d\n", errno);
+        goto out;
+    }
+    rc = pipe(fork_ready);
+    if (rc) {
+        rc = -errno;
+        ERROR("Error calling pipe() errno=%d\n", errno);
+        close(cmd[0]);
+        close(cmd[1]);
+        goto out;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        rc = -errno;
+        ERROR("Error fork() pid=%d\n", pid);
+        goto out;
+    }
+
+    if (pid > 0) {
+        close(cmd[0]);
+        fork_helper_cmd = cmd[1];
+        fork_helper_pid = pid;
+        goto out;
+    }
+
+    /* helper */
+    close(cmd[1]);
+    if (read(cmd[0], &num, sizeof(num)) != sizeof(num))
+        /* the parent exited early */
+        _exit(0);
+
+    for (int node = 1; node <= num; node++) {
+        uint64_t start_nsec = os_now_nsec();
 
         pid = fork();
+        if (pid == 0) {
+            fork_child_nsec = os_now_nsec() - start_nsec;
+            close(cmd[0]);
+            fork_helper_node = node;
+            goto out;
+        }
         if (pid < 0) {
             ERROR("Error fork() pid=%d\n", pid);
-            goto out;
+            break;
         }
+    }
+    _exit(0);
 
-        rc = gettimeofday(&tv_after, NULL);
-        if (rc) {
-            ERROR("Error gettimeofday() rc=%d\n", rc);
-            goto out;
-        }
+out:
+    return rc;
+}
 
-        timersub(&tv_after, &tv_before, &res);
-        INFO("%lu.%6.6lu\n", res.tv_sec, res.tv_usec);
+static int fork_helper_prologue(struct timeval *tv_start)
+{
+    int rc;
+
+    rc = write(fork_helper_cmd, &children_num, sizeof(children_num));
+    close(fork_helper_cmd);
+    if (rc != sizeof(children_num)) {
+        ERROR("Error waking up the fork helper errno=%d\n", errno);
+        return -EIO;
+    }
+
+    rc = fork_ready_wait(tv_start);
+    waitpid(fork_helper_pid, NULL, 0);
+
+    return rc;
+}
+
+static int fork_prologue(struct mysocket *mysock, unsigned short myport,
+        int *is_child)
+{
+    struct timeval tv_start;
+    long first, last, node = 0, fanout;
+    char suffix[32];
+    pid_t pid = -1;
+    int rc = 0;
 
+    if (fork_helper_node) {
+        /* forked by the helper */
         if (do_send_time) {
-            if (pid > 0) /* parent */
-                sprintf(suffix, "parent;%d", i);
-
-            else if (pid == 0) { /* child */
-                rc = mysocket_fini(mysock);
-                if (rc) {
-                    ERROR("Error mysocket_fini() rc=%d\n", rc);
-                    goto out;
-                }
-                rc = mysocket_init(mysock, SOCK_DGRAM, myport);
-                if (rc) {
-                    ERROR("Error mysocket_init() rc=%d\n", rc);
-                    goto out;
-                }
-
-                sprintf(suffix, "child;%d", i);
+            rc = mysocket_init(mysock, SOCK_DGRAM, myport - fork_helper_node);
+            if (rc) {
+                ERROR("Error mysocket_init() rc=%d\n", rc);
+                goto out;
             }
-///            if (pid == 0)
-            ///            if (pid == 0)
-            send_time(mysock, &res, suffix);
+            sprintf(suffix, "child;%d", fork_helper_node - 1);
+            send_time(mysock, NULL, suffix);
         }
+        goto out_ready;
+    }
+
+    gettimeofday(&tv_start, NULL);
+
+    if (fork_mode == FORK_MODE_HELPER) {
+        rc = fork_helper_prologue(&tv_start);
+        goto out;
+    }
 
-        if (pid == 0)
+    rc = pipe(fork_ready);
+    if (rc) {
+        rc = -errno;
+        ERROR("Error calling pipe() errno=%d\n", errno);
+        goto out;
+    }
+
+    fanout = fork_mode == FORK_MODE_TREE ? fork_fanout : children_num;
+
+    /* a child goes on with forking its own subtree */
+    while (1) {
+        first = node * fanout + 1;
+        last = node * fanout + fanout;
+        if (last > children_num)
+            last = children_num;
+
+        for (; first <= last; first++) {
+            rc = fork_one(mysock, myport, first, &pid);
+            if (rc)
+                goto out;
+            if (pid == 0)
+                break;
+        }
+        if (first > last)
             break;
+        node = first;
+    }
 
-//            INFO("sleep_between_clones_msec=%d", sleep_between_clones_msec);
-//            os_sleep_msec(sleep_between_clones_msec);
+    if (node == 0) {
+        rc = fork_ready_wait(&tv_start);
+        goto out;
     }
 
-    if (is_child)
-        *is_child = (pid == 0);
+out_ready:
+    fork_ready_signal();
 out:
+    /* inner tree nodes forked their own children, pid is the last one's */
+    if (is_child)
+        *is_child = node != 0 || fork_helper_node;
     return rc;
 }
 
 static int clone_prologue(struct mysocket *mysock, unsigned short myport,
         int *is_child)
 {
+    static struct histogram clone_hist;
     unsigned int myparentid, myid, index;
     struct timeval tv_before, tv_after, res;
+    uint64_t start_nsec, clone_nsec;
     char suffix[32];
     int rc, rc_clone;
 
@@ -125,7 +373,9 @@ static int clone_prologue(struct mysocket *mysock, unsigned short myport,
         goto out;
     }
 
+    start_nsec = os_now_nsec();
     rc = os_clone(children_num);
+    clone_nsec = os_now_nsec() - start_nsec;
     if (!(rc >= 0)) {
         ERROR("Error myclone() rc=%d\n", rc);
         goto out;
@@ -133,6 +383,13 @@ static int clone_prologue(struct mysocket *mysock, unsigned short myport,
     INFO("rc=%d\n", rc);
     rc_clone = rc;
 
+    if (rc_clone == 0) {
+        /* one sample per batch, runs add up by merging the dumps */
+        histogram_init(&clone_hist);
+        histogram_record(&clone_hist, clone_nsec);
+        server_report_histogram(&clone_hist, "clone");
+    }
+
     rc = gettimeofday(&tv_after, NULL);
     if (rc) {
         ERROR("Error gettimeofday() rc=%d\n", rc);
@@ -217,6 +474,10 @@ int server_prologue(int *is_child)
     if (do_send_time) {
         myport = PORT_PARENT;
 
+        /* the helper's children have a port of their own */
+        if (fork_helper_node)
+            goto out_fork;
+
         rc = mysocket_init(&su, SOCK_DGRAM, myport);
         if (rc) {
             ERROR("Error mysocket_init() rc=%d\n", rc);
@@ -230,6 +491,7 @@ int server_prologue(int *is_child)
         }
     }
 
+out_fork:
     if (do_fork) {
         rc = fork_prologue(&su, myport, is_child);
         if (rc) {
@@ -255,3 +517,153 @@ int server_prologue(int *is_child)
 out:
     return rc;
 }
+
+#if CFG_SERVER_WORKERS
+static void *server_worker_thread(void *p)
+{
+    struct server_worker *w = p;
+    long rc;
+
+    rc = w->fn(w);
+    bufpool_thread_flush();
+    if (rc && !w->stop) {
+        ERROR("Worker %u failed rc=%ld, stopping\n", w->id, rc);
+        kill(getpid(), SIGTERM);
+    }
+
+    return (void *) rc;
+}
+
+static void server_worker_stop(struct server_worker *w)
+{
+    struct tcp_server_loop *loop;
+
+    /* the worker publishes its loop then checks stop, so one of us sees it */
+    __atomic_store_n(&w->stop, 1, __ATOMIC_SEQ_CST);
+    loop = __atomic_load_n(&w->loop, __ATOMIC_SEQ_CST);
+    if (loop)
+        tcp_server_loop_stop(loop);
+    if (w->sock)
+        /* wakes up the worker blocked in recv() */
+        shutdown(w->sock->s, SHUT_RDWR);
+}
+
+static void server_workers_print_stats(struct server_worker *workers,
+        int num, double sec)
+{
+    struct server_worker *w;
+    struct net_stats total;
+
+    memset(&total, 0, sizeof(total));
+
+    for (int i = 0; i < num; i++) {
+        w = &workers[i];
+        fprintf(stderr, "WORKER_TRACE worker=%u cpu=%d conns=%lu recvs=%lu "
+            "bytes_rx=%lu bytes_tx=%lu recvs/s=%.0lf\n",
+            w->id, w->cpu, w->stats.conns, w->stats.recvs,
+            w->stats.bytes_rx, w->stats.bytes_tx, w->stats.recvs / sec);
+
+        total.conns += w->stats.conns;
+        total.recvs += w->stats.recvs;
+        total.bytes_rx += w->stats.bytes_rx;
+        total.bytes_tx += w->stats.bytes_tx;
+    }
+
+    fprintf(stderr, "WORKER_TRACE total workers=%d duration=%.3lf conns=%lu "
+        "recvs=%lu bytes_rx=%lu bytes_tx=%lu recvs/s=%.0lf\n",
+        num, sec, total.conns, total.recvs,
+        total.bytes_rx, total.bytes_tx, total.recvs / sec);
+}
+
+int server_run_workers(const char *name, server_worker_fn_t fn, void *priv)
+{
+    struct server_worker *workers, *w;
+    struct timespec ts_start, ts_stop;
+    char thread_name[32];
+    sigset_t set;
+    void *ret;
+    int sig, started = 0, rc;
+
+    /* the workers inherit the mask, signals are only taken by sigwait() */
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    rc = pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (rc) {
+        ERROR("Error calling pthread_sigmask() rc=%d\n", rc);
+        goto out;
+    }
+
+    rc = posix_memalign((void **) &workers, sizeof(*workers),
+            workers_num * sizeof(*workers));
+    if (rc) {
+        ERROR("Error allocating workers\n");
+        rc = -ENOMEM;
+        goto out;
+    }
+    memset(workers, 0, workers_num * sizeof(*workers));
+
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    for (started = 0; started < workers_num; started++) {
+        w = &workers[started];
+        w->id = started;
+        w->cpu = os_cpu_nth(started);
+        w->fn = fn;
+        w->priv = priv;
+
+        /* thread names are limited to 15 characters */
+        snprintf(thread_name, sizeof(thread_name), "%.10s-%u", name, w->id);
+        thread_name[15] = '\0';
+        rc = os_thread_create(thread_name, server_worker_thread, w,
+                &w->thread);
+        if (rc) {
+            ERROR("Error os_thread_create() rc=%d\n", rc);
+            goto out_stop;
+        }
+
+        rc = os_thread_set_cpu(w->thread, w->cpu);
+        if (rc)
+            ERROR("Could not pin worker %u to CPU %d rc=%d\n",
+                w->id, w->cpu, rc);
+    }
+    INFO("Started %d workers\n", workers_num);
+
+    rc = sigwait(&set, &sig);
+    if (rc)
+        ERROR("Error calling sigwait() rc=%d\n", rc);
+    else
+        INFO("Stopping workers (signal %d)\n", sig);
+
+out_stop:
+    clock_gettime(CLOCK_MONOTONIC, &ts_stop);
+
+    for (int i = 0; i < started; i++)
+        server_worker_stop(&workers[i]);
+
+    for (int i = 0; i < started; i++) {
+        os_thread_wait(workers[i].thread, &ret);
+        os_thread_destroy(workers[i].thread);
+    }
+
+    server_workers_print_stats(workers, started,
+        (ts_stop.tv_sec - ts_start.tv_sec) +
+        (ts_stop.tv_nsec - ts_start.tv_nsec) / 1e9);
+
+    free(workers);
+out:
+    return rc;
+}
+
+#else
+
+int server_run_workers(const char *name, server_worker_fn_t fn, void *priv)
+{
+    (void) name;
+    (void) fn;
+    (void) priv;
+
+    ERROR("Worker mode not supported\n");
+    return -ENOTSUP;
+}
+#endif
@@ -30,6 +30,46 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifndef SERVER_COMMON_H_
+#define SERVER_COMMON_H_
+
+#include <common/cfg.h>
+#include <common/net.h>
+#include <common/thread.h>
+#include <common/histogram.h>
+
 #define PORT_PARENT 32767
 
 int server_prologue(int *is_child);
+
+/* Prints the histogram, and dumps it to <prefix><name>.hist with -H */
+void server_report_histogram(const struct histogram *h, const char *name);
+
+/* -f -F helper: forks the fork helper, call before the app allocates memory */
+int server_fork_helper_start(void);
+
+/*
+ * Worker mode (-w N): N threads, each serving its own SO_REUSEPORT socket on
+ * the same port and pinned to CPU (id % online CPUs). The workers run until
+ * SIGINT/SIGTERM, then their stats are reported per worker and aggregated.
+ */
+struct server_worker {
+    unsigned int id;
+    int cpu;
+    struct os_thread *thread;
+    long (*fn)(struct server_worker *w);
+    void *priv;
+
+    /* set by the worker so that it can be stopped */
+    struct tcp_server_loop *volatile loop;
+    struct mysocket *volatile sock;
+    volatile int stop;
+
+    struct net_stats stats;
+} __attribute__((aligned(64)));
+
+typedef long (*server_worker_fn_t)(struct server_worker *w);
+
+int server_run_workers(const char *name, server_worker_fn_t fn, void *priv);
+
+#endif /* SERVER_COMMON_H_ */
@@ -31,59 +31,84 @@
  */
 
 #include <common/log.h>
+#include <common/cmdline.h>
 #include <common/net.h>
 #include <server-common.h>
 
 
-void *thread_func_server_tcp(void *p)
+static int server_tcp_conn_recv(struct tcp_server_loop *loop,
+        struct tcp_conn *conn)
 {
-    struct os_server server;
-    struct net_msg msg;
-    long rc = -1;
+    (void) loop;
 
-    (void) p;
+    /* discard everything, the client closes the connection */
+    tcp_conn_consume(conn, conn->rx_len);
+    return TCP_CONN_KEEP;
+}
 
-    rc = server_prologue(NULL);
-    if (rc) {
-        ERROR("Error server_prologue() rc=%ld\n", rc);
-        goto out;
-    }
+static const struct tcp_server_loop_ops server_tcp_ops = {
+    .conn_recv = server_tcp_conn_recv,
+};
 
-    rc = tcp_server_start(&server, DEFAULT_SERVER_PORT);
+static long server_tcp_serve(struct server_worker *w)
+{
+    struct os_server server;
+    struct tcp_server_loop loop;
+    long rc;
+
+    rc = tcp_server_start_flags(&server, DEFAULT_SERVER_PORT,
+            w ? MYSOCKET_REUSEPORT : 0);
     if (rc) {
         ERROR("Error tcp_server_start() rc=%ld\n", rc);
         goto out;
     }
     INFO("Listening....\n");
 
-    /* TODO try fork() here */
+    rc = tcp_server_loop_init(&loop, &server, &server_tcp_ops, NULL);
+    if (rc) {
+        ERROR("Error tcp_server_loop_init() rc=%ld\n", rc);
+        goto out_server_stop;
+    }
 
-    while (1) {
-        rc = tcp_server_accept(&server, &msg);
-        if (rc) {
-            ERROR("Error tcp_server_accept() rc=%ld\n", rc);
-            goto out_server_stop;
-        }
-
-        while (1) {
-            rc = tcp_server_recv_msg(&msg);
-            if (rc == 0)
-                break;
-            if (rc < 0) {
-                ERROR("Error tcp_server_recv_msg() rc=%ld\n", rc);
-                break;
-            }
-        }
-
-        net_msg_cleanup(&msg);
-        if (rc < 0)
-            break;
+    if (w)
+        __atomic_store_n(&w->loop, &loop, __ATOMIC_SEQ_CST);
+    if (!w || !__atomic_load_n(&w->stop, __ATOMIC_SEQ_CST)) {
+        rc = tcp_server_loop_run(&loop);
+        if (rc)
+            ERROR("Error tcp_server_loop_run() rc=%ld\n", rc);
+    }
+    if (w) {
+        w->loop = NULL;
+        w->stats = loop.stats;
     }
 
+    tcp_server_loop_fini(&loop);
 out_server_stop:
     tcp_server_stop(&server);
+out:
+    return rc;
+}
+
+void *thread_func_server_tcp(void *p)
+{
+    long rc = -1;
+
+    (void) p;
+
+    rc = server_prologue(NULL);
+    if (rc) {
+        ERROR("Error server_prologue() rc=%ld\n", rc);
+        goto out;
+    }
+
+    /* TODO try fork() here */
+
+    if (workers_num)
+        rc = server_run_workers(APP_NAME_SERVER_TCP, server_tcp_serve, NULL);
+    else
+        rc = server_tcp_serve(NULL);
+
 out:
     INFO("Exiting\n");
     return (void *) rc;
 }
-
@@ -32,57 +32,107 @@
 
 #include <string.h>
 #include <common/log.h>
+#include <common/cmdline.h>
 #include <common/net.h>
 #include <server-common.h>
 
 
-void *thread_func_server_udp(void *p)
+static long server_udp_serve(struct server_worker *w)
 {
     struct mysocket listener;
     struct sockaddr_in prev_client_addr;
     unsigned short prev_client_port = 0;
-    struct net_msg msg;
+    struct udp_batch batch;
+    struct net_msg *msg;
     long rc = -1;
 
-    (void) p;
-
-    rc = server_prologue(NULL);
+    rc = udp_batch_init(&batch, UDP_BATCH_MAX);
     if (rc) {
-        ERROR("Error server_prologue() rc=%ld\n", rc);
+        ERROR("Error udp_batch_init() rc=%ld\n", rc);
         goto out;
     }
 
-    rc = udp_server_start(&listener, DEFAULT_SERVER_PORT);
+    rc = udp_server_start_flags(&listener, DEFAULT_SERVER_PORT,
+            w ? MYSOCKET_REUSEPORT : 0);
     if (rc) {
         ERROR("Error udp_server_start() rc=%ld\n", rc);
-        goto out;
+        goto out_batch_fini;
     }
     INFO("Listening....\n");
 
-    /* TODO try fork() here */
-
-    while (1) {
-        memset(&msg, 0, sizeof(msg));
-        msg.connection = -1;
+    if (w)
+        w->sock = &listener;
 
-        rc = udp_server_recv_msg(&listener, &msg);
+    while (!w || !w->stop) {
+        rc = udp_server_recv_batch(&listener, &batch);
+        if (w && w->stop) {
+            rc = 0;
+            break;
+        }
         if (rc < 0) {
-            ERROR("Error udp_server_recv_msg() rc=%ld\n", rc);
-            goto out;
+            ERROR("Error udp_server_recv_batch() rc=%ld\n", rc);
+            break;
         }
 
-        if (msg.client_addr.sin_port != prev_client_port ||
-            memcmp(&prev_client_addr, &msg.client_addr, sizeof(msg.client_addr))) {
-            /* new client */
-            INFO("Connection accepted from %s:%d\n",
-                inet_ntoa(msg.client_addr.sin_addr), ntohs(msg.client_addr.sin_port));
-            prev_client_addr = msg.client_addr;
-            prev_client_port = msg.client_addr.sin_port;
+        for (int i = 0; i < batch.count; i++) {
+            msg = &batch.msgs[i];
+
+            if (w) {
+                w->stats.recvs++;
+                w->stats.bytes_rx += msg->netbuf_size;
+                if (do_echo)
+                    w->stats.bytes_tx += msg->netbuf_size;
+            }
+
+            if (msg->client_addr.sin_port != prev_client_port ||
+                memcmp(&prev_client_addr, &msg->client_addr, sizeof(msg->client_addr))) {
+                /* new client */
+                INFO("Connection accepted from %s:%d\n",
+                    inet_ntoa(msg->client_addr.sin_addr), ntohs(msg->client_addr.sin_port));
+                prev_client_addr = msg->client_addr;
+                prev_client_port = msg->client_addr.sin_port;
+                if (w)
+                    w->stats.conns++;
+            }
         }
 
-        net_msg_cleanup(&msg);
+        if (do_echo) {
+            rc = udp_server_send_batch(&listener, &batch);
+            if (rc < 0) {
+                ERROR("Error udp_server_send_batch() rc=%ld\n", rc);
+                break;
+            }
+        }
+    }
+
+    if (w)
+        w->sock = NULL;
+    mysocket_fini(&listener);
+out_batch_fini:
+    udp_batch_fini(&batch);
+out:
+    return rc;
+}
+
+void *thread_func_server_udp(void *p)
+{
+    long rc = -1;
+
+    (void) p;
+
+    rc = server_prologue(NULL);
+    if (rc) {
+        ERROR("Error server_prologue() rc=%ld\n", rc);
+        goto out;
     }
 
+    /* TODO try fork() here */
+
+    if (workers_num)
+        rc = server_run_workers(APP_NAME_SERVER_UDP, server_udp_serve, NULL);
+    else
+        rc = server_udp_serve(NULL);
+
 out:
     INFO("Exiting\n");
     return (void *) rc;
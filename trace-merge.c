@@ -0,0 +1,132 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Authors: Costin Lupu <costin.lupu@cs.pub.ro>
+ *
+ * Copyright (c) 2022, University Politehnica of Bucharest. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Merges the per-process span files written with -T into one Chrome Trace
+ * Event JSON, which Perfetto and chrome://tracing open directly:
+ *
+ *   trace-merge [-o trace.json] run.*.json
+ *
+ * The input files hold one event per line, as written by common/profile.c.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LINE_MAX_LEN    4096
+
+
+static void usage(const char *cmd)
+{
+    fprintf(stderr, "Usage: %s [-o OUT] FILE...\n", cmd);
+}
+
+static int merge_file(FILE *out, const char *path, unsigned long *events)
+{
+    char line[LINE_MAX_LEN], *ev;
+    size_t len;
+    FILE *in;
+    int rc = 0;
+
+    in = fopen(path, "r");
+    if (!in) {
+        fprintf(stderr, "error: Could not open %s\n", path);
+        rc = 1;
+        goto out;
+    }
+
+    while (fgets(line, sizeof(line), in)) {
+        /* the separators and the array brackets are ours to write */
+        len = strcspn(line, "\r\n");
+        while (len && line[len - 1] == ',')
+            len--;
+        line[len] = '\0';
+
+        ev = line + (line[0] == ',');
+        if (ev[0] != '{')
+            continue;
+
+        fprintf(out, "%s\n%s", *events ? "," : "", ev);
+        (*events)++;
+    }
+
+    fclose(in);
+out:
+    return rc;
+}
+
+int main(int argc, char **argv)
+{
+    const char *out_path = NULL;
+    unsigned long events = 0;
+    FILE *out = stdout;
+    int opt, rc = 0;
+
+    while ((opt = getopt(argc, argv, "o:h")) != -1) {
+        switch (opt) {
+        case 'o':
+            out_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            rc = opt != 'h';
+            goto out;
+        }
+    }
+
+    if (optind == argc) {
+        usage(argv[0]);
+        rc = 1;
+        goto out;
+    }
+
+    if (out_path) {
+        out = fopen(out_path, "w");
+        if (!out) {
+            fprintf(stderr, "error: Could not open %s\n", out_path);
+            rc = 1;
+            goto out;
+        }
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (int i = optind; i < argc && !rc; i++)
+        rc = merge_file(out, argv[i], &events);
+    fprintf(out, "\n]}\n");
+
+    if (out != stdout)
+        fclose(out);
+    fprintf(stderr, "%lu events from %d files\n", events, argc - optind);
+out:
+    return rc;
+}